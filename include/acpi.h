@@ -0,0 +1,8 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "kernel.h"
+
+u32 acpi_find_cpus(u32* apic_ids, u32 max, u32* lapic_base);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include "kernel.h"
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+// Interrupt vectors delivered by the local APIC, above the remapped PIC
+#define APIC_TIMER_VECTOR    48
+#define APIC_RESCHED_VECTOR  49
+#define APIC_SPURIOUS_VECTOR 255
+
+bool lapic_init(u32 phys_base);
+void lapic_enable(void);
+u32 lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_init(u32 apic_id);
+void lapic_send_startup(u32 apic_id, u32 page);
+void lapic_send_ipi(u32 apic_id, u32 vector);
+void lapic_timer_start(u32 hz);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "kernel.h"
+
+// Output devices, any combination
+#define CONSOLE_VGA    0x01
+#define CONSOLE_SERIAL 0x02
+
+void console_init(void);
+void console_write(const char* buf, size_t len);
+void console_flush(void);
+void console_home(void);
+u32 console_get_outputs(void);
+void console_set_outputs(u32 outputs);
+
+#endif
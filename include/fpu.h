@@ -0,0 +1,35 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include "kernel.h"
+#include "smp.h"
+
+// x87/SSE register state as stored by fxsave (or fnsave without FXSR)
+typedef struct fpu_state {
+    u8 data[512];
+} __attribute__((aligned(16))) fpu_state_t;
+
+void fpu_init(void);
+void fpu_init_cpu(void);
+bool fpu_sse_enabled(void);
+void fpu_save_owner(cpu_t* cpu);
+bool fpu_fork(process_t* parent, process_t* child);
+void fpu_exit(process_t* proc);
+void fpu_free(process_t* proc);
+
+// The kernel uses the FPU only between these, with interrupts off. The
+// current process's registers are saved first and reloaded on its next
+// use, so it is safe from any context.
+u32 kernel_fpu_begin(void);
+void kernel_fpu_end(u32 flags);
+
+// Called on switching away from prev. A process that used the FPU this
+// time round has its registers saved; others pay only the test.
+static inline void fpu_switch(process_t* prev) {
+    cpu_t* cpu = this_cpu();
+    if (cpu->fpu_owner == prev) {
+        fpu_save_owner(cpu);
+    }
+}
+
+#endif
@@ -15,7 +15,7 @@ typedef struct {
 } file_entry_t;
 
 typedef struct {
-    file_entry_t files[FS_MAX_FILES];
+    file_entry_t* files[FS_MAX_FILES];
     u32 total_blocks;
     u32 free_blocks;
     bool initialized;
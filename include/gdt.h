@@ -1,6 +1,32 @@
 #ifndef GDT_H
 #define GDT_H
 
+#include "kernel.h"
+
+#define GDT_ENTRIES 8
+
+// Selectors
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_TSS         0x28
+#define GDT_PERCPU      0x30  // Loaded into %gs, based at the CPU's cpu_t
+#define GDT_DF_TSS      0x38  // Double fault task
+
+#define DF_STACK_SIZE 4096
+
+// 32-bit task state segment. Only esp0/ss0 matter until there is user mode.
+typedef struct {
+    u32 prev_tss;
+    u32 esp0, ss0, esp1, ss1, esp2, ss2;
+    u32 cr3, eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    u32 es, cs, ss, ds, fs, gs, ldt;
+    u16 trap, iomap_base;
+} __attribute__((packed)) tss_t;
+
+struct cpu;
+
 void init_gdt(void);
+void gdt_init_cpu(struct cpu* cpu);
+void gdt_init_double_fault(struct cpu* cpu);
 
 #endif
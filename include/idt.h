@@ -5,18 +5,32 @@
 
 #define IRQ0 32
 #define IRQ1 33
+#define IRQ4 36
 
+// Stack frame built by isr_common_stub/irq_common_stub, lowest address first
 typedef struct {
-    u32 ds;
+    u32 gs, fs, es, ds;
     u32 edi, esi, ebp, esp, ebx, edx, ecx, eax;
     u32 int_no, err_code;
     u32 eip, cs, eflags, useresp, ss;
 } registers_t;
 
+typedef void (*interrupt_handler_t)(registers_t* regs);
+
+// Bottom halves: work an interrupt handler defers until every handler of
+// the interrupt has run and the controller has its EOI
+#define BH_TTY 0
+#define BH_MAX 32
+
+typedef void (*bottom_half_t)(void);
+
 void init_idt(void);
-void register_interrupt_handler(u8 n, void (*handler)(void));
-void isr_handler(registers_t regs);
-void irq_handler(registers_t regs);
+void idt_load(void);
+void register_interrupt_handler(u8 n, interrupt_handler_t handler);
+void register_bottom_half(u32 nr, bottom_half_t handler);
+void raise_bottom_half(u32 nr);
+void isr_handler(registers_t* regs);
+void irq_handler(registers_t* regs);
 void outb(u16 port, u8 val);
 u8 inb(u16 port);
 
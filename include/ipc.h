@@ -0,0 +1,38 @@
+#ifndef IPC_H
+#define IPC_H
+
+#include "kernel.h"
+
+// Named message queues between processes. Each queue is a lock-free ring
+// with a single sender and a single receiver; ipc_open() binds the caller
+// to one end and returns a handle for it.
+#define IPC_MAX_QUEUES 32
+#define IPC_NAME_MAX 16
+#define IPC_RING_SIZE 256  // Messages per queue, a power of two
+#define IPC_INLINE_SIZE 20
+
+// Ends of a queue, for ipc_open()
+#define IPC_SEND 1
+#define IPC_RECV 2
+
+// A message carries a few bytes inline. Larger payloads travel as a whole
+// page: the sender hands over a frame from pmm_alloc_frame() and the
+// receiver owns it from then on, so nothing is copied.
+typedef struct {
+    u32 tag;    // Sender-defined
+    u32 len;    // Bytes in data, or valid bytes in page
+    u32 page;   // Transferred frame, 0 if none
+    u8 data[IPC_INLINE_SIZE];
+} ipc_msg_t;
+
+void ipc_init(void);
+int ipc_open(const char* name, u32 end);
+void ipc_close(int handle);
+bool ipc_send(int handle, const ipc_msg_t* msg);
+bool ipc_recv(int handle, ipc_msg_t* msg);
+bool ipc_try_send(int handle, const ipc_msg_t* msg);
+bool ipc_try_recv(int handle, ipc_msg_t* msg);
+bool ipc_send_page(int handle, u32 tag, u32 page, u32 len);
+void ipc_benchmark(void);
+
+#endif
@@ -16,14 +16,77 @@ typedef int32_t  i32;
 typedef int64_t  i64;
 
 // Function declarations
-void kernel_main(void);
+void kernel_main(u32 magic, u32 mboot_addr);
 
 // Utility functions
 void* memset(void* dest, int value, size_t count);
 void* memcpy(void* dest, const void* src, size_t count);
+void* memmove(void* dest, const void* src, size_t count);
+int memcmp(const void* s1, const void* s2, size_t count);
 size_t strlen(const char* str);
 int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
 char* strcpy(char* dest, const char* src);
+void string_init(void);
+const char* string_variant(void);
+
+// Bit scans: index of the lowest / highest set bit. Undefined for 0.
+static inline u32 bit_scan_forward(u32 value) {
+    u32 index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+static inline u32 bit_scan_reverse(u32 value) {
+    u32 index;
+    asm("bsr %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+// 64-by-32 bit division without libgcc; saturates if the quotient
+// doesn't fit in 32 bits
+static inline u32 div_u64_u32(u64 dividend, u32 divisor) {
+    u32 high = (u32)(dividend >> 32);
+    u32 low = (u32)dividend;
+    u32 quotient, remainder;
+    if (high >= divisor) {
+        return 0xFFFFFFFF;
+    }
+    asm("divl %4" : "=a"(quotient), "=d"(remainder) : "a"(low), "d"(high), "rm"(divisor));
+    return quotient;
+}
+
+static inline void cpuid(u32 leaf, u32* eax, u32* ebx, u32* ecx, u32* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+#ifdef HOST_BUILD
+// The host harness (tools/hostbench) runs in user mode on one thread
+static inline u32 irq_save(void) {
+    return 0;
+}
+
+static inline void irq_restore(u32 flags) {
+    (void)flags;
+}
+#else
+// Disable interrupts, returning the previous EFLAGS for irq_restore()
+static inline u32 irq_save(void) {
+    u32 flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(u32 flags) {
+    asm volatile("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+#endif
+
+// CPU timestamp counter
+static inline u64 rdtsc(void) {
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+}
 
 #endif
@@ -6,8 +6,7 @@
 #define KEYBOARD_DATA_PORT 0x60
 #define KEYBOARD_STATUS_PORT 0x64
 
+// Keys go to the tty (tty.h); the driver only decodes scancodes
 void keyboard_init(void);
-char keyboard_getchar(void);
-bool keyboard_has_input(void);
 
 #endif
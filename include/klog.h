@@ -0,0 +1,32 @@
+#ifndef KLOG_H
+#define KLOG_H
+
+#include "kernel.h"
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type) __builtin_va_arg(ap, type)
+#define va_end(ap) __builtin_va_end(ap)
+
+// Log levels, most severe first. Records at or above the console level
+// (numerically at or below it) are printed; all of them are kept for dmesg.
+#define KLOG_ERR   0
+#define KLOG_WARN  1
+#define KLOG_INFO  2
+#define KLOG_DEBUG 3
+
+#define KLOG_RECORDS 512       // Ring slots, a power of two
+#define KLOG_TEXT_SIZE 112     // Message bytes per record, NUL included
+#define KLOG_FLUSH_MS 20       // klogd's drain interval
+
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args);
+int ksnprintf(char* buf, size_t size, const char* fmt, ...);
+
+void klog(u32 level, const char* fmt, ...);
+void klog_start(void);
+void klog_flush(void);
+void klog_set_console_level(u32 level);
+void klog_dump(void);
+void klog_benchmark(void);
+
+#endif
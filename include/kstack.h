@@ -0,0 +1,23 @@
+#ifndef KSTACK_H
+#define KSTACK_H
+
+#include "kernel.h"
+#include "gdt.h"
+
+// Kernel stacks come in power-of-two page counts from KSTACK_MIN_SIZE to
+// KSTACK_MAX_SIZE, each with an unmapped guard page below it
+#define KSTACK_MIN_SIZE 4096
+#define KSTACK_MAX_SIZE 65536
+#define KSTACK_CLASSES 5
+#define KSTACK_REGION_SIZE 0x2000000  // 32MB of address space
+#define KSTACK_CACHE_MAX 16           // Mapped stacks kept per class
+#define KSTACK_PREBUILT 8             // Default-size stacks built at boot
+
+void kstack_init(u32 default_size);
+u32 kstack_alloc(u32* size);
+void kstack_free(u32 base, u32 size);
+bool kstack_is_guard(u32 addr);
+bool kstack_handle_double_fault(tss_t* tss);
+void kstack_stats(void);
+
+#endif
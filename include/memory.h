@@ -3,13 +3,26 @@
 
 #include "kernel.h"
 
-#define BUDDY_MAX_ORDER 10
-#define BUDDY_MIN_SIZE (1 << 4)  // 16 bytes minimum
-#define BUDDY_MAX_SIZE (1 << BUDDY_MAX_ORDER)  // 1024 bytes maximum
+#define BUDDY_MIN_SHIFT 4
+#define BUDDY_MAX_ORDER 16
+#define BUDDY_MIN_SIZE (1 << BUDDY_MIN_SHIFT)  // 16 bytes minimum
+#define BUDDY_MAX_SIZE (BUDDY_MIN_SIZE << BUDDY_MAX_ORDER)  // 1MB maximum
+
+#define HEAP_MIN_SIZE (1024 * 1024)       // 1MB
+#define HEAP_MAX_SIZE (64 * 1024 * 1024)  // 64MB
 
 void memory_init(void);
+void memory_init_pool(void* base, u32 size);
 void* kmalloc(size_t size);
+void* kmalloc_aligned(size_t size, size_t align);
 void kfree(void* ptr);
 void* krealloc(void* ptr, size_t size);
+void* buddy_alloc(u32 order);
+void buddy_free(void* block, u32 order);
+void* buddy_block_base(void* ptr, u32 order);
+void memory_usage(u32* free_bytes, u32* largest_free);
+void memory_self_check(void);
+void memory_benchmark(void);
+void copy_benchmark(void);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include "kernel.h"
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+// multiboot_info_t flags
+#define MULTIBOOT_INFO_MEMORY  (1 << 0)
+#define MULTIBOOT_INFO_MODS    (1 << 3)
+#define MULTIBOOT_INFO_MEM_MAP (1 << 6)
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+typedef struct {
+    u32 flags;
+    u32 mem_lower;       // KB of memory below 1MB
+    u32 mem_upper;       // KB of memory above 1MB
+    u32 boot_device;
+    u32 cmdline;
+    u32 mods_count;
+    u32 mods_addr;
+    u32 syms[4];
+    u32 mmap_length;
+    u32 mmap_addr;
+    u32 drives_length;
+    u32 drives_addr;
+    u32 config_table;
+    u32 boot_loader_name;
+    u32 apm_table;
+    u32 vbe_control_info;
+    u32 vbe_mode_info;
+    u16 vbe_mode;
+    u16 vbe_interface_seg;
+    u16 vbe_interface_off;
+    u16 vbe_interface_len;
+} __attribute__((packed)) multiboot_info_t;
+
+// The size field does not count itself: the next entry starts at
+// (u32)entry + entry->size + sizeof(entry->size)
+typedef struct {
+    u32 size;
+    u64 addr;
+    u64 len;
+    u32 type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+typedef struct {
+    u32 mod_start;
+    u32 mod_end;
+    u32 string;
+    u32 reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+#endif
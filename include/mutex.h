@@ -0,0 +1,29 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#include "kernel.h"
+#include "scheduler.h"
+
+// Sleeping mutex with priority inheritance. Process context only.
+//
+// owner holds the owning process_t*, 0 when free, with MUTEX_WAITERS set
+// while processes are queued on wait. Locking and unlocking an
+// uncontended mutex is a single compare-and-swap.
+#define MUTEX_WAITERS 1u
+
+// Longest chain of owners blocked on each other that a boost follows
+#define MUTEX_PI_MAX_DEPTH 8
+
+typedef struct mutex {
+    volatile u32 owner;
+    wait_queue_t wait;
+    struct mutex* next_held;  // Owner's held_mutexes list
+} mutex_t;
+
+void mutex_init(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+bool mutex_trylock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+void mutex_release_all(void);
+
+#endif
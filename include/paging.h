@@ -0,0 +1,54 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include "kernel.h"
+
+// Page directory / page table entry flags
+#define PAGE_PRESENT  0x001
+#define PAGE_WRITE    0x002
+#define PAGE_USER     0x004
+#define PAGE_WRITETHROUGH 0x008
+#define PAGE_NOCACHE  0x010
+#define PAGE_LARGE    0x080  // 4MB page (PSE), directory entries only
+#define PAGE_GLOBAL   0x100
+#define PAGE_COW      0x200  // Available bit: copy on the next write
+
+#define PAGE_FRAME_MASK 0xFFFFF000
+#define LARGE_PAGE_SIZE 0x400000
+
+// Physical memory below this is identity-mapped with 4MB pages. Virtual
+// space from VMM_WINDOW_START is handed out by vmm_reserve() and backed
+// with 4KB pages on demand, or by vmm_reserve_unbacked() for callers that
+// map their own pages. Everything up to here is shared by all address
+// spaces.
+#define DIRECT_MAP_LIMIT 0xC0000000
+#define VMM_WINDOW_START 0xC0000000
+#define VMM_WINDOW_END   0xE0000000
+#define VMM_MAX_REGIONS  16
+
+// Mapped separately in each process's page directory
+#define PROCESS_WINDOW_START 0xE0000000
+#define PROCESS_WINDOW_END   0xF0000000
+
+void paging_init(void);
+void* vmm_reserve(u32 size, u32 flags);
+void* vmm_reserve_unbacked(u32 size, bool (*fault)(u32 addr));
+bool paging_map_page(u32 virt, u32 phys, u32 flags);
+u32 paging_unmap_page(u32 virt);
+u32 paging_translate(u32 virt);
+bool paging_identity_map(u32 phys, u32 size, u32 flags);
+
+// Per-process page directories. NULL stands for the kernel directory.
+u32* paging_new_directory(void);
+void paging_free_directory(u32* dir);
+void paging_switch(u32* dir);
+bool paging_map_page_in(u32* dir, u32 virt, u32 phys, u32 flags);
+u32 paging_unmap_page_in(u32* dir, u32 virt);
+u32 paging_lookup_in(u32* dir, u32 virt);
+bool paging_set_flags_in(u32* dir, u32 virt, u32 flags);
+
+// Lazy TLB shootdown for kernel addresses that get a new frame later
+void paging_flush_tlb_lazy(void);
+void paging_tlb_sync(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include "kernel.h"
+#include "multiboot.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+
+void pmm_init(multiboot_info_t* mbi);
+u32 pmm_alloc_frame(void);
+void pmm_free_frame(u32 addr);
+u32 pmm_alloc_frames(u32 count);
+void pmm_free_frames(u32 addr, u32 count);
+void pmm_frame_get(u32 addr);
+void pmm_frame_put(u32 addr);
+u32 pmm_frame_refs(u32 addr);
+u32 pmm_total_frames(void);
+u32 pmm_free_frame_count(void);
+u32 pmm_highest_address(void);
+
+#endif
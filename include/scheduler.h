@@ -2,9 +2,32 @@
 #define SCHEDULER_H
 
 #include "kernel.h"
+#include "timer.h"
+#include "spinlock.h"
 
-#define MAX_PROCESSES 64
-#define MAX_PRIORITY 3
+// The process table starts at PROCESS_TABLE_INITIAL slots and doubles on
+// demand up to PROCESS_TABLE_MAX live processes
+#define PROCESS_TABLE_INITIAL 64
+#define PROCESS_TABLE_MAX 32768
+#define PID_MAX 0x7FFFFFFF
+#define MAX_PRIORITY 31  // 32 levels, one bit each in the ready bitmap
+#define PROCESS_STACK_SIZE 4096  // Default; see process_create_ex()
+
+// Time slice per priority level: higher priorities run longer per turn
+#define SCHED_BASE_SLICE_MS 10
+#define SCHED_SLICE_STEP_MS 5
+
+// Aging: the oldest waiter of a level moves up one level after waiting
+// SCHED_AGING_THRESHOLD_MS, so low priority work gets a bounded wait even
+// under sustained high priority load. Build with -DSCHED_AGING=0 to disable.
+#ifndef SCHED_AGING
+#define SCHED_AGING 1
+#endif
+#define SCHED_AGING_INTERVAL_MS 50
+#define SCHED_AGING_THRESHOLD_MS 200
+
+#define DEFAULT_PRIORITY 8
+#define SHELL_PRIORITY 16
 
 typedef enum {
     PROCESS_READY,
@@ -15,21 +38,122 @@ typedef enum {
 
 typedef struct process {
     u32 pid;
-    u32 priority;
+    u32 slot;            // Index in the process table
+    struct process* hash_next;  // PID hash chain
+    u32 priority;        // Base priority, raised by priority inheritance
+    u32 base_priority;   // Priority as created, without inheritance
+    u32 dyn_priority;    // Queue level, raised above the base by aging
     process_state_t state;
     u32 esp;
     u32 ebp;
     u32 eip;
     u32 stack_base;
     u32 stack_size;
-    struct process* next;
+    u32 time_slice;      // Ticks left in the current turn
+    u32 ticks;           // Ticks spent running
+    u32 ready_since;     // Tick the process entered its current queue
+    u64 runtime;         // TSC cycles spent running
+    u64 wait_time;       // TSC cycles spent ready but not running
+    u64 last_tsc;        // Start of the current run, or of the wait if ready
+    u64 start_tsc;       // Creation time
+    u32 nvcsw;           // Switches away while blocking or exiting
+    u32 nivcsw;          // Switches away while still runnable (preempted)
+    u32 cpu;             // CPU whose run queue owns the process
+    bool killed;         // Exit at the next pass through the scheduler
+    struct wait_queue* waiting_on;  // Set while blocked on a wait queue
+    ktimer_t* sleep_timer;          // Set while in sleep_ms()
+    struct mutex* held_mutexes;     // Mutexes owned, for priority inheritance
+    struct mutex* blocked_on;       // Set while waiting for a mutex
+    struct address_space* mm;       // NULL until the process maps memory
+    struct fpu_state* fpu;          // NULL until the process uses the FPU
+    u32 fpu_cpu;         // CPU index + 1 its state was last loaded on
+    struct process* next;  // Run queue or wait queue links
+    struct process* prev;
 } process_t;
 
+// FIFO of blocked processes. A blocked process is on no run queue, so the
+// wait queue reuses its next/prev links.
+typedef struct wait_queue {
+    spinlock_t lock;
+    process_t* head;
+    process_t* tail;
+} wait_queue_t;
+
+typedef struct {
+    process_t* head;
+    process_t* tail;
+} run_queue_t;
+
+// Copy of a process's accounting, for ps and top
+typedef struct {
+    u32 pid;
+    u32 priority;
+    u32 dyn_priority;
+    u32 cpu;
+    process_state_t state;
+    u64 runtime;
+    u64 wait_time;
+    u64 start_tsc;
+    u32 nvcsw;
+    u32 nivcsw;
+} process_info_t;
+
+// Per-CPU scheduler state, embedded in cpu_t. The lock covers the run
+// queues and current; it is held across switch_context() and released by
+// the process switched to.
+typedef struct {
+    spinlock_t lock;
+    u32 cpu;             // Index of the owning CPU
+    run_queue_t ready_queues[MAX_PRIORITY + 1];
+    u32 ready_bitmap;
+    volatile u32 nr_ready;
+    process_t* current;
+    process_t* idle;
+    process_t* zombie;   // Exited, but its stack may still be in use
+    volatile bool need_resched;
+    u32 priority_ticks[MAX_PRIORITY + 1];  // Ticks consumed per level
+    u32 idle_ticks;
+    u32 last_aging;
+    u32 aged_count;
+    u32 steals;          // Processes pulled from other CPUs
+} sched_cpu_t;
+
+// Sleep until condition holds. The condition is tested under the wait
+// queue lock, and a waker takes that lock before waking, so a wakeup can't
+// be missed between the test and blocking.
+#define wait_event(wq, condition)                           \
+    do {                                                    \
+        u32 __flags = spin_lock_irqsave(&(wq)->lock);       \
+        while (!(condition)) {                              \
+            sleep_on(wq);                                   \
+        }                                                   \
+        spin_unlock_irqrestore(&(wq)->lock, __flags);       \
+    } while (0)
+
 void scheduler_init(void);
+void scheduler_start_ap(void);
+void cpu_idle(void);
 u32 process_create(void (*entry)(void), u32 priority);
+u32 process_create_ex(void (*entry)(void), u32 priority, u32 stack_size);
 void process_exit(u32 pid);
+int fork(void);
+int fork_eager(void);
 void schedule(void);
+void scheduler_tick(u32 elapsed);
+void scheduler_irq_exit(void);
+void scheduler_stats(void);
+u32 process_snapshot(process_info_t* out, u32 max);
 process_t* get_current_process(void);
 void yield(void);
+void sleep_ms(u32 ms);
+
+void wait_queue_init(wait_queue_t* wq);
+void sleep_on(wait_queue_t* wq);
+void sleep_on_unlock(wait_queue_t* wq, spinlock_t* outer);
+void wake_up(wait_queue_t* wq);
+bool wake_up_locked(wait_queue_t* wq);
+void wake_up_all(wait_queue_t* wq);
+void process_wake(process_t* proc);
+void sched_set_priority(process_t* proc, u32 priority);
 
 #endif
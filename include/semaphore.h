@@ -0,0 +1,19 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "kernel.h"
+#include "scheduler.h"
+
+// Counting semaphore. The count is guarded by the wait queue lock, so
+// sem_up() is safe from interrupt handlers; sem_down() may sleep.
+typedef struct {
+    u32 count;
+    wait_queue_t wait;
+} semaphore_t;
+
+void sem_init(semaphore_t* sem, u32 count);
+void sem_down(semaphore_t* sem);
+bool sem_trydown(semaphore_t* sem);
+void sem_up(semaphore_t* sem);
+
+#endif
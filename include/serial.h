@@ -0,0 +1,36 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "kernel.h"
+
+#define COM1_PORT 0x3F8
+#define COM1_IRQ IRQ4
+
+// Baud rate is 115200 / divisor, overridable at build time
+// (make SERIAL_DIVISOR=12 for 9600)
+#ifndef SERIAL_DIVISOR
+#define SERIAL_DIVISOR 1
+#endif
+
+#define SERIAL_BASE_BAUD 115200
+#define SERIAL_TX_SIZE 8192
+#define SERIAL_RX_SIZE 256
+
+typedef struct {
+    u32 tx_bytes;
+    u32 rx_bytes;
+    u32 rx_dropped;   // Receive ring full
+    u32 overruns;     // The UART's FIFO overflowed
+    u32 tx_full;      // Writes that had to wait for the UART
+    u32 interrupts;
+} serial_stats_t;
+
+bool serial_init(u32 divisor);
+bool serial_present(void);
+void serial_write(const char* buf, size_t len);
+bool serial_read(char* c);
+bool serial_has_input(void);
+void serial_flush(void);
+void serial_get_stats(serial_stats_t* stats);
+
+#endif
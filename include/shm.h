@@ -0,0 +1,21 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "kernel.h"
+
+// Named shared memory. shm_create() makes a region (or finds the one
+// already using the name) and shm_attach() maps it into the calling
+// process's window. Each mapping holds a reference to the region's
+// frames, so the memory lives until the name is destroyed and the last
+// process has detached or exited.
+#define SHM_MAX_REGIONS 32
+#define SHM_NAME_MAX 16
+#define SHM_MAX_SIZE (4 * 1024 * 1024)
+
+int shm_create(const char* name, u32 size);
+bool shm_destroy(int id);
+void* shm_attach(int id);
+bool shm_detach(void* addr);
+void shm_stats(void);
+
+#endif
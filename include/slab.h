@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "kernel.h"
+#include "spinlock.h"
+
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_NAME_LEN 16
+
+typedef struct slab slab_t;
+
+typedef struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    u32 object_size;     // Size requested by the caller
+    u32 stride;          // Distance between objects in a slab
+    u32 free_offset;     // Where a free object keeps its next pointer
+    u32 slab_order;      // Buddy order of each slab
+    u32 objects_per_slab;
+    u32 first_offset;    // Offset of the first object from the slab start
+    void (*ctor)(void*);
+    spinlock_t lock;     // Protects the slab lists and counters
+    slab_t* partial;     // Slabs with free and used objects
+    slab_t* full;        // Slabs with no free objects
+    slab_t* empty;       // At most one cached slab with no used objects
+    u32 slab_count;
+    u32 active_objects;
+    struct kmem_cache* next;
+} kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                void (*ctor)(void*));
+void kmem_cache_destroy(kmem_cache_t* cache);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_cache_info(void);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "kernel.h"
+#include "gdt.h"
+#include "scheduler.h"
+
+#define MAX_CPUS 8
+#define AP_STACK_SIZE 16384
+#define TRAMPOLINE_BASE 0x8000  // Real-mode entry point of the APs
+
+typedef struct cpu {
+    struct cpu* self;    // Read through %gs:0 by this_cpu()
+    u32 index;
+    u32 apic_id;
+    volatile bool online;
+    u32 stack_top;
+    u64 gdt[GDT_ENTRIES];
+    tss_t tss;
+    sched_cpu_t sched;
+    process_t* fpu_owner;  // Process whose state is live in the FPU
+    process_t* fpu_last;   // Its state may still be in the registers
+    u32 tlb_gen;           // Last paging_tlb_sync() generation flushed
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+extern volatile u32 cpu_count;
+
+static inline cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    asm volatile("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void smp_init(void);
+void smp_send_resched(u32 cpu);
+void smp_stats(void);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "kernel.h"
+
+// Contention statistics, aggregated per lock name. Build with
+// LOCK_STATS=1 to enable; the `locks` shell command prints them.
+#ifndef LOCK_STATS
+#define LOCK_STATS 0
+#endif
+
+#define LOCK_CLASS_MAX 32
+
+typedef struct {
+    const char* name;
+    u32 acquisitions;
+    u32 contended;       // Acquisitions that had to wait
+    u64 spin_cycles;     // TSC cycles spent waiting
+    u64 max_hold_cycles;
+} lock_class_t;
+
+// Ticket spinlock: a locker takes the next ticket and spins until owner
+// reaches it, so waiters get the lock in arrival order. Waiters spin on a
+// plain read so the cache line stays shared until the holder releases it.
+typedef struct {
+    volatile u16 owner;  // Ticket being served
+    volatile u16 next;   // Next ticket to hand out
+#if LOCK_STATS
+    const char* name;
+    lock_class_t* class;
+    u64 acquired_at;
+#endif
+} spinlock_t;
+
+#if LOCK_STATS
+#define SPINLOCK_INIT(name) { 0, 0, name, NULL, 0 }
+#else
+#define SPINLOCK_INIT(name) { 0, 0 }
+#endif
+
+void lock_stat_acquired(spinlock_t* lock, u64 start, bool contended);
+void lock_stat_released(spinlock_t* lock);
+void lock_stats_dump(void);
+
+static inline void spin_lock_init(spinlock_t* lock, const char* name) {
+    lock->owner = 0;
+    lock->next = 0;
+#if LOCK_STATS
+    lock->name = name;
+    lock->class = NULL;
+    lock->acquired_at = 0;
+#else
+    (void)name;
+#endif
+}
+
+static inline bool spin_trylock(spinlock_t* lock) {
+#if LOCK_STATS
+    u64 start = rdtsc();
+#endif
+    // Take a ticket only if it would be served right away
+    u16 owner = lock->owner;
+    if (!__sync_bool_compare_and_swap(&lock->next, owner, (u16)(owner + 1))) {
+        return false;
+    }
+#if LOCK_STATS
+    lock_stat_acquired(lock, start, false);
+#endif
+    return true;
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+#if LOCK_STATS
+    u64 start = rdtsc();
+#endif
+    u16 ticket = __sync_fetch_and_add(&lock->next, 1);
+    bool contended = false;
+    while (lock->owner != ticket) {
+        contended = true;
+        asm volatile("pause" : : : "memory");
+    }
+    asm volatile("" : : : "memory");
+#if LOCK_STATS
+    lock_stat_acquired(lock, start, contended);
+#else
+    (void)contended;
+#endif
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+#if LOCK_STATS
+    lock_stat_released(lock);
+#endif
+    // Only the holder writes owner, and x86 doesn't reorder stores, so a
+    // compiler barrier is enough to publish the critical section
+    asm volatile("" : : : "memory");
+    lock->owner = lock->owner + 1;
+}
+
+static inline bool spin_is_locked(spinlock_t* lock) {
+    return lock->owner != lock->next;
+}
+
+// Interrupt handlers take the same locks, so process context must hold
+// them with interrupts disabled on the local CPU
+static inline u32 spin_lock_irqsave(spinlock_t* lock) {
+    u32 flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, u32 flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
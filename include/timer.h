@@ -0,0 +1,49 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "kernel.h"
+
+// PIT tick rate, overridable at build time (make TIMER_HZ=1000)
+#ifndef TIMER_HZ
+#define TIMER_HZ 100
+#endif
+
+#define TIMER_MIN_HZ 100
+#define TIMER_MAX_HZ 1000
+#define PIT_FREQUENCY 1193182
+
+// Hierarchical timer wheel geometry: one 256-slot wheel for the next 256
+// ticks, then four 64-slot wheels each covering 64 times the range of the
+// one below, which spans the whole 32-bit tick space.
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct ktimer {
+    struct ktimer* next;
+    struct ktimer* prev;
+    struct ktimer** slot;  // List head this timer is linked on
+    u32 expires;           // Absolute tick
+    u16 level;             // 0 = root wheel, 1-4 = outer wheels
+    u16 index;
+    bool pending;
+    void (*callback)(void* data);
+    void* data;
+} ktimer_t;
+
+void timer_init(u32 frequency);
+u32 timer_get_ticks(void);
+u32 timer_get_frequency(void);
+u32 timer_ms_to_ticks(u32 ms);
+u32 timer_tsc_per_ms(void);
+
+void timer_setup(ktimer_t* timer, void (*callback)(void*), void* data);
+void timer_add(ktimer_t* timer, u32 expires);
+void timer_cancel(ktimer_t* timer);
+
+void timer_idle_enter(void);
+void timer_idle_exit(void);
+
+#endif
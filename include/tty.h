@@ -0,0 +1,39 @@
+#ifndef TTY_H
+#define TTY_H
+
+#include "kernel.h"
+
+// Cooked: lines are edited and echoed, and a reader gets a whole line.
+// Raw: every key goes to the reader as it arrives, without echo.
+typedef enum {
+    TTY_COOKED,
+    TTY_RAW
+} tty_mode_t;
+
+#define TTY_INPUT_SIZE 256   // Keys waiting for the bottom half
+#define TTY_LINE_MAX 256     // Longest line being edited
+#define TTY_READ_SIZE 1024   // Input ready for readers
+
+// Control characters
+#define TTY_CTRL(c) ((c) & 0x1F)
+#define TTY_INTR   TTY_CTRL('C')  // Discard the line
+#define TTY_KILL   TTY_CTRL('U')  // Erase the line
+#define TTY_WERASE TTY_CTRL('W')  // Erase the last word
+#define TTY_DEL    0x7F           // What terminals send for backspace
+
+typedef struct {
+    u32 keys;       // Keys taken from the drivers
+    u32 dropped;    // Lost because the input ring or the read queue was full
+    u32 lines;      // Complete lines handed to readers
+    u32 wakeups;    // Reader wakeups
+} tty_stats_t;
+
+void tty_init(void);
+void tty_input(char c);
+int tty_read(char* buf, size_t size);
+bool tty_has_input(void);
+void tty_set_mode(tty_mode_t mode);
+tty_mode_t tty_get_mode(void);
+void tty_get_stats(tty_stats_t* out);
+
+#endif
@@ -7,11 +7,22 @@
 #define VGA_HEIGHT 25
 #define VGA_MEMORY 0xB8000
 
+// vga_putchar(), vga_puts(), vga_put_dec() and vga_put_hex() print to the
+// console (see console.h); vga_write() draws on the screen only
+
 void vga_init(void);
 void vga_clear(void);
+void vga_home(void);
 void vga_putchar(char c);
+void vga_write(const char* buf, size_t len);
 void vga_puts(const char* str);
+void vga_put_dec(u32 value);
+void vga_put_hex(u32 value);
 void vga_set_color(u8 color);
 u8 vga_get_color(void);
+void vga_flush(void);
+void vga_scroll_view(int rows);
+void vga_tick(void);
+void vga_benchmark(void);
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef VM_H
+#define VM_H
+
+#include "kernel.h"
+#include "spinlock.h"
+
+// Per-process address spaces. A process starts out running in the kernel
+// directory; its first request for process window memory gives it a page
+// directory of its own, which is freed with it.
+
+// A range of the process window. Its mappings hold one frame reference per
+// page, dropped when the area is freed; release() then lets the owner of
+// the area tidy up. fork() gives the child a copy of each area, calling
+// dup() on the copy. Private areas become copy-on-write; shared ones map
+// the same frames writable in both.
+typedef struct vm_area {
+    u32 start;
+    u32 end;
+    u32 flags;           // PAGE_* flags of its mappings
+    bool shared;
+    void (*release)(struct vm_area* area);
+    void (*dup)(struct vm_area* area);
+    void* data;          // For release() and dup()
+    struct vm_area* next;
+} vm_area_t;
+
+typedef struct address_space {
+    u32* directory;
+    vm_area_t* areas;    // Sorted by address
+    u32 pages;           // Pages mapped in the window
+    spinlock_t lock;     // Area list and page count
+} address_space_t;
+
+address_space_t* as_create(void);
+void as_destroy(address_space_t* as);
+address_space_t* as_current(bool create);
+address_space_t* as_fork(address_space_t* as, bool eager);
+vm_area_t* as_alloc_area(address_space_t* as, u32 size, u32 flags);
+bool as_map_page(address_space_t* as, vm_area_t* area, u32 virt, u32 phys);
+void as_free_area(address_space_t* as, vm_area_t* area);
+vm_area_t* as_find_area(address_space_t* as, u32 addr);
+
+// Private zero-filled memory in the current process's window
+void* vm_alloc(u32 size);
+bool vm_free(void* addr);
+
+void fork_benchmark(void);
+
+#endif
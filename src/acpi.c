@@ -0,0 +1,130 @@
+#include "acpi.h"
+#include "paging.h"
+#include "kernel.h"
+
+// Minimal ACPI table parsing: locate the RSDP in the BIOS areas, follow the
+// RSDT to the MADT and list the local APIC of every enabled processor.
+
+#define EBDA_SEGMENT_PTR 0x40E
+#define BIOS_ROM_START   0xE0000
+#define BIOS_ROM_END     0x100000
+
+#define MADT_LOCAL_APIC 0
+#define MADT_CPU_ENABLED 0x1
+
+typedef struct {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_address;
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} __attribute__((packed)) acpi_header_t;
+
+typedef struct {
+    acpi_header_t header;
+    u32 lapic_address;
+    u32 flags;
+} __attribute__((packed)) acpi_madt_t;
+
+typedef struct {
+    u8 type;
+    u8 length;
+    u8 acpi_id;
+    u8 apic_id;
+    u32 flags;
+} __attribute__((packed)) madt_local_apic_t;
+
+static bool checksum_ok(const void* data, u32 length) {
+    const u8* bytes = (const u8*)data;
+    u8 sum = 0;
+    for (u32 i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static acpi_rsdp_t* scan_rsdp(u32 start, u32 end) {
+    for (u32 addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+        acpi_rsdp_t* rsdp = (acpi_rsdp_t*)addr;
+        if (strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum_ok(rsdp, sizeof(acpi_rsdp_t))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+static acpi_rsdp_t* find_rsdp(void) {
+    u32 ebda = (u32)(*(u16*)EBDA_SEGMENT_PTR) << 4;
+    acpi_rsdp_t* rsdp = NULL;
+    if (ebda) {
+        rsdp = scan_rsdp(ebda, ebda + 1024);
+    }
+    if (!rsdp) {
+        rsdp = scan_rsdp(BIOS_ROM_START, BIOS_ROM_END);
+    }
+    return rsdp;
+}
+
+// Tables usually sit in reserved RAM just past the direct map
+static acpi_header_t* map_table(u32 addr) {
+    if (!paging_identity_map(addr, sizeof(acpi_header_t), 0)) {
+        return NULL;
+    }
+    acpi_header_t* table = (acpi_header_t*)addr;
+    if (!paging_identity_map(addr, table->length, 0) || !checksum_ok(table, table->length)) {
+        return NULL;
+    }
+    return table;
+}
+
+// Returns the number of enabled CPUs found, or 0 without a usable MADT
+u32 acpi_find_cpus(u32* apic_ids, u32 max, u32* lapic_base) {
+    acpi_rsdp_t* rsdp = find_rsdp();
+    if (!rsdp) {
+        return 0;
+    }
+    
+    acpi_header_t* rsdt = map_table(rsdp->rsdt_address);
+    if (!rsdt) {
+        return 0;
+    }
+    
+    acpi_madt_t* madt = NULL;
+    u32 entries = (rsdt->length - sizeof(acpi_header_t)) / sizeof(u32);
+    u32* pointers = (u32*)(rsdt + 1);
+    for (u32 i = 0; i < entries && !madt; i++) {
+        acpi_header_t* table = map_table(pointers[i]);
+        if (table && strncmp(table->signature, "APIC", 4) == 0) {
+            madt = (acpi_madt_t*)table;
+        }
+    }
+    if (!madt) {
+        return 0;
+    }
+    
+    *lapic_base = madt->lapic_address;
+    
+    u32 count = 0;
+    u8* entry = (u8*)(madt + 1);
+    u8* end = (u8*)madt + madt->header.length;
+    while (entry + 2 <= end && entry[1] >= 2) {
+        madt_local_apic_t* cpu = (madt_local_apic_t*)entry;
+        if (cpu->type == MADT_LOCAL_APIC && (cpu->flags & MADT_CPU_ENABLED) && count < max) {
+            apic_ids[count++] = cpu->apic_id;
+        }
+        entry += entry[1];
+    }
+    return count;
+}
@@ -0,0 +1,119 @@
+#include "apic.h"
+#include "paging.h"
+#include "pmm.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Local APIC
+//
+// Every CPU sees its own local APIC at the same physical address. The BSP
+// maps the register page uncached and calibrates the APIC timer against
+// the PIT; the APs then run their scheduler tick from the APIC timer, since
+// PIC interrupts only ever reach the BSP.
+
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE      0x100
+#define LAPIC_ICR_INIT        0x00000500
+#define LAPIC_ICR_STARTUP     0x00000600
+#define LAPIC_ICR_LEVEL       0x00008000
+#define LAPIC_ICR_ASSERT      0x00004000
+#define LAPIC_ICR_PENDING     0x00001000
+#define LAPIC_TIMER_PERIODIC  0x00020000
+#define LAPIC_TIMER_MASKED    0x00010000
+#define LAPIC_TIMER_DIV16     0x3
+
+#define CALIBRATION_TICKS 10
+
+static volatile u32* lapic = NULL;
+static u32 counts_per_tick = 0;  // APIC timer counts per PIT tick
+
+static inline u32 lapic_read(u32 reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(u32 reg, u32 value) {
+    lapic[reg / 4] = value;
+}
+
+static void lapic_wait_icr(void) {
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+// BSP only: map the registers and calibrate the timer. Interrupts must be
+// enabled so the PIT keeps ticking during calibration.
+bool lapic_init(u32 phys_base) {
+    if (!paging_identity_map(phys_base, PAGE_SIZE, PAGE_WRITE | PAGE_NOCACHE | PAGE_WRITETHROUGH)) {
+        return false;
+    }
+    lapic = (volatile u32*)phys_base;
+    lapic_enable();
+    
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED);
+    
+    u32 start = timer_get_ticks();
+    while (timer_get_ticks() == start) {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    start = timer_get_ticks();
+    while (timer_get_ticks() - start < CALIBRATION_TICKS) {
+        asm volatile("pause");
+    }
+    counts_per_tick = (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT)) / CALIBRATION_TICKS;
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    
+    return true;
+}
+
+// Per CPU: software-enable the APIC with the spurious vector
+void lapic_enable(void) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+u32 lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_init(u32 apic_id) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+    lapic_wait_icr();
+}
+
+// Start an AP at real-mode address page << 12
+void lapic_send_startup(u32 apic_id, u32 page) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_STARTUP | (page & 0xFF));
+    lapic_wait_icr();
+}
+
+void lapic_send_ipi(u32 apic_id, u32 vector) {
+    u32 flags = irq_save();
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector & 0xFF);
+    lapic_wait_icr();
+    irq_restore(flags);
+}
+
+// Periodic APIC timer interrupts at hz on the calling CPU
+void lapic_timer_start(u32 hz) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, counts_per_tick * timer_get_frequency() / hz);
+}
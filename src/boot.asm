@@ -25,7 +25,7 @@ boot:
     ; Set up stack
     mov esp, stack_top
     
-    ; Save multiboot info
+    ; Multiboot info pointer and magic become kernel_main's arguments
     push ebx
     push eax
     
@@ -0,0 +1,69 @@
+#include "console.h"
+#include "kernel.h"
+#include "vga.h"
+#include "serial.h"
+
+// Console: kernel output goes to the VGA screen and, when COM1 answers,
+// the serial port. Input from the keyboard and the serial port goes
+// through the tty (tty.c), so the shell can run from either and the
+// system can be driven headless (make run-headless).
+static u32 outputs = CONSOLE_VGA;
+
+void console_init(void) {
+    if (serial_init(SERIAL_DIVISOR)) {
+        outputs |= CONSOLE_SERIAL;
+    }
+}
+
+// Terminals want CR LF for a new line
+static void serial_write_crlf(const char* buf, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            serial_write(buf + start, i - start);
+            serial_write("\r\n", 2);
+            start = i + 1;
+        }
+    }
+    serial_write(buf + start, len - start);
+}
+
+void console_write(const char* buf, size_t len) {
+    if (outputs & CONSOLE_VGA) {
+        vga_write(buf, len);
+    }
+    if (outputs & CONSOLE_SERIAL) {
+        serial_write_crlf(buf, len);
+    }
+}
+
+// Get everything out before the kernel halts with interrupts off
+void console_flush(void) {
+    vga_flush();
+    serial_flush();
+}
+
+// Start a full-screen redraw on each device: blank the screen and home
+// the cursor, with VT100 sequences on the serial terminal
+void console_home(void) {
+    if (outputs & CONSOLE_VGA) {
+        vga_home();
+    }
+    if (outputs & CONSOLE_SERIAL) {
+        serial_write("\x1b[H\x1b[2J", 7);
+    }
+}
+
+u32 console_get_outputs(void) {
+    return outputs;
+}
+
+// At least one device stays on, and the serial port only if it exists
+void console_set_outputs(u32 new_outputs) {
+    if (!serial_present()) {
+        new_outputs &= ~CONSOLE_SERIAL;
+    }
+    if (new_outputs) {
+        outputs = new_outputs;
+    }
+}
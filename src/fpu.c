@@ -0,0 +1,195 @@
+#include "fpu.h"
+#include "idt.h"
+#include "slab.h"
+#include "scheduler.h"
+#include "kernel.h"
+#include "klog.h"
+
+// Lazy FPU/SSE switching
+//
+// CR0.TS is set whenever the registers don't hold the running process's
+// state, so its first FPU or SSE instruction raises #NM (vector 7). The
+// handler clears TS, loads the process's state (allocating it on first
+// use) and records the process as this CPU's owner. Processes that never
+// touch the FPU never trap and never get a save area.
+//
+// State is saved when the owner is switched away rather than when the
+// next user traps, because the owner may be stolen by another CPU before
+// then. The registers are still valid after the save, so a process that
+// comes back to the same CPU with nobody else having used the FPU there
+// only clears TS.
+
+#define CPUID_FXSR (1 << 24)
+#define CPUID_SSE  (1 << 25)
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+#define MXCSR_DEFAULT 0x1F80  // All SIMD exceptions masked
+
+static kmem_cache_t* fpu_cache = NULL;
+static bool fxsr = false;
+static bool sse = false;
+
+static inline void clts(void) {
+    asm volatile("clts");
+}
+
+static inline void stts(void) {
+    u32 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | CR0_TS));
+}
+
+// fnsave reinitializes the FPU, so reload to keep the registers valid
+static void save_state(fpu_state_t* state) {
+    if (fxsr) {
+        asm volatile("fxsave (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile("fnsave (%0); frstor (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void load_state(fpu_state_t* state) {
+    if (fxsr) {
+        asm volatile("fxrstor (%0)" : : "r"(state) : "memory");
+    } else {
+        asm volatile("frstor (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void reset_state(void) {
+    asm volatile("fninit");
+    if (sse) {
+        u32 mxcsr = MXCSR_DEFAULT;
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+    }
+}
+
+// #NM: the running process wants the FPU
+static void device_not_available(registers_t* regs) {
+    (void)regs;
+    cpu_t* cpu = this_cpu();
+    process_t* proc = cpu->sched.current;
+    clts();
+    
+    if (!proc->fpu) {
+        proc->fpu = (fpu_state_t*)kmem_cache_alloc(fpu_cache);
+        if (!proc->fpu) {
+            stts();
+            klog(KLOG_ERR, "Out of memory for FPU state, killing process %u", proc->pid);
+            process_exit(proc->pid);
+            return;
+        }
+        reset_state();
+    } else if (cpu->fpu_last != proc || proc->fpu_cpu != cpu->index + 1) {
+        load_state(proc->fpu);
+    }
+    
+    cpu->fpu_owner = proc;
+    cpu->fpu_last = proc;
+    proc->fpu_cpu = cpu->index + 1;
+}
+
+// Enable the FPU and SSE on this CPU, leaving TS set
+void fpu_init_cpu(void) {
+    u32 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~CR0_EM) | CR0_MP | CR0_NE;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    
+    if (fxsr) {
+        u32 cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if (sse) {
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        asm volatile("mov %0, %%cr4" : : "r"(cr4));
+    }
+    
+    reset_state();
+    this_cpu()->fpu_owner = NULL;
+    this_cpu()->fpu_last = NULL;
+    stts();
+}
+
+void fpu_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    fxsr = (edx & CPUID_FXSR) != 0;
+    sse = fxsr && (edx & CPUID_SSE);
+    
+    fpu_cache = kmem_cache_create("fpu", sizeof(fpu_state_t), 16, NULL);
+    register_interrupt_handler(7, device_not_available);
+    fpu_init_cpu();
+}
+
+bool fpu_sse_enabled(void) {
+    return sse;
+}
+
+// Save the owner's registers and trap its next use
+void fpu_save_owner(cpu_t* cpu) {
+    save_state(cpu->fpu_owner->fpu);
+    cpu->fpu_owner = NULL;
+    stts();
+}
+
+// Give a forked child a copy of the parent's state
+bool fpu_fork(process_t* parent, process_t* child) {
+    if (!parent->fpu) {
+        return true;
+    }
+    child->fpu = (fpu_state_t*)kmem_cache_alloc(fpu_cache);
+    if (!child->fpu) {
+        return false;
+    }
+    
+    u32 flags = irq_save();
+    if (this_cpu()->fpu_owner == parent) {
+        save_state(parent->fpu);
+    }
+    irq_restore(flags);
+    memcpy(child->fpu, parent->fpu, sizeof(fpu_state_t));
+    return true;
+}
+
+// The running process is exiting: its registers are garbage now
+void fpu_exit(process_t* proc) {
+    cpu_t* cpu = this_cpu();
+    if (cpu->fpu_owner == proc) {
+        cpu->fpu_owner = NULL;
+        stts();
+    }
+    if (cpu->fpu_last == proc) {
+        cpu->fpu_last = NULL;
+    }
+}
+
+void fpu_free(process_t* proc) {
+    if (proc->fpu) {
+        kmem_cache_free(fpu_cache, proc->fpu);
+        proc->fpu = NULL;
+    }
+}
+
+u32 kernel_fpu_begin(void) {
+    u32 flags = irq_save();
+    cpu_t* cpu = this_cpu();
+    if (cpu->fpu_owner) {
+        fpu_save_owner(cpu);
+    }
+    cpu->fpu_last = NULL;
+    clts();
+    return flags;
+}
+
+void kernel_fpu_end(u32 flags) {
+    stts();
+    irq_restore(flags);
+}
@@ -2,12 +2,25 @@
 #include "kernel.h"
 #include "vga.h"
 #include "memory.h"
+#include "slab.h"
+#include "paging.h"
+#include "mutex.h"
 
-#define FS_START_ADDR 0x300000  // Start at 3MB
 #define FS_SIZE (1024 * 1024)   // 1MB filesystem
 
 static filesystem_t* fs = NULL;
 static u8* fs_data = NULL;
+static kmem_cache_t* file_cache = NULL;
+static mutex_t fs_lock;  // The file table and block contents
+
+static int find_slot(const char* name) {
+    for (int i = 0; i < FS_MAX_FILES; i++) {
+        if (fs->files[i] && strcmp(fs->files[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 void fs_init(void) {
     if (fs && fs->initialized) return;
@@ -16,40 +29,43 @@ void fs_init(void) {
     fs = (filesystem_t*)kmalloc(sizeof(filesystem_t));
     if (!fs) return;
     
-    fs_data = (u8*)FS_START_ADDR;
-    
-    // Check if filesystem exists (simple check)
-    bool exists = false;
-    for (int i = 0; i < FS_MAX_FILES; i++) {
-        if (fs->files[i].used) {
-            exists = true;
-            break;
-        }
+    // Block storage is demand-zero: untouched blocks cost no memory
+    fs_data = (u8*)vmm_reserve(FS_SIZE, PAGE_WRITE);
+    if (!fs_data) {
+        kfree(fs);
+        fs = NULL;
+        return;
     }
     
-    if (!exists) {
-        // Initialize new filesystem
-        memset(fs, 0, sizeof(filesystem_t));
-        fs->total_blocks = FS_SIZE / FS_BLOCK_SIZE;
-        fs->free_blocks = fs->total_blocks;
+    // File entries are allocated on demand from their own slab cache
+    file_cache = kmem_cache_create("file", sizeof(file_entry_t), 0, NULL);
+    if (!file_cache) {
+        kfree(fs);
+        fs = NULL;
+        return;
     }
     
+    // Initialize new filesystem
+    memset(fs, 0, sizeof(filesystem_t));
+    fs->total_blocks = FS_SIZE / FS_BLOCK_SIZE;
+    fs->free_blocks = fs->total_blocks;
+    mutex_init(&fs_lock);
+    
     fs->initialized = true;
 }
 
-int fs_create_file(const char* name, u32 size) {
-    if (!fs || !fs->initialized) return -1;
-    if (strlen(name) >= FS_MAX_FILENAME) return -1;
-    
+// The operations below run with fs_lock held; the public entry points
+// take it around them
+static int create_file(const char* name, u32 size) {
     // Check if file already exists
-    if (fs_find_file(name)) {
+    if (find_slot(name) != -1) {
         return -1;  // File exists
     }
     
     // Find free slot
     int slot = -1;
     for (int i = 0; i < FS_MAX_FILES; i++) {
-        if (!fs->files[i].used) {
+        if (!fs->files[i]) {
             slot = i;
             break;
         }
@@ -69,9 +85,9 @@ int fs_create_file(const char* name, u32 size) {
     for (u32 i = 0; i < fs->total_blocks && blocks_found < blocks_needed; i++) {
         bool block_used = false;
         for (int j = 0; j < FS_MAX_FILES; j++) {
-            if (fs->files[j].used) {
-                u32 file_start = fs->files[j].start_block;
-                u32 file_blocks = (fs->files[j].size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+            if (fs->files[j]) {
+                u32 file_start = fs->files[j]->start_block;
+                u32 file_blocks = (fs->files[j]->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
                 if (i >= file_start && i < file_start + file_blocks) {
                     block_used = true;
                     break;
@@ -91,46 +107,38 @@ int fs_create_file(const char* name, u32 size) {
     }
     
     // Create file entry
-    strcpy(fs->files[slot].name, name);
-    fs->files[slot].size = size;
-    fs->files[slot].start_block = start_block;
-    fs->files[slot].used = true;
+    file_entry_t* file = (file_entry_t*)kmem_cache_alloc(file_cache);
+    if (!file) return -1;
+    
+    strcpy(file->name, name);
+    file->size = size;
+    file->start_block = start_block;
+    file->used = true;
+    fs->files[slot] = file;
     
     fs->free_blocks -= blocks_needed;
     
     return 0;
 }
 
-int fs_delete_file(const char* name) {
-    if (!fs || !fs->initialized) return -1;
-    
-    file_entry_t* file = fs_find_file(name);
-    if (!file) return -1;
+static int delete_file(const char* name) {
+    int slot = find_slot(name);
+    if (slot == -1) return -1;
     
+    file_entry_t* file = fs->files[slot];
     u32 blocks_used = (file->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
     fs->free_blocks += blocks_used;
     
-    memset(file, 0, sizeof(file_entry_t));
+    kmem_cache_free(file_cache, file);
+    fs->files[slot] = NULL;
     
     return 0;
 }
 
-file_entry_t* fs_find_file(const char* name) {
-    if (!fs || !fs->initialized) return NULL;
-    
-    for (int i = 0; i < FS_MAX_FILES; i++) {
-        if (fs->files[i].used && strcmp(fs->files[i].name, name) == 0) {
-            return &fs->files[i];
-        }
-    }
-    return NULL;
-}
-
-int fs_read_file(const char* name, void* buffer, u32 size) {
-    if (!fs || !fs->initialized) return -1;
-    
-    file_entry_t* file = fs_find_file(name);
-    if (!file) return -1;
+static int read_file(const char* name, void* buffer, u32 size) {
+    int slot = find_slot(name);
+    if (slot == -1) return -1;
+    file_entry_t* file = fs->files[slot];
     
     u32 read_size = size < file->size ? size : file->size;
     u32 offset = file->start_block * FS_BLOCK_SIZE;
@@ -140,11 +148,10 @@ int fs_read_file(const char* name, void* buffer, u32 size) {
     return read_size;
 }
 
-int fs_write_file(const char* name, const void* data, u32 size) {
-    if (!fs || !fs->initialized) return -1;
-    
-    file_entry_t* file = fs_find_file(name);
-    if (!file) return -1;
+static int write_file(const char* name, const void* data, u32 size) {
+    int slot = find_slot(name);
+    if (slot == -1) return -1;
+    file_entry_t* file = fs->files[slot];
     
     if (size > file->size) {
         size = file->size;  // Don't write beyond file size
@@ -156,20 +163,69 @@ int fs_write_file(const char* name, const void* data, u32 size) {
     return size;
 }
 
+int fs_create_file(const char* name, u32 size) {
+    if (!fs || !fs->initialized) return -1;
+    if (strlen(name) >= FS_MAX_FILENAME) return -1;
+    
+    mutex_lock(&fs_lock);
+    int result = create_file(name, size);
+    mutex_unlock(&fs_lock);
+    return result;
+}
+
+int fs_delete_file(const char* name) {
+    if (!fs || !fs->initialized) return -1;
+    
+    mutex_lock(&fs_lock);
+    int result = delete_file(name);
+    mutex_unlock(&fs_lock);
+    return result;
+}
+
+// The entry stays valid only until the file is deleted
+file_entry_t* fs_find_file(const char* name) {
+    if (!fs || !fs->initialized) return NULL;
+    
+    mutex_lock(&fs_lock);
+    int slot = find_slot(name);
+    file_entry_t* file = slot == -1 ? NULL : fs->files[slot];
+    mutex_unlock(&fs_lock);
+    return file;
+}
+
+int fs_read_file(const char* name, void* buffer, u32 size) {
+    if (!fs || !fs->initialized) return -1;
+    
+    mutex_lock(&fs_lock);
+    int result = read_file(name, buffer, size);
+    mutex_unlock(&fs_lock);
+    return result;
+}
+
+int fs_write_file(const char* name, const void* data, u32 size) {
+    if (!fs || !fs->initialized) return -1;
+    
+    mutex_lock(&fs_lock);
+    int result = write_file(name, data, size);
+    mutex_unlock(&fs_lock);
+    return result;
+}
+
 void fs_list_files(void) {
     if (!fs || !fs->initialized) {
         vga_puts("Filesystem not initialized\n");
         return;
     }
     
+    mutex_lock(&fs_lock);
     bool found = false;
     for (int i = 0; i < FS_MAX_FILES; i++) {
-        if (fs->files[i].used) {
-            vga_puts(fs->files[i].name);
+        if (fs->files[i]) {
+            vga_puts(fs->files[i]->name);
             vga_puts(" (");
             // Print size (simplified)
             char size_str[32];
-            u32 size = fs->files[i].size;
+            u32 size = fs->files[i]->size;
             int idx = 0;
             if (size == 0) {
                 size_str[idx++] = '0';
@@ -193,6 +249,8 @@ void fs_list_files(void) {
         }
     }
     
+    mutex_unlock(&fs_lock);
+    
     if (!found) {
         vga_puts("No files found\n");
     }
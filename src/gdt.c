@@ -1,6 +1,11 @@
 #include "gdt.h"
+#include "smp.h"
 #include "kernel.h"
 
+// Every CPU has its own GDT: the flat kernel and user segments, a TSS, and
+// a data segment based at the CPU's cpu_t that is kept in %gs, so this_cpu()
+// is a single load.
+
 struct gdt_entry {
     u16 limit_low;
     u16 base_low;
@@ -15,12 +20,13 @@ struct gdt_ptr {
     u32 base;
 } __attribute__((packed));
 
-struct gdt_entry gdt[5];
-struct gdt_ptr gdtp;
-
 extern void gdt_flush(u32);
+extern void double_fault_task(void);
+
+static tss_t df_tss[MAX_CPUS];
+static u8 df_stacks[MAX_CPUS][DF_STACK_SIZE] __attribute__((aligned(16)));
 
-static void gdt_set_gate(int num, u32 base, u32 limit, u8 access, u8 gran) {
+static void gdt_set_gate(struct gdt_entry* gdt, int num, u32 base, u32 limit, u8 access, u8 gran) {
     gdt[num].base_low = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
     gdt[num].base_high = (base >> 24) & 0xFF;
@@ -31,24 +37,79 @@ static void gdt_set_gate(int num, u32 base, u32 limit, u8 access, u8 gran) {
     gdt[num].access = access;
 }
 
-void init_gdt(void) {
-    gdtp.limit = (sizeof(struct gdt_entry) * 5) - 1;
-    gdtp.base = (u32)&gdt;
+void gdt_init_cpu(struct cpu* cpu) {
+    struct gdt_entry* gdt = (struct gdt_entry*)cpu->gdt;
+    struct gdt_ptr gdtp;
+    
+    cpu->self = cpu;
+    
+    memset(&cpu->tss, 0, sizeof(tss_t));
+    cpu->tss.ss0 = GDT_KERNEL_DATA;
+    cpu->tss.esp0 = cpu->stack_top;
+    cpu->tss.iomap_base = sizeof(tss_t);
     
     // Null segment
-    gdt_set_gate(0, 0, 0, 0, 0);
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);
     
     // Code segment
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);
     
     // Data segment
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);
     
     // User code segment
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
     
     // User data segment
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    
+    // Task state segment
+    gdt_set_gate(gdt, 5, (u32)&cpu->tss, sizeof(tss_t) - 1, 0x89, 0x00);
     
+    // Per-CPU data segment
+    gdt_set_gate(gdt, 6, (u32)cpu, sizeof(struct cpu) - 1, 0x92, 0x40);
+    
+    gdtp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
+    gdtp.base = (u32)gdt;
     gdt_flush((u32)&gdtp);
+    
+    asm volatile("ltr %w0" : : "r"(GDT_TSS));
+    asm volatile("mov %w0, %%gs" : : "r"(GDT_PERCPU));
+}
+
+// Boot processor; the APs call gdt_init_cpu() from ap_main()
+void init_gdt(void) {
+    gdt_init_cpu(&cpus[0]);
+}
+
+// Double faults are delivered through a task gate, which switches to a
+// separate TSS and stack. A fault on a kernel stack that ran into its guard
+// page can't push an exception frame, so this is the only way to report it
+// rather than triple fault. Needs paging on, since the task loads CR3.
+void gdt_init_double_fault(struct cpu* cpu) {
+    struct gdt_entry* gdt = (struct gdt_entry*)cpu->gdt;
+    tss_t* tss = &df_tss[cpu->index];
+    u32 cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    
+    memset(tss, 0, sizeof(tss_t));
+    tss->cr3 = cr3;
+    tss->eip = (u32)double_fault_task;
+    tss->eflags = 0x2;
+    tss->esp = (u32)&df_stacks[cpu->index][DF_STACK_SIZE];
+    tss->esp0 = tss->esp;
+    tss->ss0 = GDT_KERNEL_DATA;
+    tss->cs = GDT_KERNEL_CODE;
+    tss->ss = GDT_KERNEL_DATA;
+    tss->ds = GDT_KERNEL_DATA;
+    tss->es = GDT_KERNEL_DATA;
+    tss->fs = GDT_KERNEL_DATA;
+    tss->gs = GDT_PERCPU;
+    tss->iomap_base = sizeof(tss_t);
+    
+    // Returning from the task reloads CR3 from the main TSS, which the
+    // processor never writes back
+    cpu->tss.cr3 = cr3;
+    
+    gdt_set_gate(gdt, 7, (u32)tss, sizeof(tss_t) - 1, 0x89, 0x00);
 }
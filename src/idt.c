@@ -1,9 +1,11 @@
 #include "idt.h"
 #include "kernel.h"
+#include "apic.h"
+#include "gdt.h"
 
 // Forward declarations
-void isr_handler(registers_t regs);
-void irq_handler(registers_t regs);
+void isr_handler(registers_t* regs);
+void irq_handler(registers_t* regs);
 
 struct idt_entry {
     u16 base_low;
@@ -56,8 +58,12 @@ extern void isr30();
 extern void isr31();
 extern void irq0();
 extern void irq1();
+extern void irq4();
+extern void irq_apic_timer();
+extern void irq_resched();
+extern void irq_spurious();
 
-void (*interrupt_handlers[256])(void);
+interrupt_handler_t interrupt_handlers[256];
 
 static void idt_set_gate(u8 num, u32 base, u16 sel, u8 flags) {
     idt[num].base_low = base & 0xFFFF;
@@ -67,7 +73,7 @@ static void idt_set_gate(u8 num, u32 base, u16 sel, u8 flags) {
     idt[num].flags = flags;
 }
 
-void register_interrupt_handler(u8 n, void (*handler)(void)) {
+void register_interrupt_handler(u8 n, interrupt_handler_t handler) {
     interrupt_handlers[n] = handler;
 }
 
@@ -87,7 +93,7 @@ void init_idt(void) {
     idt_set_gate(5, (u32)isr5, 0x08, 0x8E);
     idt_set_gate(6, (u32)isr6, 0x08, 0x8E);
     idt_set_gate(7, (u32)isr7, 0x08, 0x8E);
-    idt_set_gate(8, (u32)isr8, 0x08, 0x8E);
+    idt_set_gate(8, 0, GDT_DF_TSS, 0x85);  // Task gate, see gdt_init_double_fault()
     idt_set_gate(9, (u32)isr9, 0x08, 0x8E);
     idt_set_gate(10, (u32)isr10, 0x08, 0x8E);
     idt_set_gate(11, (u32)isr11, 0x08, 0x8E);
@@ -115,6 +121,12 @@ void init_idt(void) {
     // Set up IRQs
     idt_set_gate(IRQ0, (u32)irq0, 0x08, 0x8E);
     idt_set_gate(IRQ1, (u32)irq1, 0x08, 0x8E);
+    idt_set_gate(IRQ4, (u32)irq4, 0x08, 0x8E);
+    
+    // Local APIC vectors
+    idt_set_gate(APIC_TIMER_VECTOR, (u32)irq_apic_timer, 0x08, 0x8E);
+    idt_set_gate(APIC_RESCHED_VECTOR, (u32)irq_resched, 0x08, 0x8E);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (u32)irq_spurious, 0x08, 0x8E);
     
     // Remap PIC
     outb(0x20, 0x11);
@@ -131,6 +143,11 @@ void init_idt(void) {
     idt_flush((u32)&idtp);
 }
 
+// APs share the BSP's IDT
+void idt_load(void) {
+    idt_flush((u32)&idtp);
+}
+
 void outb(u16 port, u8 val) {
     asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
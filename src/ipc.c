@@ -0,0 +1,455 @@
+#include "ipc.h"
+#include "memory.h"
+#include "mutex.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "kernel.h"
+#include "vga.h"
+
+// Message queues
+//
+// The ring is single-producer/single-consumer, so the fast path needs no
+// lock: the sender fills a slot and then publishes tail, the receiver
+// copies a slot out and then publishes head, and each index is written
+// by one side only. The two sides' fields sit on separate cache lines.
+//
+// A side that finds the ring full (or empty) raises its waiting flag and
+// sleeps on its wait queue; the other side checks the flag after
+// publishing. A full barrier between the store and the load on both sides
+// means either the sleeper sees the update or the waker sees the flag, so
+// the common case never touches the wait queue at all.
+//
+// A handle is the queue index times two plus the end it is bound to, with
+// a generation in the upper bits. Every open of a slot takes the slot's
+// next generation, so a handle kept after its end was closed no longer
+// matches once the end is opened again or the slot holds another queue.
+//
+// Each call holds a reference on its queue from lookup until it is done,
+// so an ipc_close() racing with it can't free the queue underneath; the
+// table holds one more until both ends are closed.
+
+#define CACHE_LINE 64
+
+#define HANDLE_GEN_SHIFT 16
+#define HANDLE_GEN_MASK 0x7FFF  // Keeps handles positive
+#define HANDLE_SLOT(handle) ((u32)(handle) & ((1 << HANDLE_GEN_SHIFT) - 1))
+
+typedef struct {
+    // Sender side
+    volatile u32 tail;
+    volatile u32 send_waiting;
+    u8 pad0[CACHE_LINE - 8];
+    
+    // Receiver side
+    volatile u32 head;
+    volatile u32 recv_waiting;
+    u8 pad1[CACHE_LINE - 8];
+    
+    char name[IPC_NAME_MAX];
+    u32 bound;            // Ends currently open
+    u32 gen[2];           // Generation of each end's handle
+    volatile u32 closed;  // Ends opened and closed again
+    volatile u32 refs;    // The table's, plus one per call using the queue
+    wait_queue_t send_wait;
+    wait_queue_t recv_wait;
+    ipc_msg_t slots[IPC_RING_SIZE];
+} ipc_queue_t;
+
+static ipc_queue_t* queues[IPC_MAX_QUEUES];
+static u32 slot_gen[IPC_MAX_QUEUES];
+static mutex_t queues_lock;  // Opening and closing; not the rings
+static spinlock_t table_lock = SPINLOCK_INIT("ipc table");  // queues[], bound, gen
+static bool initialized = false;
+
+void ipc_init(void) {
+    if (initialized) return;
+    
+    memset(queues, 0, sizeof(queues));
+    memset(slot_gen, 0, sizeof(slot_gen));
+    mutex_init(&queues_lock);
+    initialized = true;
+}
+
+static void destroy_queue(ipc_queue_t* queue);
+
+// The queue a handle names, with a reference the caller drops with
+// queue_put(), or NULL if the handle is stale
+static ipc_queue_t* queue_get(int handle, u32 end) {
+    if (handle < 0) {
+        return NULL;
+    }
+    u32 slot = HANDLE_SLOT(handle);
+    if (slot >= IPC_MAX_QUEUES * 2 || (slot & 1 ? IPC_RECV : IPC_SEND) != end) {
+        return NULL;
+    }
+    
+    u32 flags = spin_lock_irqsave(&table_lock);
+    ipc_queue_t* queue = queues[slot >> 1];
+    if (queue && (queue->bound & end) && queue->gen[slot & 1] == (u32)handle >> HANDLE_GEN_SHIFT) {
+        __sync_fetch_and_add(&queue->refs, 1);
+    } else {
+        queue = NULL;
+    }
+    spin_unlock_irqrestore(&table_lock, flags);
+    return queue;
+}
+
+static void queue_put(ipc_queue_t* queue) {
+    if (__sync_sub_and_fetch(&queue->refs, 1) == 0) {
+        destroy_queue(queue);
+    }
+}
+
+static bool can_send(ipc_queue_t* queue) {
+    return queue->tail - queue->head < IPC_RING_SIZE || (queue->closed & IPC_RECV);
+}
+
+static bool can_recv(ipc_queue_t* queue) {
+    return queue->head != queue->tail || (queue->closed & IPC_SEND);
+}
+
+// Sleep on wq until ready(queue)
+static void ring_wait(ipc_queue_t* queue, wait_queue_t* wq, volatile u32* waiting,
+                      bool (*ready)(ipc_queue_t*)) {
+    u32 flags = spin_lock_irqsave(&wq->lock);
+    *waiting = 1;
+    __sync_synchronize();
+    while (!ready(queue)) {
+        sleep_on(wq);
+    }
+    *waiting = 0;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Called after publishing an index
+static void ring_notify(wait_queue_t* wq, volatile u32* waiting) {
+    __sync_synchronize();
+    if (*waiting) {
+        wake_up(wq);
+    }
+}
+
+static bool ring_put(ipc_queue_t* queue, const ipc_msg_t* msg) {
+    u32 tail = queue->tail;
+    if (tail - queue->head == IPC_RING_SIZE) {
+        return false;
+    }
+    queue->slots[tail & (IPC_RING_SIZE - 1)] = *msg;
+    asm volatile("" : : : "memory");  // Slot before index
+    queue->tail = tail + 1;
+    return true;
+}
+
+static bool ring_get(ipc_queue_t* queue, ipc_msg_t* msg) {
+    u32 head = queue->head;
+    if (head == queue->tail) {
+        return false;
+    }
+    asm volatile("" : : : "memory");  // Index before slot
+    *msg = queue->slots[head & (IPC_RING_SIZE - 1)];
+    asm volatile("" : : : "memory");  // Slot before handing it back
+    queue->head = head + 1;
+    return true;
+}
+
+static void destroy_queue(ipc_queue_t* queue) {
+    // Pages still in flight belong to nobody now
+    ipc_msg_t msg;
+    while (ring_get(queue, &msg)) {
+        if (msg.page) {
+            pmm_free_frame(msg.page);
+        }
+    }
+    kfree(queue);
+}
+
+// Bind to one end (IPC_SEND or IPC_RECV) of the queue called name,
+// creating it if needed. Returns a handle, or -1 if the end is already
+// bound or there is no room.
+int ipc_open(const char* name, u32 end) {
+    if (!initialized || (end != IPC_SEND && end != IPC_RECV) || strlen(name) >= IPC_NAME_MAX) {
+        return -1;
+    }
+    
+    mutex_lock(&queues_lock);
+    int index = -1;
+    int free_index = -1;
+    for (int i = 0; i < IPC_MAX_QUEUES; i++) {
+        if (queues[i] && strcmp(queues[i]->name, name) == 0) {
+            index = i;
+            break;
+        }
+        if (!queues[i] && free_index == -1) {
+            free_index = i;
+        }
+    }
+    
+    if (index == -1 && free_index != -1) {
+        ipc_queue_t* queue = (ipc_queue_t*)kmalloc(sizeof(ipc_queue_t));
+        if (queue) {
+            memset(queue, 0, sizeof(ipc_queue_t));
+            strcpy(queue->name, name);
+            wait_queue_init(&queue->send_wait);
+            wait_queue_init(&queue->recv_wait);
+            queue->refs = 1;
+            u32 flags = spin_lock_irqsave(&table_lock);
+            queues[free_index] = queue;
+            spin_unlock_irqrestore(&table_lock, flags);
+            index = free_index;
+        }
+    }
+    
+    int handle = -1;
+    if (index != -1 && !(queues[index]->bound & end)) {
+        ipc_queue_t* queue = queues[index];
+        u32 flags = spin_lock_irqsave(&table_lock);
+        u32 gen = slot_gen[index] = (slot_gen[index] + 1) & HANDLE_GEN_MASK;
+        queue->gen[end == IPC_RECV] = gen;
+        queue->bound |= end;
+        __sync_fetch_and_and(&queue->closed, ~end);
+        spin_unlock_irqrestore(&table_lock, flags);
+        handle = (gen << HANDLE_GEN_SHIFT) | (index * 2 + (end == IPC_RECV));
+    }
+    mutex_unlock(&queues_lock);
+    return handle;
+}
+
+// Unbind an end, waking the other side if it is blocked on us. The queue
+// leaves the table when neither end is bound, and is freed once the last
+// call using it returns.
+void ipc_close(int handle) {
+    if (!initialized) {
+        return;
+    }
+    
+    u32 end = handle & 1 ? IPC_RECV : IPC_SEND;
+    mutex_lock(&queues_lock);
+    ipc_queue_t* queue = queue_get(handle, end);
+    if (!queue) {
+        mutex_unlock(&queues_lock);
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&table_lock);
+    queue->bound &= ~end;
+    __sync_fetch_and_or(&queue->closed, end);
+    bool unused = !queue->bound;
+    if (unused) {
+        queues[HANDLE_SLOT(handle) >> 1] = NULL;
+    }
+    spin_unlock_irqrestore(&table_lock, flags);
+    
+    wake_up_all(&queue->send_wait);
+    wake_up_all(&queue->recv_wait);
+    if (unused) {
+        queue_put(queue);  // The table's reference
+    }
+    mutex_unlock(&queues_lock);
+    queue_put(queue);
+}
+
+bool ipc_try_send(int handle, const ipc_msg_t* msg) {
+    ipc_queue_t* queue = queue_get(handle, IPC_SEND);
+    if (!queue) {
+        return false;
+    }
+    bool sent = ring_put(queue, msg);
+    if (sent) {
+        ring_notify(&queue->recv_wait, &queue->recv_waiting);
+    }
+    queue_put(queue);
+    return sent;
+}
+
+bool ipc_try_recv(int handle, ipc_msg_t* msg) {
+    ipc_queue_t* queue = queue_get(handle, IPC_RECV);
+    if (!queue) {
+        return false;
+    }
+    bool received = ring_get(queue, msg);
+    if (received) {
+        ring_notify(&queue->send_wait, &queue->send_waiting);
+    }
+    queue_put(queue);
+    return received;
+}
+
+// Blocks while the ring is full. Fails if the receiver has closed.
+bool ipc_send(int handle, const ipc_msg_t* msg) {
+    ipc_queue_t* queue = queue_get(handle, IPC_SEND);
+    if (!queue) {
+        return false;
+    }
+    
+    bool sent = true;
+    while (!ring_put(queue, msg)) {
+        if (queue->closed & IPC_RECV) {
+            sent = false;
+            break;
+        }
+        ring_wait(queue, &queue->send_wait, &queue->send_waiting, can_send);
+    }
+    if (sent) {
+        ring_notify(&queue->recv_wait, &queue->recv_waiting);
+    }
+    queue_put(queue);
+    return sent;
+}
+
+// Blocks while the ring is empty. Fails once the sender has closed and
+// everything it sent has been received.
+bool ipc_recv(int handle, ipc_msg_t* msg) {
+    ipc_queue_t* queue = queue_get(handle, IPC_RECV);
+    if (!queue) {
+        return false;
+    }
+    
+    bool received = true;
+    while (!ring_get(queue, msg)) {
+        if (queue->closed & IPC_SEND) {
+            received = false;
+            break;
+        }
+        ring_wait(queue, &queue->recv_wait, &queue->recv_waiting, can_recv);
+    }
+    if (received) {
+        ring_notify(&queue->send_wait, &queue->send_waiting);
+    }
+    queue_put(queue);
+    return received;
+}
+
+// Hand a frame to the receiver. On failure the caller still owns it.
+bool ipc_send_page(int handle, u32 tag, u32 page, u32 len) {
+    ipc_msg_t msg;
+    msg.tag = tag;
+    msg.len = len < PAGE_SIZE ? len : PAGE_SIZE;
+    msg.page = page;
+    return ipc_send(handle, &msg);
+}
+
+// Benchmark: streaming throughput from a producer process to the shell,
+// then round-trip latency through an echo process
+
+#define BENCH_MESSAGES 1000000
+#define BENCH_PAGES 1000
+#define BENCH_ROUND_TRIPS 10000
+
+static void bench_producer(void) {
+    int out = ipc_open("ipcbench", IPC_SEND);
+    ipc_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.len = sizeof(u32);
+    for (u32 i = 1; i <= BENCH_MESSAGES; i++) {
+        msg.tag = i;
+        ipc_send(out, &msg);
+    }
+    
+    // Then 4KB payloads by page transfer
+    for (u32 i = 0; i < BENCH_PAGES; i++) {
+        u32 page = pmm_alloc_frame();
+        if (!page || !ipc_send_page(out, 0, page, PAGE_SIZE)) {
+            if (page) {
+                pmm_free_frame(page);
+            }
+            break;
+        }
+    }
+    ipc_close(out);
+}
+
+static void bench_echo(void) {
+    int in = ipc_open("ipcping", IPC_RECV);
+    int out = ipc_open("ipcpong", IPC_SEND);
+    ipc_msg_t msg;
+    while (ipc_recv(in, &msg) && msg.tag) {
+        ipc_send(out, &msg);
+    }
+    ipc_close(in);
+    ipc_close(out);
+}
+
+static void print_rate(const char* what, u32 count, u64 cycles, u32 tsc_per_ms) {
+    vga_puts(what);
+    vga_put_dec(div_u64_u32(cycles, count ? count : 1));
+    vga_puts(" cycles/msg");
+    u32 ms = div_u64_u32(cycles, tsc_per_ms);
+    if (ms) {
+        vga_puts(", ");
+        vga_put_dec(div_u64_u32((u64)count * 1000, ms));
+        vga_puts(" msgs/s");
+    }
+    vga_puts("\n");
+}
+
+void ipc_benchmark(void) {
+    u32 tsc_per_ms = timer_tsc_per_ms();
+    if (!tsc_per_ms) {
+        tsc_per_ms = 1;
+    }
+    u32 priority = get_current_process()->priority;
+    
+    // Throughput
+    int in = ipc_open("ipcbench", IPC_RECV);
+    if (in < 0 || !process_create(bench_producer, priority)) {
+        vga_puts("ipcbench: setup failed\n");
+        ipc_close(in);
+        return;
+    }
+    ipc_msg_t msg;
+    u32 received = 0;
+    u32 pages = 0;
+    u32 errors = 0;
+    u64 start = rdtsc();
+    u64 small_end = start;
+    while (ipc_recv(in, &msg)) {
+        if (msg.page) {
+            pmm_free_frame(msg.page);
+            pages++;
+        } else {
+            received++;
+            if (msg.tag != received) {
+                errors++;
+            }
+            small_end = rdtsc();
+        }
+    }
+    u64 end = rdtsc();
+    ipc_close(in);
+    print_rate("stream: ", received, small_end - start, tsc_per_ms);
+    print_rate("pages:  ", pages, end - small_end, tsc_per_ms);
+    if (errors) {
+        vga_put_dec(errors);
+        vga_puts(" messages out of order\n");
+    }
+    
+    // Ping-pong latency
+    int ping = ipc_open("ipcping", IPC_SEND);
+    int pong = ipc_open("ipcpong", IPC_RECV);
+    if (ping < 0 || pong < 0 || !process_create(bench_echo, priority)) {
+        vga_puts("ipcbench: setup failed\n");
+        ipc_close(ping);
+        ipc_close(pong);
+        return;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.tag = 1;
+    start = rdtsc();
+    for (u32 i = 0; i < BENCH_ROUND_TRIPS; i++) {
+        ipc_send(ping, &msg);
+        ipc_recv(pong, &msg);
+    }
+    end = rdtsc();
+    msg.tag = 0;
+    ipc_send(ping, &msg);
+    ipc_close(ping);
+    ipc_close(pong);
+    
+    vga_puts("ping-pong: ");
+    vga_put_dec(div_u64_u32(end - start, BENCH_ROUND_TRIPS));
+    vga_puts(" cycles/round trip over ");
+    vga_put_dec(BENCH_ROUND_TRIPS);
+    vga_puts(" round trips\n");
+}
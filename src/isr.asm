@@ -3,9 +3,12 @@ global isr0, isr1, isr2, isr3, isr4, isr5, isr6, isr7
 global isr8, isr9, isr10, isr11, isr12, isr13, isr14, isr15
 global isr16, isr17, isr18, isr19, isr20, isr21, isr22, isr23
 global isr24, isr25, isr26, isr27, isr28, isr29, isr30, isr31
-global irq0, irq1
+global irq0, irq1, irq4
+global irq_apic_timer, irq_resched, irq_spurious
+global double_fault_task
 extern isr_handler
 extern irq_handler
+extern double_fault_handler
 
 ; Common ISR handler
 isr_common_stub:
@@ -14,11 +17,9 @@ isr_common_stub:
     push es
     push fs
     push gs
-    mov ax, 0x10
+    mov ax, 0x10  ; %gs keeps the per-CPU segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov eax, esp
     push eax
     call isr_handler
@@ -38,11 +39,9 @@ irq_common_stub:
     push es
     push fs
     push gs
-    mov ax, 0x10
+    mov ax, 0x10  ; %gs keeps the per-CPU segment
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov eax, esp
     push eax
     call irq_handler
@@ -104,6 +103,15 @@ ISR_NOERRCODE 29
 ISR_NOERRCODE 30
 ISR_NOERRCODE 31
 
+; Double fault task, entered through a task gate on its own stack. The
+; iret switches back to the interrupted task; the next double fault
+; resumes at the jmp.
+double_fault_task:
+    add esp, 4  ; Error code
+    call double_fault_handler
+    iret
+    jmp double_fault_task
+
 ; IRQ handlers
 irq0:
     push byte 0
@@ -114,3 +122,23 @@ irq1:
     push byte 0
     push byte 33  ; IRQ1 = 33
     jmp irq_common_stub
+
+irq4:
+    push byte 0
+    push byte 36  ; IRQ4 = 36
+    jmp irq_common_stub
+
+; Local APIC interrupts
+irq_apic_timer:
+    push byte 0
+    push byte 48  ; APIC_TIMER_VECTOR
+    jmp irq_common_stub
+
+irq_resched:
+    push byte 0
+    push byte 49  ; APIC_RESCHED_VECTOR
+    jmp irq_common_stub
+
+; Spurious interrupts must not be acknowledged
+irq_spurious:
+    iret
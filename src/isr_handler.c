@@ -1,50 +1,94 @@
 #include "idt.h"
 #include "kernel.h"
-#include "vga.h"
+#include "klog.h"
+#include "console.h"
+#include "scheduler.h"
+#include "apic.h"
+#include "smp.h"
+#include "kstack.h"
 
-extern void (*interrupt_handlers[256])(void);
+extern interrupt_handler_t interrupt_handlers[256];
+
+static bottom_half_t bottom_halves[BH_MAX];
+static volatile u32 bh_pending = 0;
 
 // Forward declarations for outb
 void outb(u16 port, u8 val);
 
-void isr_handler(registers_t regs) {
-    if (interrupt_handlers[regs.int_no] != 0) {
-        interrupt_handlers[regs.int_no]();
-    } else {
-        vga_puts("Unhandled interrupt: ");
-        // Simple number to string conversion
-        char num[32];
-        int n = regs.int_no;
-        int i = 0;
-        if (n == 0) {
-            num[i++] = '0';
-        } else {
-            while (n > 0) {
-                num[i++] = '0' + (n % 10);
-                n /= 10;
+void register_bottom_half(u32 nr, bottom_half_t handler) {
+    if (nr < BH_MAX) {
+        bottom_halves[nr] = handler;
+    }
+}
+
+// Safe from any context; the bottom half runs on the way out of the next
+// hardware interrupt on whichever CPU takes it
+void raise_bottom_half(u32 nr) {
+    if (nr < BH_MAX) {
+        __sync_fetch_and_or(&bh_pending, 1u << nr);
+    }
+}
+
+// Interrupts stay off: process kernel stacks are small and a nested IRQ
+// could preempt into the scheduler mid-way. A bottom half raised again
+// while running is picked up by the next pass.
+static void run_bottom_halves(void) {
+    u32 pending;
+    while ((pending = __sync_fetch_and_and(&bh_pending, 0)) != 0) {
+        for (u32 nr = 0; pending; nr++, pending >>= 1) {
+            if ((pending & 1) && bottom_halves[nr]) {
+                bottom_halves[nr]();
             }
         }
-        num[i] = '\0';
-        // Reverse
-        for (int j = 0; j < i / 2; j++) {
-            char tmp = num[j];
-            num[j] = num[i - 1 - j];
-            num[i - 1 - j] = tmp;
-        }
-        vga_puts(num);
-        vga_puts("\n");
     }
 }
 
-void irq_handler(registers_t regs) {
-    // Send EOI to PIC
-    if (regs.int_no >= 40) {
-        outb(0xA0, 0x20);  // Slave PIC
+// The common stubs pass a pointer to the saved frame, so handlers can
+// inspect the error code and faulting context
+void isr_handler(registers_t* regs) {
+    if (interrupt_handlers[regs->int_no] != 0) {
+        interrupt_handlers[regs->int_no](regs);
+    } else {
+        klog(KLOG_WARN, "Unhandled interrupt %u", regs->int_no);
+    }
+}
+
+// Runs in the double fault task; the interrupted context is saved in this
+// CPU's main TSS
+void double_fault_handler(void) {
+    tss_t* tss = &this_cpu()->tss;
+    if (kstack_handle_double_fault(tss)) {
+        return;
     }
-    outb(0x20, 0x20);  // Master PIC
     
-    if (interrupt_handlers[regs.int_no] != 0) {
-        interrupt_handlers[regs.int_no]();
+    klog(KLOG_ERR, "Double fault at eip %p, esp %p, system halted", tss->eip, tss->esp);
+    klog_flush();
+    console_flush();
+    while (1) {
+        asm volatile("cli; hlt");
+    }
+}
+
+void irq_handler(registers_t* regs) {
+    // Send EOI to the local APIC or the PIC
+    if (regs->int_no >= APIC_TIMER_VECTOR) {
+        lapic_eoi();
+    } else {
+        if (regs->int_no >= 40) {
+            outb(0xA0, 0x20);  // Slave PIC
+        }
+        outb(0x20, 0x20);  // Master PIC
     }
+    
+    if (interrupt_handlers[regs->int_no] != 0) {
+        interrupt_handlers[regs->int_no](regs);
+    }
+    
+    if (bh_pending) {
+        run_bottom_halves();
+    }
+    
+    // Switch now if the handler woke or preempted something
+    scheduler_irq_exit();
 }
 
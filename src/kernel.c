@@ -1,36 +1,101 @@
 #include "kernel.h"
 #include "gdt.h"
 #include "idt.h"
+#include "multiboot.h"
+#include "pmm.h"
+#include "paging.h"
 #include "memory.h"
 #include "scheduler.h"
+#include "smp.h"
+#include "timer.h"
 #include "keyboard.h"
+#include "tty.h"
 #include "vga.h"
+#include "console.h"
+#include "serial.h"
+#include "klog.h"
 #include "fs.h"
 #include "shell.h"
+#include "fpu.h"
+#include "ipc.h"
 
-void kernel_main(void) {
+void kernel_main(u32 magic, u32 mboot_addr) {
     // Initialize VGA
     vga_init();
     vga_clear();
+    
+    // Mirror the console to COM1 from the first message on
+    console_init();
     vga_puts("Custom OS Kernel v1.0\n");
     vga_puts("Initializing system...\n");
+    if (serial_present()) {
+        vga_puts("  Serial console on COM1 at ");
+        vga_put_dec(SERIAL_BASE_BAUD / SERIAL_DIVISOR);
+        vga_puts(" baud\n");
+    }
+    
+    // Initialize physical memory from the bootloader's memory map
+    vga_puts("Initializing physical memory...\n");
+    multiboot_info_t* mbi = NULL;
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+        mbi = (multiboot_info_t*)mboot_addr;
+    } else {
+        vga_puts("  No Multiboot info, assuming 8MB of RAM\n");
+    }
+    pmm_init(mbi);
+    vga_puts("  ");
+    vga_put_dec((pmm_total_frames() * PAGE_SIZE) >> 20);
+    vga_puts(" MB usable, ");
+    vga_put_dec((pmm_free_frame_count() * PAGE_SIZE) >> 20);
+    vga_puts(" MB free\n");
+    
+    // Identity-map RAM and turn on demand paging
+    vga_puts("Enabling paging...\n");
+    paging_init();
+    gdt_init_double_fault(&cpus[0]);
     
     // Initialize memory management
     vga_puts("Initializing memory manager...\n");
     memory_init();
+    memory_self_check();
     
     // Initialize file system
     vga_puts("Initializing file system...\n");
     fs_init();
     
-    // Initialize keyboard
+    // Initialize keyboard and the tty its keys go to
     vga_puts("Initializing keyboard driver...\n");
+    tty_init();
     keyboard_init();
     
+    // Initialize timer; the scheduler sizes its time slices from the rate
+    vga_puts("Initializing timer...\n");
+    timer_init(TIMER_HZ);
+    
     // Initialize scheduler
     vga_puts("Initializing scheduler...\n");
     scheduler_init();
     
+    // Message queues, before any process can open one
+    vga_puts("Initializing IPC...\n");
+    ipc_init();
+    
+    // FPU and SSE, switched lazily per process, so after the scheduler.
+    // The string functions pick their SSE2 or ERMS variants once it's up.
+    vga_puts("Initializing FPU/SSE...\n");
+    fpu_init();
+    string_init();
+    
+    // Start the other processors once the scheduler can take them
+    vga_puts("Starting application processors...\n");
+    smp_init();
+    vga_puts("  ");
+    vga_put_dec(cpu_count);
+    vga_puts(cpu_count == 1 ? " CPU online\n" : " CPUs online\n");
+    
+    // Log records are printed by klogd from now on
+    klog_start();
+    
     vga_puts("\nSystem initialized successfully!\n");
     vga_puts("Starting shell...\n\n");
     
@@ -2,13 +2,32 @@
 #include "idt.h"
 #include "kernel.h"
 #include "vga.h"
+#include "tty.h"
 
-#define KEYBOARD_BUFFER_SIZE 256
+// Modifier and lock keys; the right Ctrl and Alt send the left codes with
+// the 0xE0 prefix
+#define SCANCODE_LEFT_SHIFT 0x2A
+#define SCANCODE_RIGHT_SHIFT 0x36
+#define SCANCODE_CTRL 0x1D
+#define SCANCODE_ALT 0x38
+#define SCANCODE_CAPS_LOCK 0x3A
+#define SCANCODE_RELEASE 0x80
 
-static char keyboard_buffer[KEYBOARD_BUFFER_SIZE];
-static u32 keyboard_head = 0;
-static u32 keyboard_tail = 0;
+// Extended (0xE0-prefixed) scancodes
+#define SCANCODE_EXTENDED 0xE0
+#define SCANCODE_KEYPAD_ENTER 0x1C
+#define SCANCODE_KEYPAD_SLASH 0x35
+#define SCANCODE_PAGE_UP 0x49
+#define SCANCODE_PAGE_DOWN 0x51
+
+#define MOD_SHIFT 0x01
+#define MOD_CTRL  0x02
+#define MOD_ALT   0x04
+#define MOD_CAPS  0x08  // Caps Lock toggled on
+
+static u32 modifiers = 0;
 static bool keyboard_initialized = false;
+static bool extended = false;  // Last byte was the 0xE0 prefix
 
 // PS/2 keyboard scancode to ASCII mapping (US layout)
 static const char scancode_to_ascii[128] = {
@@ -16,53 +35,134 @@ static const char scancode_to_ascii[128] = {
     '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
     0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`', 0,
     '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0, '*', 0, ' ',
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '7', '8', '9', '-', '4',
-    '5', '6', '+', '1', '2', '3', '0', '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '7', '8', '9', '-', '4', '5',
+    '6', '+', '1', '2', '3', '0', '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0
+};
+
+// The same keys with Shift held
+static const char scancode_to_ascii_shift[128] = {
+    0,  27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+    '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+    0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0,
+    '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0, '*', 0, ' ',
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '7', '8', '9', '-', '4', '5',
+    '6', '+', '1', '2', '3', '0', '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    0, 0, 0, 0, 0, 0, 0
 };
 
-static void keyboard_handler(void) {
+// Presses and releases of Shift, Ctrl and Alt, and Caps Lock presses.
+// True if the code was one of them.
+static bool track_modifier(u8 code, bool released, bool was_extended) {
+    u32 mod;
+    switch (code) {
+        case SCANCODE_LEFT_SHIFT:
+        case SCANCODE_RIGHT_SHIFT:
+            // E0 2A/E0 36 are fake shifts around Print Screen and the
+            // navigation keys
+            if (was_extended) {
+                return true;
+            }
+            mod = MOD_SHIFT;
+            break;
+        case SCANCODE_CTRL:
+            mod = MOD_CTRL;
+            break;
+        case SCANCODE_ALT:
+            mod = MOD_ALT;
+            break;
+        case SCANCODE_CAPS_LOCK:
+            if (!released) {
+                modifiers ^= MOD_CAPS;
+            }
+            return true;
+        default:
+            return false;
+    }
+    
+    if (released) {
+        modifiers &= ~mod;
+    } else {
+        modifiers |= mod;
+    }
+    return true;
+}
+
+static char translate(u8 code) {
+    char c = scancode_to_ascii[code];
+    bool letter = c >= 'a' && c <= 'z';
+    bool shift = (modifiers & MOD_SHIFT) != 0;
+    if (letter && (modifiers & MOD_CAPS)) {
+        shift = !shift;
+    }
+    if (shift) {
+        c = scancode_to_ascii_shift[code];
+    }
+    
+    // Ctrl+letter and friends give the control characters 0x00-0x1F
+    if ((modifiers & MOD_CTRL) && c >= '@' && c <= '~') {
+        c = TTY_CTRL(c);
+    }
+    return c;
+}
+
+// Top half: decode the scancode and pass keys on to the tty
+static void keyboard_handler(registers_t* regs) {
+    (void)regs;
     u8 scancode = inb(KEYBOARD_DATA_PORT);
+    if (scancode == SCANCODE_EXTENDED) {
+        extended = true;
+        return;
+    }
+    bool was_extended = extended;
+    extended = false;
     
-    if (scancode & 0x80) {
-        // Key release - ignore for now
+    bool released = (scancode & SCANCODE_RELEASE) != 0;
+    u8 code = scancode & ~SCANCODE_RELEASE;
+    if (track_modifier(code, released, was_extended) || released) {
         return;
     }
     
-    char c = scancode_to_ascii[scancode];
-    if (c != 0) {
-        u32 next = (keyboard_tail + 1) % KEYBOARD_BUFFER_SIZE;
-        if (next != keyboard_head) {
-            keyboard_buffer[keyboard_tail] = c;
-            keyboard_tail = next;
+    char c = 0;
+    if (was_extended) {
+        // Page Up/Down scroll the console; the keypad's 9 and 3 send the
+        // same codes without the prefix. Arrows and the rest of the
+        // navigation block have no meaning to the line discipline yet.
+        switch (code) {
+            case SCANCODE_PAGE_UP:
+                vga_scroll_view(VGA_HEIGHT / 2);
+                return;
+            case SCANCODE_PAGE_DOWN:
+                vga_scroll_view(-(VGA_HEIGHT / 2));
+                return;
+            case SCANCODE_KEYPAD_ENTER:
+                c = '\n';
+                break;
+            case SCANCODE_KEYPAD_SLASH:
+                c = '/';
+                break;
+            default:
+                return;
         }
+    } else {
+        c = translate(code);
+    }
+    
+    if (c != 0) {
+        tty_input(c);
     }
 }
 
 void keyboard_init(void) {
     if (keyboard_initialized) return;
     
-    keyboard_head = 0;
-    keyboard_tail = 0;
-    memset(keyboard_buffer, 0, KEYBOARD_BUFFER_SIZE);
+    modifiers = 0;
+    extended = false;
     
     // Register keyboard interrupt handler
     register_interrupt_handler(IRQ1, keyboard_handler);
     
     keyboard_initialized = true;
 }
-
-char keyboard_getchar(void) {
-    while (!keyboard_has_input()) {
-        asm volatile("hlt");
-    }
-    
-    char c = keyboard_buffer[keyboard_head];
-    keyboard_head = (keyboard_head + 1) % KEYBOARD_BUFFER_SIZE;
-    return c;
-}
-
-bool keyboard_has_input(void) {
-    return keyboard_head != keyboard_tail;
-}
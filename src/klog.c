@@ -0,0 +1,362 @@
+#include "klog.h"
+#include "kernel.h"
+#include "console.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "vga.h"
+
+// Kernel log
+//
+// klog() formats its message straight into a slot of a ring of fixed-size
+// records and returns; nothing touches a device, so it is cheap enough
+// for interrupt handlers and hot paths. A writer claims a sequence number
+// with one atomic add, which picks the slot, clears the slot's sequence
+// while it fills the record, then stores its sequence number plus one to
+// publish it. There are no locks, so any CPU and any context can log.
+//
+// Records are printed to the console later, by the klogd process, by a
+// CPU about to go idle, or before the kernel halts. Until klogd is
+// started every record is printed as soon as it is written. The ring
+// keeps the last KLOG_RECORDS records for dmesg; a reader that falls a
+// whole ring behind skips the records it lost and reports how many.
+typedef struct {
+    volatile u32 seq;  // Sequence number + 1 once written, 0 while filling
+    u8 level;
+    u8 cpu;
+    u16 len;
+    u64 tsc;
+    char text[KLOG_TEXT_SIZE];
+} klog_record_t;
+
+typedef enum {
+    RECORD_OK,
+    RECORD_NOT_READY,
+    RECORD_LOST,
+} record_state_t;
+
+static klog_record_t ring[KLOG_RECORDS];
+static volatile u32 klog_head = 0;  // Next sequence number to hand out
+static u32 klog_tail = 0;           // Next record to print
+static u32 lost = 0;                // Records skipped since the last report
+static u32 console_level = KLOG_INFO;
+static bool deferred = false;
+static spinlock_t drain_lock = SPINLOCK_INIT("klog");
+
+static const char* level_prefix[] = { "error: ", "warning: ", "", "debug: " };
+
+// Divide by a small base, returning the remainder in rem; 64-bit division
+// isn't available without libgcc
+static u64 divmod(u64 value, u32 base, u32* rem) {
+    u32 high = (u32)(value >> 32);
+    u32 low = (u32)value;
+    u32 quotient = div_u64_u32(((u64)(high % base) << 32) | low, base);
+    *rem = low - quotient * base;
+    return ((u64)(high / base) << 32) | quotient;
+}
+
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t pos;
+} output_t;
+
+static inline void emit(output_t* out, char c) {
+    if (out->pos + 1 < out->size) {
+        out->buf[out->pos] = c;
+    }
+    out->pos++;
+}
+
+static void emit_padded(output_t* out, const char* str, u32 len, u32 width, bool left, char pad) {
+    for (u32 i = len; !left && i < width; i++) {
+        emit(out, pad);
+    }
+    for (u32 i = 0; i < len; i++) {
+        emit(out, str[i]);
+    }
+    for (u32 i = len; left && i < width; i++) {
+        emit(out, ' ');
+    }
+}
+
+static void emit_number(output_t* out, u64 value, u32 base, bool upper, bool negative,
+                        u32 width, bool left, char pad) {
+    static const char lower_digits[] = "0123456789abcdef";
+    static const char upper_digits[] = "0123456789ABCDEF";
+    const char* digits = upper ? upper_digits : lower_digits;
+    char buf[24];
+    u32 i = sizeof(buf);
+    
+    do {
+        u32 digit;
+        if (value >> 32) {
+            value = divmod(value, base, &digit);
+        } else {
+            digit = (u32)value % base;
+            value = (u32)value / base;
+        }
+        buf[--i] = digits[digit];
+    } while (value);
+    
+    if (negative) {
+        // The sign goes before zero padding
+        if (pad == '0') {
+            emit(out, '-');
+            width = width ? width - 1 : 0;
+        } else {
+            buf[--i] = '-';
+        }
+    }
+    emit_padded(out, buf + i, sizeof(buf) - i, width, left, pad);
+}
+
+// vsnprintf for the kernel: %d %i %u %x %X %p %s %c and %%, with the - and
+// 0 flags, a field width and l/ll length modifiers. Returns the length the
+// whole output would have; buf always ends up terminated.
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args) {
+    output_t out = { buf, size, 0 };
+    
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            emit(&out, *fmt);
+            continue;
+        }
+        fmt++;
+        
+        bool left = false;
+        char pad = ' ';
+        for (; *fmt == '-' || *fmt == '0'; fmt++) {
+            if (*fmt == '-') {
+                left = true;
+            } else {
+                pad = '0';
+            }
+        }
+        if (left) {
+            pad = ' ';
+        }
+        u32 width = 0;
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++) {
+            width = width * 10 + (*fmt - '0');
+        }
+        u32 longs = 0;
+        for (; *fmt == 'l'; fmt++) {
+            longs++;
+        }
+        
+        switch (*fmt) {
+            case 'd':
+            case 'i': {
+                i64 value = longs >= 2 ? va_arg(args, i64) : va_arg(args, int);
+                bool negative = value < 0;
+                emit_number(&out, negative ? -(u64)value : (u64)value, 10, false, negative,
+                            width, left, pad);
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X': {
+                u64 value = longs >= 2 ? va_arg(args, u64) : va_arg(args, u32);
+                emit_number(&out, value, *fmt == 'u' ? 10 : 16, *fmt == 'X', false, width, left, pad);
+                break;
+            }
+            case 'p':
+                emit(&out, '0');
+                emit(&out, 'x');
+                emit_number(&out, (u32)va_arg(args, void*), 16, false, false, 8, false, '0');
+                break;
+            case 's': {
+                const char* str = va_arg(args, const char*);
+                if (!str) {
+                    str = "(null)";
+                }
+                emit_padded(&out, str, strlen(str), width, left, ' ');
+                break;
+            }
+            case 'c': {
+                char c = (char)va_arg(args, int);
+                emit_padded(&out, &c, 1, width, left, ' ');
+                break;
+            }
+            case '%':
+                emit(&out, '%');
+                break;
+            case '\0':
+                fmt--;  // Stray % at the end
+                break;
+            default:
+                emit(&out, '%');
+                emit(&out, *fmt);
+                break;
+        }
+    }
+    
+    if (size) {
+        buf[out.pos < size ? out.pos : size - 1] = '\0';
+    }
+    return out.pos;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+void klog(u32 level, const char* fmt, ...) {
+    u64 tsc = rdtsc();
+    u32 seq = __sync_fetch_and_add(&klog_head, 1);
+    klog_record_t* record = &ring[seq & (KLOG_RECORDS - 1)];
+    
+    // x86 keeps stores in order, so compiler barriers are enough to have
+    // the record filled in before it is published
+    record->seq = 0;
+    asm volatile("" : : : "memory");
+    record->tsc = tsc;
+    record->level = level;
+    record->cpu = this_cpu()->index;
+    
+    va_list args;
+    va_start(args, fmt);
+    u32 len = kvsnprintf(record->text, KLOG_TEXT_SIZE, fmt, args);
+    va_end(args);
+    if (len > KLOG_TEXT_SIZE - 1) {
+        len = KLOG_TEXT_SIZE - 1;
+    }
+    if (len && record->text[len - 1] == '\n') {
+        record->text[--len] = '\0';  // Each record is a line anyway
+    }
+    record->len = len;
+    
+    asm volatile("" : : : "memory");
+    record->seq = seq + 1;
+    
+    if (!deferred) {
+        klog_flush();
+    }
+}
+
+// Copy record seq out of the ring, unless it isn't published yet or a
+// writer a lap ahead has taken the slot, before or during the copy
+static record_state_t read_record(u32 seq, klog_record_t* out) {
+    klog_record_t* record = &ring[seq & (KLOG_RECORDS - 1)];
+    u32 published = record->seq;
+    if (published != seq + 1) {
+        return (published == 0 || published < seq + 1) ? RECORD_NOT_READY : RECORD_LOST;
+    }
+    
+    asm volatile("" : : : "memory");
+    out->level = record->level;
+    out->cpu = record->cpu;
+    out->len = record->len;
+    out->tsc = record->tsc;
+    memcpy(out->text, record->text, out->len);
+    out->text[out->len] = '\0';
+    asm volatile("" : : : "memory");
+    return record->seq == published ? RECORD_OK : RECORD_LOST;
+}
+
+static void print_record(const klog_record_t* record) {
+    char line[KLOG_TEXT_SIZE + 32];
+    u32 tsc_per_ms = timer_tsc_per_ms();
+    u32 ms = tsc_per_ms ? div_u64_u32(record->tsc, tsc_per_ms) : 0;
+    u32 len = ksnprintf(line, sizeof(line), "[%5u.%03u] %s%s\n", ms / 1000, ms % 1000,
+                        level_prefix[record->level & 3], record->text);
+    console_write(line, len < sizeof(line) ? len : sizeof(line) - 1);
+}
+
+// Print the records written since the last flush. One CPU drains at a
+// time; a record written meanwhile is printed by the same loop.
+void klog_flush(void) {
+    if (klog_tail == klog_head || !spin_trylock(&drain_lock)) {
+        return;
+    }
+    
+    while (klog_tail != klog_head) {
+        u32 head = klog_head;
+        if (head - klog_tail > KLOG_RECORDS) {
+            lost += head - KLOG_RECORDS - klog_tail;
+            klog_tail = head - KLOG_RECORDS;
+        }
+        
+        klog_record_t record;
+        record_state_t state = read_record(klog_tail, &record);
+        if (state == RECORD_NOT_READY) {
+            break;  // Its writer will flush, or the next drain will
+        }
+        if (state == RECORD_LOST) {
+            lost++;
+        } else if (record.level <= console_level) {
+            print_record(&record);
+        }
+        klog_tail++;
+    }
+    
+    if (lost) {
+        char line[48];
+        u32 len = ksnprintf(line, sizeof(line), "klog: %u records lost\n", lost);
+        console_write(line, len);
+        lost = 0;
+    }
+    spin_unlock(&drain_lock);
+}
+
+static void klogd(void) {
+    while (1) {
+        klog_flush();
+        sleep_ms(KLOG_FLUSH_MS);
+    }
+}
+
+// From here on records wait for klogd or an idle CPU
+void klog_start(void) {
+    if (process_create(klogd, DEFAULT_PRIORITY)) {
+        deferred = true;
+    }
+}
+
+void klog_set_console_level(u32 level) {
+    console_level = level;
+}
+
+// Replay every record still in the ring, whatever its level
+void klog_dump(void) {
+    u32 head = klog_head;
+    u32 seq = head > KLOG_RECORDS ? head - KLOG_RECORDS : 0;
+    for (; seq != head; seq++) {
+        klog_record_t record;
+        if (read_record(seq, &record) == RECORD_OK) {
+            print_record(&record);
+        }
+    }
+}
+
+// Cost of logging a short formatted record, which at debug level is only
+// stored
+#define KLOG_BENCH_RECORDS 128
+
+void klog_benchmark(void) {
+    u64 total = 0;
+    u64 best = ~0ULL;
+    for (u32 i = 0; i < KLOG_BENCH_RECORDS; i++) {
+        u64 start = rdtsc();
+        klog(KLOG_DEBUG, "klogbench: record %u of %u, value 0x%08x", i, KLOG_BENCH_RECORDS, i * 2654435761u);
+        u64 cycles = rdtsc() - start;
+        total += cycles;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    
+    vga_puts("klog: ");
+    vga_put_dec(div_u64_u32(total, KLOG_BENCH_RECORDS));
+    vga_puts(" cycles/record average, ");
+    vga_put_dec(div_u64_u32(best, 1));
+    vga_puts(" best, over ");
+    vga_put_dec(KLOG_BENCH_RECORDS);
+    vga_puts(" debug records\n");
+}
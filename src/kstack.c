@@ -0,0 +1,247 @@
+#include "kstack.h"
+#include "paging.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "kernel.h"
+#include "vga.h"
+#include "klog.h"
+
+// Kernel stack allocator
+//
+// Stacks live in their own region of the VMM window. Each slot is an
+// unmapped guard page followed by the stack pages, so running off the
+// bottom of a stack faults instead of corrupting whatever lies below.
+// Freed stacks stay mapped on a per-class free list and are handed out
+// again as is, so spawning normally costs one pop. Beyond KSTACK_CACHE_MAX
+// per class the pages go back to the frame allocator and the bare slot is
+// kept for reuse. List links and guard marks are kept out of line, indexed
+// by page, since bare slots have no memory to hold them.
+
+#define REGION_PAGES (KSTACK_REGION_SIZE / PAGE_SIZE)
+
+typedef struct {
+    u32 cached;      // Mapped stacks ready for use
+    u32 cached_count;
+    u32 bare;        // Slots whose pages were released
+} kstack_class_t;
+
+static u32 region_base = 0;
+static u32 region_next = 0;            // Bump pointer for new slots
+static kstack_class_t classes[KSTACK_CLASSES];
+static u32 next_link[REGION_PAGES];    // Free list link of the slot at a page
+static u32 guard_bitmap[REGION_PAGES / 32];
+static u32 stacks_in_use = 0;
+static spinlock_t kstack_lock = SPINLOCK_INIT("kstack");
+
+static inline u32 page_index(u32 addr) {
+    return (addr - region_base) >> PAGE_SHIFT;
+}
+
+// Class c holds stacks of (1 << c) pages; returns KSTACK_CLASSES if too big
+static u32 size_class(u32 size) {
+    u32 class = 0;
+    while (class < KSTACK_CLASSES && ((u32)KSTACK_MIN_SIZE << class) < size) {
+        class++;
+    }
+    return class;
+}
+
+static void list_push(u32* list, u32 base) {
+    next_link[page_index(base)] = *list;
+    *list = base;
+}
+
+static u32 list_pop(u32* list) {
+    u32 base = *list;
+    if (base) {
+        *list = next_link[page_index(base)];
+    }
+    return base;
+}
+
+static void unmap_pages(u32 base, u32 pages) {
+    for (u32 i = 0; i < pages; i++) {
+        u32 frame = paging_unmap_page(base + i * PAGE_SIZE);
+        if (frame) {
+            pmm_free_frame(frame);
+        }
+    }
+}
+
+static bool map_pages(u32 base, u32 pages) {
+    for (u32 i = 0; i < pages; i++) {
+        u32 frame = pmm_alloc_frame();
+        if (!frame || !paging_map_page(base + i * PAGE_SIZE, frame, PAGE_WRITE)) {
+            if (frame) {
+                pmm_free_frame(frame);
+            }
+            unmap_pages(base, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// A fault in the region that reached the page-fault handler: the stack
+// overflowed far enough for the exception frame to still fit
+static bool kstack_fault(u32 addr) {
+    if (!kstack_is_guard(addr)) {
+        return false;
+    }
+    
+    process_t* proc = get_current_process();
+    if (!proc->pid) {
+        return false;  // The idle task can't be killed
+    }
+    klog(KLOG_ERR, "Kernel stack overflow in process %u, killed", proc->pid);
+    process_exit(proc->pid);
+    return true;
+}
+
+void kstack_init(u32 default_size) {
+    if (region_base) return;
+    
+    region_base = (u32)vmm_reserve_unbacked(KSTACK_REGION_SIZE, kstack_fault);
+    region_next = region_base;
+    memset(classes, 0, sizeof(classes));
+    
+    // Build a few stacks up front so the first spawns are pops too
+    u32 bases[KSTACK_PREBUILT];
+    u32 count = 0;
+    while (count < KSTACK_PREBUILT) {
+        u32 size = default_size;
+        bases[count] = kstack_alloc(&size);
+        if (!bases[count]) {
+            break;
+        }
+        count++;
+    }
+    while (count > 0) {
+        count--;
+        kstack_free(bases[count], default_size);
+    }
+}
+
+// Returns the lowest address of a stack of at least *size bytes and rounds
+// *size up to what was allocated, or 0
+u32 kstack_alloc(u32* size) {
+    u32 class = size_class(*size);
+    if (!region_base || class == KSTACK_CLASSES) {
+        return 0;
+    }
+    u32 pages = 1u << class;
+    
+    u32 flags = spin_lock_irqsave(&kstack_lock);
+    kstack_class_t* c = &classes[class];
+    u32 base = list_pop(&c->cached);
+    if (base) {
+        c->cached_count--;
+    } else {
+        base = list_pop(&c->bare);
+        if (!base) {
+            // Carve a new slot: guard page, then the stack
+            u32 slot_size = (pages + 1) * PAGE_SIZE;
+            if (region_next + slot_size > region_base + KSTACK_REGION_SIZE) {
+                spin_unlock_irqrestore(&kstack_lock, flags);
+                return 0;
+            }
+            u32 guard = page_index(region_next);
+            guard_bitmap[guard >> 5] |= 1u << (guard & 31);
+            base = region_next + PAGE_SIZE;
+            region_next += slot_size;
+        }
+        if (!map_pages(base, pages)) {
+            list_push(&c->bare, base);
+            spin_unlock_irqrestore(&kstack_lock, flags);
+            return 0;
+        }
+    }
+    stacks_in_use++;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+    
+    *size = pages * PAGE_SIZE;
+    return base;
+}
+
+void kstack_free(u32 base, u32 size) {
+    u32 class = size_class(size);
+    if (!base || class == KSTACK_CLASSES) {
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&kstack_lock);
+    kstack_class_t* c = &classes[class];
+    if (c->cached_count < KSTACK_CACHE_MAX) {
+        list_push(&c->cached, base);
+        c->cached_count++;
+    } else {
+        // Other CPUs that ran on this stack may still have it in their
+        // TLBs; the slot gets new frames when it is reused
+        unmap_pages(base, 1u << class);
+        paging_flush_tlb_lazy();
+        list_push(&c->bare, base);
+    }
+    stacks_in_use--;
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
+
+bool kstack_is_guard(u32 addr) {
+    if (!region_base || addr < region_base || addr >= region_next) {
+        return false;
+    }
+    u32 page = page_index(addr);
+    return (guard_bitmap[page >> 5] >> (page & 31)) & 1;
+}
+
+// Resumed in place of the overflowing code, back on the top of its stack
+static void stack_overflow_exit(void) {
+    process_t* proc = get_current_process();
+    klog(KLOG_ERR, "Kernel stack overflow in process %u, killed", proc->pid);
+    process_exit(proc->pid);
+}
+
+// Called in the double fault task when pushing the page-fault frame itself
+// hit the guard page. tss holds the interrupted context; point it at
+// stack_overflow_exit() on a fresh stack top so the process can be killed.
+bool kstack_handle_double_fault(tss_t* tss) {
+    u32 cr2;
+    asm volatile("mov %%cr2, %0" : "=r"(cr2));
+    if (!kstack_is_guard(cr2) && !kstack_is_guard(tss->esp)) {
+        return false;
+    }
+    
+    process_t* proc = this_cpu()->sched.current;
+    if (!proc || !proc->pid || !proc->stack_base) {
+        return false;
+    }
+    
+    tss->esp = proc->stack_base + proc->stack_size - 16;
+    tss->ebp = 0;
+    tss->eip = (u32)stack_overflow_exit;
+    tss->eflags = 0x2;  // Interrupts off
+    tss->cs = GDT_KERNEL_CODE;
+    tss->ss = GDT_KERNEL_DATA;
+    tss->ds = GDT_KERNEL_DATA;
+    tss->es = GDT_KERNEL_DATA;
+    tss->fs = GDT_KERNEL_DATA;
+    tss->gs = GDT_PERCPU;
+    return true;
+}
+
+void kstack_stats(void) {
+    u32 flags = spin_lock_irqsave(&kstack_lock);
+    vga_puts("  stacks: ");
+    vga_put_dec(stacks_in_use);
+    vga_puts(" in use, cached");
+    for (u32 i = 0; i < KSTACK_CLASSES; i++) {
+        vga_puts(" ");
+        vga_put_dec(classes[i].cached_count);
+        vga_puts("x");
+        vga_put_dec((KSTACK_MIN_SIZE << i) / 1024);
+        vga_puts("K");
+    }
+    vga_puts("\n");
+    spin_unlock_irqrestore(&kstack_lock, flags);
+}
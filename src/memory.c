@@ -1,91 +1,133 @@
 #include "memory.h"
 #include "kernel.h"
 #include "vga.h"
+#include "pmm.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "timer.h"
 
 // Buddy allocator implementation
+//
+// The free lists are protected by buddy_lock, held with interrupts
+// disabled since the scheduler can free process memory from an interrupt.
+//
+// Free blocks sit on doubly linked per-order lists so any block can be
+// unlinked in O(1). Whether a block is free is tracked out of line, in one
+// bitmap per order with a bit per block of that order; the headers inside
+// the pool are never trusted for buddy state. free_area_mask has bit n set
+// while free_lists[n] is non-empty, so the smallest order able to serve a
+// request is a single bit scan.
+//
+// An allocated block keeps the same header at its start, holding only
+// the order. kmalloc_aligned() moves the returned pointer further into the
+// block, so it writes a second header just before that pointer, with
+// BUDDY_ALIGNED set in the order and next pointing back at the block.
+#define BUDDY_ALIGNED 0x80000000
+
 typedef struct buddy_block {
     struct buddy_block* next;
+    struct buddy_block* prev;
     u32 order;
-    bool free;
 } buddy_block_t;
 
 static buddy_block_t* free_lists[BUDDY_MAX_ORDER + 1];
+static u32* free_bitmaps[BUDDY_MAX_ORDER + 1];
+static u32 free_area_mask;
 static u8* memory_pool;
-static u32 pool_size = 1024 * 1024;  // 1MB pool
+static u32 pool_size;
+static spinlock_t buddy_lock = SPINLOCK_INIT("buddy");
 static bool initialized = false;
 
+// Returns BUDDY_MAX_ORDER + 1 if the request can't be served by any order
 static u32 get_order(size_t size) {
     u32 order = 0;
     size_t block_size = BUDDY_MIN_SIZE;
-    while (block_size < size && order < BUDDY_MAX_ORDER) {
+    while (block_size < size && order <= BUDDY_MAX_ORDER) {
         block_size <<= 1;
         order++;
     }
     return order;
 }
 
+static inline u32 block_index(void* block, u32 order) {
+    return ((u32)block - (u32)memory_pool) >> (BUDDY_MIN_SHIFT + order);
+}
+
+static inline bool block_is_free(void* block, u32 order) {
+    u32 index = block_index(block, order);
+    return (free_bitmaps[order][index >> 5] >> (index & 31)) & 1;
+}
+
+// Returns NULL if the buddy would lie past the end of the pool
 static void* get_buddy(void* block, u32 order) {
     u32 block_size = BUDDY_MIN_SIZE << order;
     u32 offset = (u32)block - (u32)memory_pool;
     u32 buddy_offset = offset ^ block_size;
+    if (buddy_offset + block_size > pool_size) {
+        return NULL;
+    }
     return (void*)((u32)memory_pool + buddy_offset);
 }
 
 static void insert_block(buddy_block_t* block, u32 order) {
+    u32 index = block_index(block, order);
+    
+    block->prev = NULL;
     block->next = free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
     free_lists[order] = block;
-    block->free = true;
     block->order = order;
+    
+    free_bitmaps[order][index >> 5] |= 1u << (index & 31);
+    free_area_mask |= 1u << order;
 }
 
 static void remove_block(buddy_block_t* block, u32 order) {
-    if (free_lists[order] == block) {
-        free_lists[order] = block->next;
+    u32 index = block_index(block, order);
+    
+    if (block->prev) {
+        block->prev->next = block->next;
     } else {
-        buddy_block_t* current = free_lists[order];
-        while (current && current->next != block) {
-            current = current->next;
-        }
-        if (current) {
-            current->next = block->next;
-        }
+        free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    
+    free_bitmaps[order][index >> 5] &= ~(1u << (index & 31));
+    if (!free_lists[order]) {
+        free_area_mask &= ~(1u << order);
     }
-    block->free = false;
 }
 
 static void* split_block(u32 order) {
-    if (order > BUDDY_MAX_ORDER) {
+    // Smallest non-empty order that can serve the request
+    u32 candidates = free_area_mask & ~((1u << order) - 1);
+    if (!candidates) {
         return NULL;
     }
+    u32 current = bit_scan_forward(candidates);
     
-    if (free_lists[order]) {
-        buddy_block_t* block = free_lists[order];
-        remove_block(block, order);
-        return block;
-    }
+    buddy_block_t* block = free_lists[current];
+    remove_block(block, current);
     
-    // Try to split a larger block
-    void* block = split_block(order + 1);
-    if (!block) {
-        return NULL;
+    // Hand the upper halves back until the block is the requested size
+    while (current > order) {
+        current--;
+        insert_block((buddy_block_t*)((u8*)block + (BUDDY_MIN_SIZE << current)), current);
     }
     
-    buddy_block_t* buddy = (buddy_block_t*)get_buddy(block, order);
-    insert_block(buddy, order);
-    
-    buddy_block_t* b = (buddy_block_t*)block;
-    b->order = order;
-    b->free = false;
+    block->order = order;
     return block;
 }
 
-static void merge_block(buddy_block_t* block) {
-    u32 order = block->order;
-    
+static void merge_block(buddy_block_t* block, u32 order) {
     while (order < BUDDY_MAX_ORDER) {
         buddy_block_t* buddy = (buddy_block_t*)get_buddy(block, order);
         
-        if (buddy->free && buddy->order == order) {
+        if (buddy && block_is_free(buddy, order)) {
             remove_block(buddy, order);
             
             // Keep the lower address block
@@ -93,7 +135,6 @@ static void merge_block(buddy_block_t* block) {
                 block = buddy;
             }
             order++;
-            block->order = order;
         } else {
             break;
         }
@@ -102,33 +143,65 @@ static void merge_block(buddy_block_t* block) {
     insert_block(block, order);
 }
 
+// Size the heap to a quarter of free RAM. The pool is demand-zero address
+// space, so pages are only committed once the allocator touches them.
 void memory_init(void) {
     if (initialized) return;
     
-    // Allocate memory pool (simplified - in real OS, use physical memory)
-    memory_pool = (u8*)0x200000;  // Start at 2MB
-    pool_size = 1024 * 1024;  // 1MB
+    u32 size = (pmm_free_frame_count() / 4) << PAGE_SHIFT;
+    if (size < HEAP_MIN_SIZE) {
+        size = HEAP_MIN_SIZE;
+    }
+    if (size > HEAP_MAX_SIZE) {
+        size = HEAP_MAX_SIZE;
+    }
+    
+    void* base = vmm_reserve(size, PAGE_WRITE);
+    if (!base) {
+        return;
+    }
+    
+    memory_init_pool(base, size);
+}
+
+void memory_init_pool(void* base, u32 size) {
+    if (initialized) return;
+    
+    memory_pool = (u8*)base;
+    pool_size = size;
+    
+    // The per-order bitmaps live at the end of the pool. Sizing them for
+    // the whole pool slightly over-provisions, which is harmless.
+    u32 bitmap_words = 0;
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        bitmap_words += ((pool_size >> (BUDDY_MIN_SHIFT + i)) + 31) / 32;
+    }
+    u32 metadata_size = (bitmap_words * sizeof(u32) + BUDDY_MIN_SIZE - 1) & ~(BUDDY_MIN_SIZE - 1);
+    pool_size -= metadata_size;
+    
+    u32* bitmap = (u32*)(memory_pool + pool_size);
+    memset(bitmap, 0, bitmap_words * sizeof(u32));
     
     // Initialize free lists
     for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
         free_lists[i] = NULL;
+        free_bitmaps[i] = bitmap;
+        bitmap += ((pool_size >> (BUDDY_MIN_SHIFT + i)) + 31) / 32;
     }
+    free_area_mask = 0;
     
-    // Initialize the entire pool as one large free block
-    buddy_block_t* initial_block = (buddy_block_t*)memory_pool;
-    u32 max_order = BUDDY_MAX_ORDER;
-    u32 pool_order = 0;
-    u32 temp_size = pool_size;
-    while (temp_size > BUDDY_MIN_SIZE && pool_order < BUDDY_MAX_ORDER) {
-        temp_size >>= 1;
-        pool_order++;
+    // Carve the pool into the largest blocks it holds. Taking them in
+    // decreasing size keeps every block aligned to its own size, so the
+    // buddy arithmetic in get_buddy() stays valid for each of them.
+    u32 offset = 0;
+    for (int order = BUDDY_MAX_ORDER; order >= 0; order--) {
+        u32 block_size = BUDDY_MIN_SIZE << order;
+        while (pool_size - offset >= block_size) {
+            insert_block((buddy_block_t*)(memory_pool + offset), order);
+            offset += block_size;
+        }
     }
     
-    initial_block->order = pool_order;
-    initial_block->free = true;
-    initial_block->next = NULL;
-    free_lists[pool_order] = initial_block;
-    
     initialized = true;
 }
 
@@ -144,23 +217,128 @@ void* kmalloc(size_t size) {
     // Add header size
     size_t total_size = size + sizeof(buddy_block_t);
     u32 order = get_order(total_size);
+    if (order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
     
+    u32 flags = spin_lock_irqsave(&buddy_lock);
     void* block = split_block(order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
     if (!block) {
         return NULL;
     }
     
-    buddy_block_t* b = (buddy_block_t*)block;
     return (void*)((u8*)block + sizeof(buddy_block_t));
 }
 
+// Header that kfree() and krealloc() read for ptr, which holds the order
+static buddy_block_t* block_header(void* ptr) {
+    return (buddy_block_t*)((u8*)ptr - sizeof(buddy_block_t));
+}
+
+// Start of the buddy block an allocation lives in
+static buddy_block_t* block_start(void* ptr) {
+    buddy_block_t* header = block_header(ptr);
+    return (header->order & BUDDY_ALIGNED) ? header->next : header;
+}
+
+// Memory aligned to align, a power of two up to PAGE_SIZE; kfree() and
+// krealloc() accept it like any other allocation. Blocks at least align
+// bytes long are aligned to it, since the pool starts on a page, so the
+// pointer goes at the first multiple of align past the header.
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (align <= sizeof(u32)) {
+        return kmalloc(size);
+    }
+    if ((align & (align - 1)) || align > PAGE_SIZE || size == 0) {
+        return NULL;
+    }
+    if (!initialized) {
+        memory_init();
+    }
+    
+    size_t offset = (sizeof(buddy_block_t) + align - 1) & ~(align - 1);
+    u32 order = get_order(offset + size);
+    if (order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    
+    u32 flags = spin_lock_irqsave(&buddy_lock);
+    buddy_block_t* block = (buddy_block_t*)split_block(order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    if (!block) {
+        return NULL;
+    }
+    
+    void* ptr = (u8*)block + offset;
+    buddy_block_t* header = block_header(ptr);
+    header->next = block;
+    header->order = order | BUDDY_ALIGNED;
+    return ptr;
+}
+
 void kfree(void* ptr) {
     if (!ptr || !initialized) {
         return;
     }
     
-    buddy_block_t* block = (buddy_block_t*)((u8*)ptr - sizeof(buddy_block_t));
-    merge_block(block);
+    u32 order = block_header(ptr)->order & ~BUDDY_ALIGNED;
+    buddy_block_t* block = block_start(ptr);
+    u32 flags = spin_lock_irqsave(&buddy_lock);
+    merge_block(block, order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+// Raw block interface for allocators layered on top of the buddy system.
+// Blocks carry no header and are aligned to their size within the pool;
+// the caller remembers the order and passes it back to buddy_free().
+void* buddy_alloc(u32 order) {
+    if (!initialized) {
+        memory_init();
+    }
+    
+    if (order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    
+    u32 flags = spin_lock_irqsave(&buddy_lock);
+    void* block = split_block(order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    return block;
+}
+
+void buddy_free(void* block, u32 order) {
+    if (!block || !initialized) {
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&buddy_lock);
+    merge_block((buddy_block_t*)block, order);
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+// Start of the order-sized block containing ptr
+void* buddy_block_base(void* ptr, u32 order) {
+    u32 offset = (u32)ptr - (u32)memory_pool;
+    offset &= ~((BUDDY_MIN_SIZE << order) - 1);
+    return (void*)((u32)memory_pool + offset);
+}
+
+// Grow a block in place to order by absorbing its buddies. Each step needs
+// the block to be the lower half of its parent and the upper half to be
+// free; the buddies are only taken once every step is known to succeed.
+static bool grow_block(buddy_block_t* block, u32 order, u32 new_order) {
+    u32 offset = (u32)block - (u32)memory_pool;
+    for (u32 o = order; o < new_order; o++) {
+        void* buddy = get_buddy(block, o);
+        if ((offset & (BUDDY_MIN_SIZE << o)) || !buddy || !block_is_free(buddy, o)) {
+            return false;
+        }
+    }
+    for (u32 o = order; o < new_order; o++) {
+        remove_block((buddy_block_t*)get_buddy(block, o), o);
+    }
+    return true;
 }
 
 void* krealloc(void* ptr, size_t size) {
@@ -173,17 +351,230 @@ void* krealloc(void* ptr, size_t size) {
         return NULL;
     }
     
-    buddy_block_t* block = (buddy_block_t*)((u8*)ptr - sizeof(buddy_block_t));
-    size_t old_size = (BUDDY_MIN_SIZE << block->order) - sizeof(buddy_block_t);
+    buddy_block_t* header = block_header(ptr);
+    buddy_block_t* block = block_start(ptr);
+    u32 order = header->order & ~BUDDY_ALIGNED;
+    size_t offset = (u8*)ptr - (u8*)block;
+    size_t old_size = (BUDDY_MIN_SIZE << order) - offset;
     
     if (old_size >= size) {
         return ptr;
     }
     
-    void* new_ptr = kmalloc(size);
+    // Try to take over the free space after the block before copying
+    u32 new_order = get_order(offset + size);
+    if (new_order <= BUDDY_MAX_ORDER) {
+        u32 flags = spin_lock_irqsave(&buddy_lock);
+        bool grown = grow_block(block, order, new_order);
+        if (grown) {
+            header->order = new_order | (header->order & BUDDY_ALIGNED);
+        }
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        if (grown) {
+            return ptr;
+        }
+    }
+    
+    // A moved aligned block keeps at least the alignment it had
+    void* new_ptr = (header->order & BUDDY_ALIGNED) ? kmalloc_aligned(size, offset & -offset) : kmalloc(size);
     if (new_ptr) {
         memcpy(new_ptr, ptr, old_size < size ? old_size : size);
         kfree(ptr);
     }
     return new_ptr;
 }
+
+// Free bytes in the heap, and the largest block a single allocation could
+// get. Walks the free lists, so it is meant for statistics.
+void memory_usage(u32* free_bytes, u32* largest_free) {
+    u32 flags = spin_lock_irqsave(&buddy_lock);
+    u32 total = 0;
+    for (u32 order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        for (buddy_block_t* b = free_lists[order]; b; b = b->next) {
+            total += BUDDY_MIN_SIZE << order;
+        }
+    }
+    u32 largest = free_area_mask ? BUDDY_MIN_SIZE << bit_scan_reverse(free_area_mask) : 0;
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    
+    *free_bytes = total;
+    *largest_free = largest;
+}
+
+// Boot-time self-check: walk every free list, verify each block is in the
+// pool, linked consistently and marked free in its order's bitmap, and
+// report the usable bytes per order.
+void memory_self_check(void) {
+    u32 total = 0;
+    bool ok = true;
+    
+    for (u32 order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        u32 block_size = BUDDY_MIN_SIZE << order;
+        u32 count = 0;
+        buddy_block_t* prev = NULL;
+        for (buddy_block_t* b = free_lists[order]; b; b = b->next) {
+            u32 offset = (u32)b - (u32)memory_pool;
+            if (offset + block_size > pool_size || (offset & (block_size - 1)) ||
+                b->prev != prev || !block_is_free(b, order)) {
+                ok = false;
+            }
+            prev = b;
+            count++;
+        }
+        if (((free_area_mask >> order) & 1) != (count != 0)) {
+            ok = false;
+        }
+        if (count == 0) {
+            continue;
+        }
+        vga_puts("  order ");
+        vga_put_dec(order);
+        vga_puts(" (");
+        vga_put_dec(block_size);
+        vga_puts(" B): ");
+        vga_put_dec(count * block_size);
+        vga_puts(" bytes free\n");
+        total += count * block_size;
+    }
+    
+    vga_puts("  heap: ");
+    vga_put_dec(total);
+    vga_puts(" of ");
+    vga_put_dec(pool_size);
+    vga_puts(ok ? " bytes usable\n" : " bytes usable - FREE LISTS CORRUPT\n");
+}
+
+// Allocation churn benchmark: keep a working set of live blocks with mixed
+// sizes and repeatedly free a random one and allocate a replacement. This
+// fragments the free lists, which is where a linear unlink used to hurt.
+#define BENCH_SLOTS 256
+#define BENCH_ROUNDS 20000
+
+static void* bench_slots[BENCH_SLOTS];
+
+void memory_benchmark(void) {
+    u32 seed = 12345;
+    u64 alloc_cycles = 0;
+    u64 free_cycles = 0;
+    u32 failures = 0;
+    
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        seed = seed * 1103515245 + 12345;
+        bench_slots[i] = kmalloc(16 + ((seed >> 16) & 1023));
+    }
+    
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        seed = seed * 1103515245 + 12345;
+        u32 slot = (seed >> 16) % BENCH_SLOTS;
+        seed = seed * 1103515245 + 12345;
+        size_t size = 16 + ((seed >> 16) & 1023);
+        
+        u64 start = rdtsc();
+        kfree(bench_slots[slot]);
+        u64 mid = rdtsc();
+        bench_slots[slot] = kmalloc(size);
+        u64 end = rdtsc();
+        
+        free_cycles += mid - start;
+        alloc_cycles += end - mid;
+        if (!bench_slots[slot]) {
+            failures++;
+        }
+    }
+    
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        kfree(bench_slots[i]);
+        bench_slots[i] = NULL;
+    }
+    
+    vga_puts("kmalloc: ");
+    vga_put_dec(div_u64_u32(alloc_cycles, BENCH_ROUNDS));
+    vga_puts(" cycles/op, kfree: ");
+    vga_put_dec(div_u64_u32(free_cycles, BENCH_ROUNDS));
+    vga_puts(" cycles/op over ");
+    vga_put_dec(BENCH_ROUNDS);
+    vga_puts(" rounds");
+    if (failures) {
+        vga_puts(", ");
+        vga_put_dec(failures);
+        vga_puts(" failed");
+    }
+    vga_puts("\n");
+}
+
+// Copy and fill throughput of the string functions against a byte loop,
+// on page-aligned blocks
+#define COPY_BENCH_MAX 65536
+#define COPY_BENCH_BYTES (4 * 1024 * 1024)  // Moved per measurement
+
+static void byte_copy(volatile u8* dest, const volatile u8* src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dest[i] = src[i];
+    }
+}
+
+// MB/s from bytes moved in cycles
+static void put_rate(u64 cycles, u32 tsc_per_ms) {
+    u32 us = div_u64_u32(cycles * 1000, tsc_per_ms);
+    vga_put_dec(us ? COPY_BENCH_BYTES / (1024 * 1024) * 1000000 / us : 0);
+    vga_puts(" MB/s");
+}
+
+void copy_benchmark(void) {
+    u32 tsc_per_ms = timer_tsc_per_ms();
+    if (!tsc_per_ms) {
+        tsc_per_ms = 1;
+    }
+    u32 pages = COPY_BENCH_MAX / PAGE_SIZE;
+    u8* src = (u8*)pmm_alloc_frames(pages);
+    u8* dest = (u8*)pmm_alloc_frames(pages);
+    if (!src || !dest) {
+        vga_puts("copybench: out of memory\n");
+        if (src) {
+            pmm_free_frames((u32)src, pages);
+        }
+        if (dest) {
+            pmm_free_frames((u32)dest, pages);
+        }
+        return;
+    }
+    memset(src, 0x5A, COPY_BENCH_MAX);
+    
+    vga_puts("String functions use ");
+    vga_puts(string_variant());
+    vga_puts("\n");
+    for (u32 size = 4096; size <= COPY_BENCH_MAX; size *= 4) {
+        u32 rounds = COPY_BENCH_BYTES / size;
+        
+        u64 start = rdtsc();
+        for (u32 i = 0; i < rounds; i++) {
+            memcpy(dest, src, size);
+        }
+        u64 copy_cycles = rdtsc() - start;
+        
+        start = rdtsc();
+        for (u32 i = 0; i < rounds; i++) {
+            memset(dest, i, size);
+        }
+        u64 fill_cycles = rdtsc() - start;
+        
+        start = rdtsc();
+        for (u32 i = 0; i < rounds; i++) {
+            byte_copy(dest, src, size);
+        }
+        u64 byte_cycles = rdtsc() - start;
+        
+        vga_puts("  ");
+        vga_put_dec(size / 1024);
+        vga_puts(" KB: memcpy ");
+        put_rate(copy_cycles, tsc_per_ms);
+        vga_puts(", memset ");
+        put_rate(fill_cycles, tsc_per_ms);
+        vga_puts(", byte loop ");
+        put_rate(byte_cycles, tsc_per_ms);
+        vga_puts("\n");
+    }
+    
+    pmm_free_frames((u32)src, pages);
+    pmm_free_frames((u32)dest, pages);
+}
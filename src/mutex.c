@@ -0,0 +1,189 @@
+#include "mutex.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "kernel.h"
+
+// Mutexes
+//
+// A contended lock sets MUTEX_WAITERS and sleeps on the mutex's wait
+// queue. Unlocking with waiters hands the mutex straight to the first one,
+// so a releasing process can't barge back in ahead of them.
+//
+// Priority inheritance: a waiter lends its priority to the owner, and on
+// through any chain of owners blocked on other mutexes, so a low priority
+// owner can't be starved by medium priority work while high priority work
+// waits on it. Unlocking drops the owner back to the highest of its base
+// priority and the waiters of the mutexes it still holds. All of this runs
+// under pi_lock; since an owner with waiters can only release through the
+// slow path, which also takes pi_lock, the owners in a chain stay put
+// while it is walked. Lock order: pi_lock, then a mutex's wait queue lock,
+// then run queue locks.
+
+static spinlock_t pi_lock = SPINLOCK_INIT("mutex");
+
+static inline process_t* mutex_owner(mutex_t* mutex) {
+    return (process_t*)(mutex->owner & ~MUTEX_WAITERS);
+}
+
+// The held list is only ever touched by its owner
+static void add_held(process_t* proc, mutex_t* mutex) {
+    mutex->next_held = proc->held_mutexes;
+    proc->held_mutexes = mutex;
+}
+
+static void remove_held(process_t* proc, mutex_t* mutex) {
+    mutex_t** link = &proc->held_mutexes;
+    while (*link && *link != mutex) {
+        link = &(*link)->next_held;
+    }
+    if (*link) {
+        *link = mutex->next_held;
+    }
+    mutex->next_held = NULL;
+}
+
+// Called with mutex->wait.lock held; 0 if nobody waits
+static u32 highest_waiter(mutex_t* mutex) {
+    u32 priority = 0;
+    for (process_t* proc = mutex->wait.head; proc; proc = proc->next) {
+        if (proc->priority > priority) {
+            priority = proc->priority;
+        }
+    }
+    return priority;
+}
+
+// Lend priority to the owner of mutex and on down the chain
+static void pi_boost(mutex_t* mutex, u32 priority) {
+    for (u32 depth = 0; mutex && depth < MUTEX_PI_MAX_DEPTH; depth++) {
+        process_t* owner = mutex_owner(mutex);
+        if (!owner || owner->priority >= priority) {
+            break;
+        }
+        sched_set_priority(owner, priority);
+        mutex = owner->blocked_on;
+    }
+}
+
+// Recompute proc's priority from what it still holds
+static void pi_restore(process_t* proc) {
+    u32 priority = proc->base_priority;
+    for (mutex_t* held = proc->held_mutexes; held; held = held->next_held) {
+        spin_lock(&held->wait.lock);
+        u32 waiter = highest_waiter(held);
+        spin_unlock(&held->wait.lock);
+        if (waiter > priority) {
+            priority = waiter;
+        }
+    }
+    if (priority != proc->priority) {
+        sched_set_priority(proc, priority);
+    }
+}
+
+void mutex_init(mutex_t* mutex) {
+    mutex->owner = 0;
+    mutex->next_held = NULL;
+    wait_queue_init(&mutex->wait);
+}
+
+bool mutex_trylock(mutex_t* mutex) {
+    process_t* self = get_current_process();
+    if (!__sync_bool_compare_and_swap(&mutex->owner, 0, (u32)self)) {
+        return false;
+    }
+    add_held(self, mutex);
+    return true;
+}
+
+void mutex_lock(mutex_t* mutex) {
+    if (mutex_trylock(mutex)) {
+        return;
+    }
+    
+    process_t* self = get_current_process();
+    u32 flags = spin_lock_irqsave(&pi_lock);
+    while (1) {
+        spin_lock(&mutex->wait.lock);
+        u32 owner = mutex->owner;
+        if (mutex_owner(mutex) == self) {
+            break;  // Handed over by mutex_unlock()
+        }
+        if (owner == 0) {
+            if (__sync_bool_compare_and_swap(&mutex->owner, 0, (u32)self)) {
+                break;
+            }
+            spin_unlock(&mutex->wait.lock);
+            continue;
+        }
+        if (!(owner & MUTEX_WAITERS) &&
+            !__sync_bool_compare_and_swap(&mutex->owner, owner, owner | MUTEX_WAITERS)) {
+            spin_unlock(&mutex->wait.lock);
+            continue;  // Released or changed hands meanwhile
+        }
+        
+        self->blocked_on = mutex;
+        pi_boost(mutex, self->priority);
+        sleep_on_unlock(&mutex->wait, &pi_lock);
+        spin_lock(&pi_lock);
+    }
+    spin_unlock(&mutex->wait.lock);
+    
+    self->blocked_on = NULL;
+    add_held(self, mutex);
+    spin_unlock_irqrestore(&pi_lock, flags);
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    process_t* self = get_current_process();
+    remove_held(self, mutex);
+    
+    // Nobody waiting: just release, unless a boost is left to give back
+    if (__sync_bool_compare_and_swap(&mutex->owner, (u32)self, 0)) {
+        if (self->priority != self->base_priority) {
+            u32 flags = spin_lock_irqsave(&pi_lock);
+            pi_restore(self);
+            spin_unlock_irqrestore(&pi_lock, flags);
+        }
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&pi_lock);
+    spin_lock(&mutex->wait.lock);
+    process_t* next = mutex->wait.head;
+    u32 lent = 0;
+    if (next) {
+        mutex->owner = (u32)next | (next->next ? MUTEX_WAITERS : 0);
+        wake_up_locked(&mutex->wait);
+        lent = highest_waiter(mutex);
+    } else {
+        mutex->owner = 0;
+    }
+    spin_unlock(&mutex->wait.lock);
+    
+    // The new owner inherits from the waiters still queued
+    if (lent) {
+        pi_boost(mutex, lent);
+    }
+    pi_restore(self);
+    spin_unlock_irqrestore(&pi_lock, flags);
+}
+
+// A process exiting with mutexes held hands each one to its next waiter,
+// so no owner points at a freed process_t. That includes a mutex handed
+// over by mutex_unlock() while it slept in mutex_lock(), if it was killed
+// before it could run and take it.
+void mutex_release_all(void) {
+    process_t* self = get_current_process();
+    u32 flags = spin_lock_irqsave(&pi_lock);
+    mutex_t* pending = self->blocked_on;
+    self->blocked_on = NULL;
+    if (pending && mutex_owner(pending) == self) {
+        add_held(self, pending);
+    }
+    spin_unlock_irqrestore(&pi_lock, flags);
+    
+    while (self->held_mutexes) {
+        mutex_unlock(self->held_mutexes);
+    }
+}
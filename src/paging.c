@@ -0,0 +1,502 @@
+#include "paging.h"
+#include "pmm.h"
+#include "idt.h"
+#include "kernel.h"
+#include "klog.h"
+#include "console.h"
+#include "spinlock.h"
+#include "smp.h"
+
+// Paging
+//
+// Physical memory is identity-mapped with 4MB PSE pages, so the kernel
+// image, page tables and every frame from the frame allocator are reachable
+// at their physical address with one TLB entry per 4MB. Dynamic regions
+// live in a separate window above the direct map. vmm_reserve() only hands
+// out address space; the page-fault handler backs each 4KB page with a
+// zeroed frame the first time it is touched.
+//
+// A process may have its own page directory. It starts as a copy of the
+// kernel directory, so the kernel half shares page tables with every other
+// address space, and has private page tables for the process window. Kernel
+// page tables created later are copied in when first faulted on. Window
+// pages shared by fork() are read-only with PAGE_COW set; a write fault
+// gives the writer its own copy.
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_PSE (1 << 3)
+#define CPUID_PGE (1 << 13)
+
+#define CR0_WP (1 << 16)
+#define CR0_PG (1u << 31)
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+
+// Page fault error code bits
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+
+typedef struct {
+    u32 start;
+    u32 end;
+    u32 flags;
+    bool (*fault)(u32 addr);  // Unbacked regions: not-present fault hook
+} vmm_region_t;
+
+static u32 kernel_directory[1024] __attribute__((aligned(4096)));
+static vmm_region_t regions[VMM_MAX_REGIONS];
+static u32 region_count = 0;
+static u32 next_reserve = VMM_WINDOW_START;
+static u32 global_flag = 0;
+static bool pse_enabled = false;
+static spinlock_t paging_lock = SPINLOCK_INIT("paging");  // Page tables and regions
+
+static inline void invlpg(u32 addr) {
+    asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline u32* current_directory(void) {
+    u32 cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return (u32*)cr3;
+}
+
+static inline bool in_process_window(u32 addr) {
+    return addr >= PROCESS_WINDOW_START && addr < PROCESS_WINDOW_END;
+}
+
+// Page tables are allocated from the frame allocator and reached through
+// the direct map
+static u32* get_page_table_in(u32* dir, u32 virt, bool create) {
+    u32* pde = &dir[virt >> 22];
+    if (*pde & PAGE_PRESENT) {
+        if (*pde & PAGE_LARGE) {
+            return NULL;
+        }
+        return (u32*)(*pde & PAGE_FRAME_MASK);
+    }
+    
+    if (!create) {
+        return NULL;
+    }
+    
+    u32 table = pmm_alloc_frame();
+    if (!table) {
+        return NULL;
+    }
+    memset((void*)table, 0, PAGE_SIZE);
+    *pde = table | PAGE_PRESENT | PAGE_WRITE;
+    return (u32*)table;
+}
+
+static u32* get_page_table(u32 virt, bool create) {
+    return get_page_table_in(kernel_directory, virt, create);
+}
+
+bool paging_map_page(u32 virt, u32 phys, u32 flags) {
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table(virt, true);
+    if (table) {
+        table[(virt >> PAGE_SHIFT) & 0x3FF] = (phys & PAGE_FRAME_MASK) | (flags & 0xFFF) | PAGE_PRESENT;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return table != NULL;
+}
+
+// Returns the frame that was mapped at virt, or 0
+u32 paging_unmap_page(u32 virt) {
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table(virt, false);
+    u32 entry = 0;
+    if (table) {
+        u32 index = (virt >> PAGE_SHIFT) & 0x3FF;
+        entry = table[index];
+        table[index] = 0;
+        invlpg(virt);
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return (entry & PAGE_PRESENT) ? (entry & PAGE_FRAME_MASK) : 0;
+}
+
+u32 paging_translate(u32 virt) {
+    u32 pde = (in_process_window(virt) ? current_directory() : kernel_directory)[virt >> 22];
+    if (!(pde & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (pde & PAGE_LARGE) {
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+    
+    u32 pte = ((u32*)(pde & PAGE_FRAME_MASK))[(virt >> PAGE_SHIFT) & 0x3FF];
+    if (!(pte & PAGE_PRESENT)) {
+        return 0;
+    }
+    return (pte & PAGE_FRAME_MASK) | (virt & (PAGE_SIZE - 1));
+}
+
+// Identity-map a physical range that lies outside the direct map, such as
+// ACPI tables or device registers. Pages that are already mapped are left
+// alone. Uses 4MB pages when PSE is available.
+bool paging_identity_map(u32 phys, u32 size, u32 flags) {
+    u32 end = phys + size;
+    bool ok = true;
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    
+    if (pse_enabled) {
+        for (u32 addr = phys & ~(LARGE_PAGE_SIZE - 1); addr < end && addr >= (phys & ~(LARGE_PAGE_SIZE - 1));
+             addr += LARGE_PAGE_SIZE) {
+            u32* pde = &kernel_directory[addr >> 22];
+            if (!(*pde & PAGE_PRESENT)) {
+                *pde = addr | (flags & 0xFFF) | PAGE_PRESENT | PAGE_LARGE;
+                invlpg(addr);
+            }
+        }
+    } else {
+        for (u32 addr = phys & PAGE_FRAME_MASK; addr < end && addr >= (phys & PAGE_FRAME_MASK);
+             addr += PAGE_SIZE) {
+            u32* table = get_page_table(addr, true);
+            if (!table) {
+                ok = false;
+                break;
+            }
+            u32* pte = &table[(addr >> PAGE_SHIFT) & 0x3FF];
+            if (!(*pte & PAGE_PRESENT)) {
+                *pte = addr | (flags & 0xFFF) | PAGE_PRESENT;
+                invlpg(addr);
+            }
+        }
+    }
+    
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return ok;
+}
+
+u32* paging_new_directory(void) {
+    u32* dir = (u32*)pmm_alloc_frame();
+    if (!dir) {
+        return NULL;
+    }
+    
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    memcpy(dir, kernel_directory, PAGE_SIZE);
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    memset(&dir[PROCESS_WINDOW_START >> 22], 0, ((PROCESS_WINDOW_END - PROCESS_WINDOW_START) >> 22) * sizeof(u32));
+    return dir;
+}
+
+// The window must already be unmapped and dir must not be loaded anywhere
+void paging_free_directory(u32* dir) {
+    if (!dir || dir == kernel_directory) {
+        return;
+    }
+    for (u32 i = PROCESS_WINDOW_START >> 22; i < PROCESS_WINDOW_END >> 22; i++) {
+        if (dir[i] & PAGE_PRESENT) {
+            pmm_free_frame(dir[i] & PAGE_FRAME_MASK);
+        }
+    }
+    pmm_free_frame((u32)dir);
+}
+
+// The task switch back from the double fault TSS reloads CR3 from the
+// main TSS, so keep it in step
+void paging_switch(u32* dir) {
+    if (!dir) {
+        dir = kernel_directory;
+    }
+    this_cpu()->tss.cr3 = (u32)dir;
+    asm volatile("mov %0, %%cr3" : : "r"(dir) : "memory");
+}
+
+// paging_unmap_page() only invalidates the local TLB. For a kernel address
+// that is unmapped and later mapped to another frame, such as a kernel
+// stack slot, other CPUs may still hold the old entry. Rather than an IPI
+// that waits for every CPU, possibly with interrupts off, the unmapping
+// side bumps tlb_flush_gen, and each CPU flushes its whole TLB (the
+// mappings are not global) before it next switches processes. That is
+// enough as long as the address is only used again by a process switched
+// to afterwards, which holds for stacks.
+static volatile u32 tlb_flush_gen = 0;
+
+void paging_flush_tlb_lazy(void) {
+    __sync_fetch_and_add(&tlb_flush_gen, 1);
+}
+
+// Called before a context switch
+void paging_tlb_sync(void) {
+    cpu_t* cpu = this_cpu();
+    u32 gen = tlb_flush_gen;
+    if (cpu->tlb_gen != gen) {
+        u32 cr3;
+        asm volatile("mov %%cr3, %0\n\t"
+                     "mov %0, %%cr3" : "=r"(cr3) : : "memory");
+        cpu->tlb_gen = gen;
+    }
+}
+
+// Map a page into the process window of dir. Window pages are never
+// global, since they change with CR3.
+bool paging_map_page_in(u32* dir, u32 virt, u32 phys, u32 flags) {
+    if (!dir) {
+        dir = kernel_directory;
+    }
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table_in(dir, virt, true);
+    if (table) {
+        table[(virt >> PAGE_SHIFT) & 0x3FF] = (phys & PAGE_FRAME_MASK) | (flags & 0xFFF & ~PAGE_GLOBAL) | PAGE_PRESENT;
+        if (dir == current_directory()) {
+            invlpg(virt);
+        }
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return table != NULL;
+}
+
+u32 paging_unmap_page_in(u32* dir, u32 virt) {
+    if (!dir) {
+        dir = kernel_directory;
+    }
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table_in(dir, virt, false);
+    u32 entry = 0;
+    if (table) {
+        u32 index = (virt >> PAGE_SHIFT) & 0x3FF;
+        entry = table[index];
+        table[index] = 0;
+        if (dir == current_directory()) {
+            invlpg(virt);
+        }
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return (entry & PAGE_PRESENT) ? (entry & PAGE_FRAME_MASK) : 0;
+}
+
+// The page table entry for virt, or 0
+u32 paging_lookup_in(u32* dir, u32 virt) {
+    if (!dir) {
+        dir = kernel_directory;
+    }
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table_in(dir, virt, false);
+    u32 entry = table ? table[(virt >> PAGE_SHIFT) & 0x3FF] : 0;
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return entry;
+}
+
+// Replace the flags of a present window page
+bool paging_set_flags_in(u32* dir, u32 virt, u32 flags) {
+    if (!dir) {
+        dir = kernel_directory;
+    }
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    u32* table = get_page_table_in(dir, virt, false);
+    u32* pte = table ? &table[(virt >> PAGE_SHIFT) & 0x3FF] : NULL;
+    bool ok = pte && (*pte & PAGE_PRESENT);
+    if (ok) {
+        *pte = (*pte & PAGE_FRAME_MASK) | (flags & 0xFFF & ~PAGE_GLOBAL) | PAGE_PRESENT;
+        if (dir == current_directory()) {
+            invlpg(virt);
+        }
+    }
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return ok;
+}
+
+static void* reserve_region(u32 size, u32 flags, bool (*fault)(u32 addr)) {
+    size = (size + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+    u32 irq_flags = spin_lock_irqsave(&paging_lock);
+    if (size == 0 || region_count == VMM_MAX_REGIONS ||
+        size > VMM_WINDOW_END - next_reserve) {
+        spin_unlock_irqrestore(&paging_lock, irq_flags);
+        return NULL;
+    }
+    
+    u32 start = next_reserve;
+    
+    // Build the page tables up front so a fault only has to fill in a PTE
+    for (u32 addr = start & ~(LARGE_PAGE_SIZE - 1); addr < start + size; addr += LARGE_PAGE_SIZE) {
+        if (!get_page_table(addr, true)) {
+            spin_unlock_irqrestore(&paging_lock, irq_flags);
+            return NULL;
+        }
+    }
+    
+    regions[region_count].start = start;
+    regions[region_count].end = start + size;
+    regions[region_count].flags = flags;
+    regions[region_count].fault = fault;
+    region_count++;
+    next_reserve += size;
+    
+    spin_unlock_irqrestore(&paging_lock, irq_flags);
+    return (void*)start;
+}
+
+// Reserve demand-zero address space. Nothing is committed until a page is
+// first touched.
+void* vmm_reserve(u32 size, u32 flags) {
+    return reserve_region(size, flags, NULL);
+}
+
+// Reserve address space whose pages the caller maps itself. A not-present
+// fault in it is passed to fault(), which returns false if it is fatal.
+void* vmm_reserve_unbacked(u32 size, bool (*fault)(u32 addr)) {
+    return reserve_region(size, 0, fault);
+}
+
+static vmm_region_t* find_region(u32 addr) {
+    for (u32 i = 0; i < region_count; i++) {
+        if (addr >= regions[i].start && addr < regions[i].end) {
+            return &regions[i];
+        }
+    }
+    return NULL;
+}
+
+// Write to a copy-on-write page. The last mapping of a frame just makes
+// it writable again; otherwise the writer gets a copy.
+static bool cow_fault(u32 addr) {
+    u32 page = addr & PAGE_FRAME_MASK;
+    spin_lock(&paging_lock);
+    u32* table = get_page_table_in(current_directory(), page, false);
+    u32* pte = table ? &table[(page >> PAGE_SHIFT) & 0x3FF] : NULL;
+    if (!pte || (*pte & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW)) {
+        spin_unlock(&paging_lock);
+        return false;
+    }
+    u32 frame = *pte & PAGE_FRAME_MASK;
+    u32 flags = (*pte & 0xFFF & ~PAGE_COW) | PAGE_WRITE;
+    if (pmm_frame_refs(frame) == 1) {
+        *pte = frame | flags;
+        invlpg(page);
+        spin_unlock(&paging_lock);
+        return true;
+    }
+    spin_unlock(&paging_lock);
+    
+    // Only this process changes its own window, so the entry stays put
+    u32 copy = pmm_alloc_frame();
+    if (!copy) {
+        return false;
+    }
+    memcpy((void*)copy, (void*)frame, PAGE_SIZE);
+    spin_lock(&paging_lock);
+    *pte = copy | flags;
+    invlpg(page);
+    spin_unlock(&paging_lock);
+    pmm_frame_put(frame);
+    return true;
+}
+
+static void page_fault_handler(registers_t* regs) {
+    u32 addr;
+    asm volatile("mov %%cr2, %0" : "=r"(addr));
+    
+    // A kernel page table created after this address space was copied
+    u32* dir = current_directory();
+    u32 index = addr >> 22;
+    if (dir != kernel_directory && !in_process_window(addr) &&
+        !(dir[index] & PAGE_PRESENT) && (kernel_directory[index] & PAGE_PRESENT)) {
+        dir[index] = kernel_directory[index];
+        return;
+    }
+    
+    if (in_process_window(addr) && (regs->err_code & PF_PRESENT) &&
+        (regs->err_code & PF_WRITE) && cow_fault(addr)) {
+        return;
+    }
+    
+    vmm_region_t* region = find_region(addr);
+    if (region && region->fault && !(regs->err_code & PF_PRESENT)) {
+        if (region->fault(addr)) {
+            return;
+        }
+        region = NULL;
+    }
+    
+    // First touch of a demand-zero page
+    if (region && !(regs->err_code & PF_PRESENT)) {
+        u32 frame = pmm_alloc_frame();
+        if (frame) {
+            memset((void*)frame, 0, PAGE_SIZE);
+            
+            // Another CPU may have faulted on the same page meanwhile
+            u32 page = addr & PAGE_FRAME_MASK;
+            u32* table = get_page_table(page, false);
+            spin_lock(&paging_lock);
+            u32* pte = &table[(page >> PAGE_SHIFT) & 0x3FF];
+            bool raced = (*pte & PAGE_PRESENT) != 0;
+            if (!raced) {
+                *pte = frame | region->flags | global_flag | PAGE_PRESENT;
+                invlpg(page);
+            }
+            spin_unlock(&paging_lock);
+            if (raced) {
+                pmm_free_frame(frame);
+            }
+            return;
+        }
+        klog(KLOG_ERR, "Out of memory backing %p", addr);
+    }
+    
+    klog(KLOG_ERR, "Page fault at %p (%s, eip %p, error %x), system halted", addr,
+         regs->err_code & PF_WRITE ? "write" : "read", regs->eip, regs->err_code);
+    klog_flush();
+    console_flush();
+    
+    while (1) {
+        asm volatile("cli; hlt");
+    }
+}
+
+void paging_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    bool pse = (edx & CPUID_PSE) != 0;
+    pse_enabled = pse;
+    if (edx & CPUID_PGE) {
+        global_flag = PAGE_GLOBAL;
+    }
+    
+    memset(kernel_directory, 0, sizeof(kernel_directory));
+    
+    u32 limit = pmm_highest_address();
+    limit = (limit + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+    if (limit == 0 || limit > DIRECT_MAP_LIMIT) {
+        limit = DIRECT_MAP_LIMIT;
+    }
+    
+    // Identity-map physical memory, falling back to 4KB pages without PSE
+    for (u32 addr = 0; addr < limit; addr += LARGE_PAGE_SIZE) {
+        if (pse) {
+            kernel_directory[addr >> 22] = addr | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE | global_flag;
+        } else {
+            u32* table = get_page_table(addr, true);
+            if (!table) {
+                break;
+            }
+            for (u32 i = 0; i < 1024; i++) {
+                table[i] = (addr + i * PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITE | global_flag;
+            }
+        }
+    }
+    
+    register_interrupt_handler(14, page_fault_handler);
+    
+    u32 cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (pse) {
+        cr4 |= CR4_PSE;
+    }
+    if (global_flag) {
+        cr4 |= CR4_PGE;
+    }
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+    
+    asm volatile("mov %0, %%cr3" : : "r"(kernel_directory));
+    
+    u32 cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= CR0_PG | CR0_WP;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+}
@@ -0,0 +1,287 @@
+#include "pmm.h"
+#include "paging.h"
+#include "kernel.h"
+#include "spinlock.h"
+
+// Physical page-frame allocator
+//
+// One bit per 4KB frame up to the highest usable address, set while the
+// frame is in use. Everything starts out used; the usable ranges of the
+// Multiboot memory map are then released and the regions the kernel
+// already occupies are reserved again. The bitmap itself is placed just
+// past the kernel image and whatever the bootloader left behind it,
+// followed by a reference count per frame for pages mapped in several
+// address spaces.
+
+#define LOW_MEMORY_END 0x100000      // IVT, BIOS data, VGA hole and ROMs
+#define FALLBACK_MEMORY_END 0x800000 // Used when the bootloader gives no map
+#define HIGHEST_FRAME_ADDR DIRECT_MAP_LIMIT  // Frames above aren't reachable
+
+// Linker-provided bounds of the kernel image
+extern u8 kernel_start[];
+extern u8 kernel_end[];
+
+static u32* frame_bitmap = NULL;
+static volatile u16* frame_refs = NULL;  // Set to 1 by allocation
+static u32 frame_count = 0;      // Frames covered by the bitmap
+static u32 usable_frames = 0;
+static u32 free_frames = 0;
+static u32 search_hint = 0;      // Bitmap word where the last free frame was found
+static spinlock_t pmm_lock = SPINLOCK_INIT("pmm");
+
+static inline bool frame_test(u32 frame) {
+    return (frame_bitmap[frame >> 5] >> (frame & 31)) & 1;
+}
+
+static inline u32 align_up(u32 value) {
+    return (value + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static void mark_frame(u32 frame, bool used) {
+    if (frame >= frame_count || frame_test(frame) == used) {
+        return;
+    }
+    if (used) {
+        frame_bitmap[frame >> 5] |= 1u << (frame & 31);
+        free_frames--;
+    } else {
+        frame_bitmap[frame >> 5] &= ~(1u << (frame & 31));
+        free_frames++;
+    }
+}
+
+// Reserving rounds outwards and releasing rounds inwards, so a partially
+// usable frame is never handed out.
+static void mark_region(u64 start, u64 end, bool used) {
+    if (end > HIGHEST_FRAME_ADDR) {
+        end = HIGHEST_FRAME_ADDR;
+    }
+    if (start >= end) {
+        return;
+    }
+    
+    u32 first, last;
+    if (used) {
+        first = (u32)start >> PAGE_SHIFT;
+        last = align_up((u32)end) >> PAGE_SHIFT;
+    } else {
+        first = align_up((u32)start) >> PAGE_SHIFT;
+        last = (u32)end >> PAGE_SHIFT;
+    }
+    for (u32 frame = first; frame < last; frame++) {
+        mark_frame(frame, used);
+    }
+}
+
+static void for_each_mmap_entry(multiboot_info_t* mbi, bool available,
+                                void (*fn)(u64 start, u64 end, bool used), bool used) {
+    u32 addr = mbi->mmap_addr;
+    while (addr < mbi->mmap_addr + mbi->mmap_length) {
+        multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)addr;
+        if ((entry->type == MULTIBOOT_MEMORY_AVAILABLE) == available) {
+            fn(entry->addr, entry->addr + entry->len, used);
+        }
+        addr += entry->size + sizeof(entry->size);
+    }
+}
+
+void pmm_init(multiboot_info_t* mbi) {
+    bool have_mmap = mbi && (mbi->flags & MULTIBOOT_INFO_MEM_MAP);
+    u64 highest = 0;
+    u32 placement = (u32)kernel_end;
+    
+    // Find the top of usable RAM
+    if (have_mmap) {
+        u32 addr = mbi->mmap_addr;
+        while (addr < mbi->mmap_addr + mbi->mmap_length) {
+            multiboot_mmap_entry_t* entry = (multiboot_mmap_entry_t*)addr;
+            if (entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr + entry->len > highest) {
+                highest = entry->addr + entry->len;
+            }
+            addr += entry->size + sizeof(entry->size);
+        }
+    } else if (mbi && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        highest = LOW_MEMORY_END + (u64)mbi->mem_upper * 1024;
+    } else {
+        highest = FALLBACK_MEMORY_END;
+    }
+    if (highest > HIGHEST_FRAME_ADDR) {
+        highest = HIGHEST_FRAME_ADDR;
+    }
+    
+    // The bitmap goes after the kernel and everything the bootloader
+    // placed behind it
+    if (mbi) {
+        if ((u32)mbi + sizeof(multiboot_info_t) > placement) {
+            placement = (u32)mbi + sizeof(multiboot_info_t);
+        }
+        if (have_mmap && mbi->mmap_addr + mbi->mmap_length > placement) {
+            placement = mbi->mmap_addr + mbi->mmap_length;
+        }
+        if (mbi->flags & MULTIBOOT_INFO_MODS) {
+            multiboot_module_t* mods = (multiboot_module_t*)mbi->mods_addr;
+            if ((u32)&mods[mbi->mods_count] > placement) {
+                placement = (u32)&mods[mbi->mods_count];
+            }
+            for (u32 i = 0; i < mbi->mods_count; i++) {
+                if (mods[i].mod_end > placement) {
+                    placement = mods[i].mod_end;
+                }
+            }
+        }
+    }
+    
+    frame_count = (u32)(highest >> PAGE_SHIFT);
+    u32 bitmap_size = ((frame_count + 31) / 32) * sizeof(u32);
+    frame_bitmap = (u32*)align_up(placement);
+    memset(frame_bitmap, 0xFF, bitmap_size);
+    frame_refs = (volatile u16*)((u32)frame_bitmap + bitmap_size);
+    u32 refs_size = frame_count * sizeof(u16);
+    memset((void*)frame_refs, 0, refs_size);
+    free_frames = 0;
+    
+    // Release usable RAM, then take back anything the map marks reserved
+    if (have_mmap) {
+        for_each_mmap_entry(mbi, true, mark_region, false);
+        for_each_mmap_entry(mbi, false, mark_region, true);
+    } else {
+        mark_region(LOW_MEMORY_END, highest, false);
+    }
+    usable_frames = free_frames;
+    
+    // Reserve what is already in use
+    mark_region(0, LOW_MEMORY_END, true);
+    mark_region((u32)kernel_start, (u32)kernel_end, true);
+    if (mbi) {
+        mark_region((u32)mbi, (u32)mbi + sizeof(multiboot_info_t), true);
+        if (have_mmap) {
+            mark_region(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length, true);
+        }
+        if (mbi->flags & MULTIBOOT_INFO_MODS) {
+            multiboot_module_t* mods = (multiboot_module_t*)mbi->mods_addr;
+            mark_region((u32)mods, (u32)&mods[mbi->mods_count], true);
+            for (u32 i = 0; i < mbi->mods_count; i++) {
+                mark_region(mods[i].mod_start, mods[i].mod_end, true);
+            }
+        }
+    }
+    mark_region((u32)frame_bitmap, (u32)frame_refs + refs_size, true);
+    
+    search_hint = 0;
+}
+
+u32 pmm_alloc_frame(void) {
+    u32 words = (frame_count + 31) / 32;
+    u32 flags = spin_lock_irqsave(&pmm_lock);
+    
+    for (u32 n = 0; n < words; n++) {
+        u32 i = search_hint + n;
+        if (i >= words) {
+            i -= words;
+        }
+        if (frame_bitmap[i] != 0xFFFFFFFF) {
+            u32 frame = i * 32 + bit_scan_forward(~frame_bitmap[i]);
+            if (frame >= frame_count) {
+                continue;
+            }
+            mark_frame(frame, true);
+            frame_refs[frame] = 1;
+            search_hint = i;
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return frame << PAGE_SHIFT;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return 0;  // Frame 0 is always reserved, so 0 means out of memory
+}
+
+void pmm_free_frame(u32 addr) {
+    u32 frame = addr >> PAGE_SHIFT;
+    if (frame < (LOW_MEMORY_END >> PAGE_SHIFT)) {
+        return;
+    }
+    u32 flags = spin_lock_irqsave(&pmm_lock);
+    mark_frame(frame, false);
+    if (frame < frame_count) {
+        frame_refs[frame] = 0;
+    }
+    if ((frame >> 5) < search_hint) {
+        search_hint = frame >> 5;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// First-fit search for a physically contiguous run of frames
+u32 pmm_alloc_frames(u32 count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count == 1) {
+        return pmm_alloc_frame();
+    }
+    
+    u32 flags = spin_lock_irqsave(&pmm_lock);
+    u32 run = 0;
+    for (u32 frame = 0; frame < frame_count; frame++) {
+        // Skip fully used words in one step
+        if ((frame & 31) == 0 && frame_bitmap[frame >> 5] == 0xFFFFFFFF) {
+            frame += 31;
+            run = 0;
+            continue;
+        }
+        if (frame_test(frame)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            u32 start = frame - count + 1;
+            for (u32 i = start; i <= frame; i++) {
+                mark_frame(i, true);
+                frame_refs[i] = 1;
+            }
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return start << PAGE_SHIFT;
+        }
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return 0;
+}
+
+void pmm_free_frames(u32 addr, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+        pmm_free_frame(addr + i * PAGE_SIZE);
+    }
+}
+
+// Take another reference to an allocated frame, for a second mapping
+void pmm_frame_get(u32 addr) {
+    u32 frame = addr >> PAGE_SHIFT;
+    if (frame < frame_count) {
+        __sync_fetch_and_add(&frame_refs[frame], 1);
+    }
+}
+
+// Drop a reference; the last one frees the frame
+void pmm_frame_put(u32 addr) {
+    u32 frame = addr >> PAGE_SHIFT;
+    if (frame < frame_count && __sync_sub_and_fetch(&frame_refs[frame], 1) == 0) {
+        pmm_free_frame(addr);
+    }
+}
+
+u32 pmm_frame_refs(u32 addr) {
+    u32 frame = addr >> PAGE_SHIFT;
+    return frame < frame_count ? frame_refs[frame] : 0;
+}
+
+u32 pmm_total_frames(void) {
+    return usable_frames;
+}
+
+u32 pmm_free_frame_count(void) {
+    return free_frames;
+}
+
+u32 pmm_highest_address(void) {
+    return frame_count << PAGE_SHIFT;
+}
@@ -1,87 +1,515 @@
 #include "scheduler.h"
+#include "smp.h"
+#include "slab.h"
+#include "kstack.h"
+#include "paging.h"
+#include "vm.h"
+#include "fpu.h"
+#include "mutex.h"
 #include "memory.h"
 #include "kernel.h"
 #include "idt.h"
+#include "timer.h"
+#include "vga.h"
+#include "klog.h"
 
-static process_t processes[MAX_PROCESSES];
-static process_t* ready_queues[MAX_PRIORITY + 1];
-static process_t* current_process = NULL;
+// Processes run on their own kernel stacks and are switched by
+// switch_context(), either from a timer interrupt when a time slice runs
+// out or a higher priority process is ready, or voluntarily via yield().
+// Interrupt handlers never switch directly: they set need_resched, and
+// the switch happens in scheduler_irq_exit() once the handler is done.
+//
+// Every CPU has its own set of run queues (sched_cpu_t, in cpu_t). Each
+// priority level has a FIFO run queue with head and tail pointers, and
+// bit n of ready_bitmap is set while level n is non-empty, so enqueue,
+// dequeue and picking the highest ready level (bsr) are all O(1)
+// regardless of the number of levels. A CPU that runs out of work steals
+// the highest priority waiter of the busiest other CPU, and new processes
+// go to the least loaded CPU.
+//
+// Locking: a CPU's run queue lock protects its queues and current, and is
+// held across switch_context(), so a process being switched out can't be
+// picked up by another CPU before its stack pointer has been saved. The
+// process switched to releases the lock in finish_switch(). A wakeup always
+// requeues a process on the CPU it last ran on for the same reason; work
+// stealing spreads it out afterwards. Lock order: process_lock, then a wait
+// queue lock, then run queue locks (a second run queue lock is only ever
+// taken with trylock).
+
+extern void switch_context(u32* old_esp, u32 new_esp);
+extern u32 save_context(u32* frame);
+
+// Process table: slots grow by doubling, free slots are kept on a stack,
+// and a PID hash with one bucket per slot finds a process by PID, so
+// spawn, exit and lookup stay O(1) however many processes exist
+static process_t** process_table = NULL;
+static u32* free_slots = NULL;
+static u32 free_count = 0;
+static u32 table_size = 0;
+static process_t** pid_hash = NULL;
+static u32 pid_hash_mask = 0;
+static u32 process_count = 0;
+static spinlock_t process_lock = SPINLOCK_INIT("process");  // Table and PID counter
+static kmem_cache_t* process_cache = NULL;
+static u32 time_slice[MAX_PRIORITY + 1];      // Slice length in ticks
+static u32 aging_interval = 1;                // In ticks
+static u32 aging_threshold = 1;               // In ticks
 static u32 next_pid = 1;
 static bool initialized = false;
 
-static void add_to_ready_queue(process_t* proc) {
+static inline sched_cpu_t* this_rq(void) {
+    return &this_cpu()->sched;
+}
+
+static inline sched_cpu_t* cpu_rq(u32 cpu) {
+    return &cpus[cpu].sched;
+}
+
+static void enqueue(sched_cpu_t* rq, process_t* proc, u32 level) {
+    run_queue_t* queue = &rq->ready_queues[level];
+    
+    proc->dyn_priority = level;
+    proc->next = NULL;
+    proc->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = proc;
+    } else {
+        queue->head = proc;
+    }
+    queue->tail = proc;
+    rq->ready_bitmap |= 1u << level;
+    rq->nr_ready++;
+}
+
+static void dequeue(sched_cpu_t* rq, process_t* proc) {
+    run_queue_t* queue = &rq->ready_queues[proc->dyn_priority];
+    
+    if (proc->prev) {
+        proc->prev->next = proc->next;
+    } else {
+        queue->head = proc->next;
+    }
+    if (proc->next) {
+        proc->next->prev = proc->prev;
+    } else {
+        queue->tail = proc->prev;
+    }
+    proc->next = NULL;
+    proc->prev = NULL;
+    
+    if (!queue->head) {
+        rq->ready_bitmap &= ~(1u << proc->dyn_priority);
+    }
+    rq->nr_ready--;
+}
+
+// Queue at the tail of the process's base level on rq's CPU
+static void add_to_ready_queue(sched_cpu_t* rq, process_t* proc) {
     if (!proc) return;
     
     proc->state = PROCESS_READY;
-    proc->next = ready_queues[proc->priority];
-    ready_queues[proc->priority] = proc;
+    proc->ready_since = timer_get_ticks();
+    proc->last_tsc = rdtsc();
+    proc->cpu = rq->cpu;
+    enqueue(rq, proc, proc->priority);
+}
+
+static process_t* find_highest_priority_process(sched_cpu_t* rq) {
+    if (!rq->ready_bitmap) {
+        return NULL;
+    }
+    
+    process_t* proc = rq->ready_queues[bit_scan_reverse(rq->ready_bitmap)].head;
+    dequeue(rq, proc);
+    return proc;
+}
+
+static bool ready_above(sched_cpu_t* rq, u32 level) {
+    if (level >= MAX_PRIORITY) {
+        return false;
+    }
+    return (rq->ready_bitmap >> (level + 1)) != 0;
+}
+
+// Whether proc should preempt what rq's CPU is running
+static bool should_preempt(sched_cpu_t* rq, process_t* proc) {
+    return rq->current == rq->idle || proc->dyn_priority > rq->current->dyn_priority;
 }
 
-static process_t* remove_from_ready_queue(u32 priority) {
-    if (priority > MAX_PRIORITY) return NULL;
+// Promote the longest waiter of each level below the top if it has waited
+// past the threshold. Only queue heads need checking: queues are FIFO, so
+// the head is always the oldest waiter.
+static void age_ready_queues(sched_cpu_t* rq, u32 now) {
+    u32 levels = rq->ready_bitmap & ~(1u << MAX_PRIORITY);
     
-    process_t* proc = ready_queues[priority];
+    while (levels) {
+        u32 level = bit_scan_forward(levels);
+        levels &= levels - 1;
+        
+        process_t* proc = rq->ready_queues[level].head;
+        if (now - proc->ready_since >= aging_threshold) {
+            dequeue(rq, proc);
+            proc->ready_since = now;
+            enqueue(rq, proc, level + 1);
+            rq->aged_count++;
+        }
+    }
+}
+
+// Load used for placement: queued processes plus the one running
+static u32 cpu_load(u32 cpu) {
+    sched_cpu_t* rq = cpu_rq(cpu);
+    return rq->nr_ready + (rq->current != rq->idle);
+}
+
+static u32 pick_cpu(void) {
+    u32 best = this_cpu()->index;
+    u32 best_load = cpu_load(best);
+    
+    for (u32 i = 0; i < cpu_count && best_load > 0; i++) {
+        u32 load = cpu_load(i);
+        if (cpus[i].online && load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Pull the highest priority waiter from the CPU with the most queued work.
+// Called with rq->lock held; the victim's lock is only tried, so two CPUs
+// stealing from each other can't deadlock.
+static bool steal_work(sched_cpu_t* rq) {
+    u32 self = this_cpu()->index;
+    sched_cpu_t* victim = NULL;
+    u32 most = 0;
+    
+    for (u32 i = 0; i < cpu_count; i++) {
+        if (i != self && cpu_rq(i)->nr_ready > most) {
+            victim = cpu_rq(i);
+            most = victim->nr_ready;
+        }
+    }
+    if (!victim || !spin_trylock(&victim->lock)) {
+        return false;
+    }
+    
+    // Move proc->cpu before dropping the victim's lock, so anyone locking
+    // the queue it names finds it there
+    process_t* proc = find_highest_priority_process(victim);
     if (proc) {
-        ready_queues[priority] = proc->next;
-        proc->next = NULL;
+        proc->cpu = self;
+    }
+    spin_unlock(&victim->lock);
+    if (!proc) {
+        return false;
+    }
+    
+    enqueue(rq, proc, proc->dyn_priority);
+    rq->steals++;
+    return true;
+}
+
+// Double the table, the free-slot stack and the hash index. Called with
+// process_lock held.
+static bool grow_process_table(void) {
+    u32 new_size = table_size ? table_size * 2 : PROCESS_TABLE_INITIAL;
+    if (new_size > PROCESS_TABLE_MAX) {
+        return false;
+    }
+    
+    process_t** table = (process_t**)krealloc(process_table, new_size * sizeof(process_t*));
+    if (!table) {
+        return false;
+    }
+    process_table = table;
+    
+    u32* slots = (u32*)krealloc(free_slots, new_size * sizeof(u32));
+    if (!slots) {
+        return false;
+    }
+    free_slots = slots;
+    
+    process_t** hash = (process_t**)kmalloc(new_size * sizeof(process_t*));
+    if (!hash) {
+        return false;
+    }
+    memset(hash, 0, new_size * sizeof(process_t*));
+    
+    // Rehash into the larger index
+    for (u32 i = 0; i < table_size; i++) {
+        process_t* proc = process_table[i];
+        if (proc) {
+            u32 bucket = proc->pid & (new_size - 1);
+            proc->hash_next = hash[bucket];
+            hash[bucket] = proc;
+        }
+    }
+    kfree(pid_hash);
+    pid_hash = hash;
+    pid_hash_mask = new_size - 1;
+    
+    // Push the new slots so the lowest is handed out first
+    for (u32 i = new_size; i > table_size; i--) {
+        process_table[i - 1] = NULL;
+        free_slots[free_count++] = i - 1;
+    }
+    table_size = new_size;
+    return true;
+}
+
+static process_t* find_process(u32 pid) {
+    if (!pid_hash) {
+        return NULL;
+    }
+    
+    process_t* proc = pid_hash[pid & pid_hash_mask];
+    while (proc && proc->pid != pid) {
+        proc = proc->hash_next;
     }
     return proc;
 }
 
-static process_t* find_highest_priority_process(void) {
-    for (int i = MAX_PRIORITY; i >= 0; i--) {
-        if (ready_queues[i]) {
-            return remove_from_ready_queue(i);
+// PIDs count up and only wrap at PID_MAX, skipping any still in use, so a
+// PID is not handed out again until billions of others have been. A stale
+// PID held by a caller keeps naming a dead process instead of silently
+// naming a new one.
+static u32 alloc_pid(void) {
+    while (1) {
+        u32 pid = next_pid;
+        next_pid = next_pid == PID_MAX ? 1 : next_pid + 1;
+        if (!find_process(pid)) {
+            return pid;
         }
     }
-    return NULL;
 }
 
-static void setup_process_stack(process_t* proc, void (*entry)(void)) {
+// Assign a PID and slot. Called with process_lock held.
+static bool register_process(process_t* proc) {
+    if (!free_count && !grow_process_table()) {
+        return false;
+    }
+    
+    proc->pid = alloc_pid();
+    proc->slot = free_slots[--free_count];
+    process_table[proc->slot] = proc;
+    
+    u32 bucket = proc->pid & pid_hash_mask;
+    proc->hash_next = pid_hash[bucket];
+    pid_hash[bucket] = proc;
+    process_count++;
+    return true;
+}
+
+static void unregister_process(process_t* proc) {
+    process_t** link = &pid_hash[proc->pid & pid_hash_mask];
+    while (*link != proc) {
+        link = &(*link)->hash_next;
+    }
+    *link = proc->hash_next;
+    
+    process_table[proc->slot] = NULL;
+    free_slots[free_count++] = proc->slot;
+    process_count--;
+}
+
+static void free_process(process_t* proc) {
+    if (proc->mm) {
+        as_destroy(proc->mm);
+    }
+    fpu_free(proc);
+    if (proc->stack_base) {
+        kstack_free(proc->stack_base, proc->stack_size);
+    }
+    kmem_cache_free(process_cache, proc);
+}
+
+static void wait_unlink(process_t* proc) {
+    wait_queue_t* wq = proc->waiting_on;
+    
+    if (proc->prev) {
+        proc->prev->next = proc->next;
+    } else {
+        wq->head = proc->next;
+    }
+    if (proc->next) {
+        proc->next->prev = proc->prev;
+    } else {
+        wq->tail = proc->prev;
+    }
+    proc->next = NULL;
+    proc->prev = NULL;
+    proc->waiting_on = NULL;
+}
+
+// Runs in the process switched to: drop the run queue lock taken by the
+// process that switched away, then free it if it exited
+static void finish_switch(void) {
+    sched_cpu_t* rq = this_rq();
+    process_t* zombie = rq->zombie;
+    
+    rq->zombie = NULL;
+    spin_unlock(&rq->lock);
+    if (zombie) {
+        free_process(zombie);
+    }
+}
+
+static void exit_current(void);
+static void schedule_locked(sched_cpu_t* rq);
+
+// First code run by a new process: switch_context() returns here
+static void process_start(void) {
+    finish_switch();
+    
+    // Killed before it ever ran: schedule() never sees it on the way in
+    if (get_current_process()->killed) {
+        exit_current();
+    }
+    asm volatile("sti");
+    
+    void (*entry)(void) = (void (*)(void))get_current_process()->eip;
+    entry();
+    
+    exit_current();
+}
+
+// With nothing ready, halt until an interrupt brings work. The BSP also
+// stops the periodic tick until the next timer is due.
+void cpu_idle(void) {
+    while (1) {
+        asm volatile("cli");
+        sched_cpu_t* rq = this_rq();
+        if (rq->ready_bitmap || rq->need_resched) {
+            schedule();
+        } else {
+            klog_flush();
+            vga_flush();
+            bool bsp = this_cpu()->index == 0;
+            if (bsp) {
+                timer_idle_enter();
+            }
+            asm volatile("sti; hlt; cli");
+            if (bsp) {
+                timer_idle_exit();
+            }
+        }
+        asm volatile("sti");
+    }
+}
+
+// Build the frame switch_context() pops when it first switches to proc
+static void setup_process_stack(process_t* proc) {
     u32* stack = (u32*)(proc->stack_base + proc->stack_size);
     
-    // Initialize stack frame for iret
     stack--;
-    *stack = 0x202;  // EFLAGS (IF set)
+    *stack = 0;  // Return address for process_start (never used)
     stack--;
-    *stack = 0x08;  // CS
-    stack--;
-    *stack = (u32)entry;  // EIP
+    *stack = (u32)process_start;  // switch_context returns here
     
-    // Registers
-    stack--;
-    *stack = 0;  // EDI
-    stack--;
-    *stack = 0;  // ESI
+    // Callee-saved registers
     stack--;
     *stack = 0;  // EBP
     stack--;
-    *stack = (u32)stack;  // ESP
-    stack--;
     *stack = 0;  // EBX
     stack--;
-    *stack = 0;  // EDX
-    stack--;
-    *stack = 0;  // ECX
+    *stack = 0;  // ESI
     stack--;
-    *stack = 0;  // EAX
+    *stack = 0;  // EDI
     
     proc->esp = (u32)stack;
-    proc->ebp = proc->esp;
+    proc->ebp = 0;
+}
+
+static process_t* alloc_process(void (*entry)(void), u32 priority, u32 stack_size) {
+    process_t* proc = (process_t*)kmem_cache_alloc(process_cache);
+    if (!proc) {
+        return NULL;
+    }
+    memset(proc, 0, sizeof(process_t));
+    
+    // Guard-paged stack, normally straight off the stack cache
+    proc->stack_size = stack_size;
+    proc->stack_base = kstack_alloc(&proc->stack_size);
+    if (!proc->stack_base) {
+        kmem_cache_free(process_cache, proc);
+        return NULL;
+    }
+    
+    proc->priority = priority;
+    proc->base_priority = priority;
+    proc->eip = (u32)entry;
+    proc->start_tsc = rdtsc();
+    setup_process_stack(proc);
+    
+    return proc;
 }
 
 void scheduler_init(void) {
     if (initialized) return;
     
-    memset(processes, 0, sizeof(processes));
     for (int i = 0; i <= MAX_PRIORITY; i++) {
-        ready_queues[i] = NULL;
+        time_slice[i] = timer_ms_to_ticks(SCHED_BASE_SLICE_MS + i * SCHED_SLICE_STEP_MS);
     }
+    aging_interval = timer_ms_to_ticks(SCHED_AGING_INTERVAL_MS);
+    aging_threshold = timer_ms_to_ticks(SCHED_AGING_THRESHOLD_MS);
+    
+    // Control blocks come from a dedicated slab cache, stacks from the
+    // guard-paged stack allocator
+    process_cache = kmem_cache_create("process", sizeof(process_t), 0, NULL);
+    kstack_init(PROCESS_STACK_SIZE);
+    
+    // Runs when nothing else is ready; never queued
+    sched_cpu_t* rq = this_rq();
+    spin_lock_init(&rq->lock, "run queue");
+    rq->cpu = 0;
+    rq->idle = alloc_process(cpu_idle, 0, PROCESS_STACK_SIZE);
+    rq->idle->pid = 0;
+    
+    // The boot thread becomes a process on its existing stack
+    process_t* boot = (process_t*)kmem_cache_alloc(process_cache);
+    memset(boot, 0, sizeof(process_t));
+    boot->priority = SHELL_PRIORITY;
+    boot->base_priority = SHELL_PRIORITY;
+    boot->dyn_priority = SHELL_PRIORITY;
+    boot->state = PROCESS_RUNNING;
+    boot->time_slice = time_slice[SHELL_PRIORITY];
+    boot->start_tsc = rdtsc();
+    boot->last_tsc = boot->start_tsc;
+    register_process(boot);
+    rq->current = boot;
     
     initialized = true;
 }
 
+// On an AP: its boot thread becomes the CPU's idle process, already
+// running on the stack prepared by smp_init()
+void scheduler_start_ap(void) {
+    cpu_t* cpu = this_cpu();
+    sched_cpu_t* rq = &cpu->sched;
+    
+    process_t* idle = (process_t*)kmem_cache_alloc(process_cache);
+    memset(idle, 0, sizeof(process_t));
+    idle->state = PROCESS_RUNNING;
+    idle->cpu = cpu->index;
+    idle->start_tsc = rdtsc();
+    idle->last_tsc = idle->start_tsc;
+    
+    spin_lock_init(&rq->lock, "run queue");
+    rq->cpu = cpu->index;
+    rq->idle = idle;
+    rq->current = idle;
+}
+
+static u32 start_process(process_t* proc);
+
 u32 process_create(void (*entry)(void), u32 priority) {
+    return process_create_ex(entry, priority, PROCESS_STACK_SIZE);
+}
+
+// As process_create(), with a stack of at least stack_size bytes (rounded
+// up to a power-of-two number of pages, at most KSTACK_MAX_SIZE)
+u32 process_create_ex(void (*entry)(void), u32 priority, u32 stack_size) {
     if (!initialized) {
         scheduler_init();
     }
@@ -90,77 +518,586 @@ u32 process_create(void (*entry)(void), u32 priority) {
         priority = MAX_PRIORITY;
     }
     
-    // Find free process slot
-    process_t* proc = NULL;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROCESS_TERMINATED || processes[i].pid == 0) {
-            proc = &processes[i];
-            break;
-        }
+    process_t* proc = alloc_process(entry, priority, stack_size);
+    if (!proc) {
+        return 0;  // Out of memory
+    }
+    return start_process(proc);
+}
+
+// Register a new process and queue it. Returns its pid, or 0 if the
+// process table is full, in which case proc is freed.
+static u32 start_process(process_t* proc) {
+    u32 flags = spin_lock_irqsave(&process_lock);
+    if (!register_process(proc)) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        free_process(proc);
+        return 0;  // Table full
     }
+    u32 pid = proc->pid;
+    spin_unlock(&process_lock);
     
-    if (!proc) {
-        return 0;  // No free slots
+    // Start it on the least loaded CPU
+    u32 cpu = pick_cpu();
+    sched_cpu_t* rq = cpu_rq(cpu);
+    spin_lock(&rq->lock);
+    add_to_ready_queue(rq, proc);
+    bool preempt = should_preempt(rq, proc);
+    if (preempt) {
+        rq->need_resched = true;
+    }
+    spin_unlock(&rq->lock);
+    if (preempt) {
+        smp_send_resched(cpu);
     }
     
-    // Allocate stack
-    proc->stack_size = 4096;  // 4KB stack
-    proc->stack_base = (u32)kmalloc(proc->stack_size);
-    if (!proc->stack_base) {
+    irq_restore(flags);
+    return pid;
+}
+
+// Duplicate the running process. The child gets a copy of the kernel
+// stack and of the address space, and resumes returning 0 from here. Frame
+// pointers saved on the copied stack are rebased onto the child's stack so
+// it can return up the call chain; any other pointer into the parent's
+// stack is not, so the child must not use addresses of stack variables
+// taken before the fork. Call without locks held.
+static int do_fork(bool eager) {
+    process_t* parent = get_current_process();
+    if (!parent->stack_base) {
+        return -1;  // Boot and idle threads: stack bounds unknown
+    }
+    
+    process_t* child = (process_t*)kmem_cache_alloc(process_cache);
+    if (!child) {
+        return -1;
+    }
+    memset(child, 0, sizeof(process_t));
+    child->stack_size = parent->stack_size;
+    child->stack_base = kstack_alloc(&child->stack_size);
+    if (!child->stack_base || child->stack_size != parent->stack_size) {
+        free_process(child);
+        return -1;
+    }
+    if (parent->mm) {
+        child->mm = as_fork(parent->mm, eager);
+        if (!child->mm) {
+            free_process(child);
+            return -1;
+        }
+    }
+    if (!fpu_fork(parent, child)) {
+        free_process(child);
+        return -1;
+    }
+    child->priority = parent->base_priority;
+    child->base_priority = parent->base_priority;
+    child->start_tsc = rdtsc();
+    
+    u32 frame[7];
+    if (save_context(frame)) {
+        // The child, switched to for the first time, unless killed before
+        finish_switch();
+        if (get_current_process()->killed) {
+            exit_current();
+        }
+        asm volatile("sti");
         return 0;
     }
     
-    proc->pid = next_pid++;
-    proc->priority = priority;
-    proc->state = PROCESS_READY;
+    u32 parent_top = parent->stack_base + parent->stack_size;
+    u32 delta = child->stack_base - parent->stack_base;
+    u32 sp = frame[6];
+    memcpy((void*)(sp + delta), (void*)sp, parent_top - sp);
+    child->esp = sp + delta - 6 * sizeof(u32);
+    memcpy((void*)child->esp, frame, 6 * sizeof(u32));
     
-    setup_process_stack(proc, entry);
+    // Walk the saved EBP chain, starting with the one switch_context pops
+    u32* link = (u32*)(child->esp + 3 * sizeof(u32));
+    while (*link >= sp && *link < parent_top) {
+        *link += delta;
+        link = (u32*)*link;
+    }
     
-    add_to_ready_queue(proc);
+    u32 pid = start_process(child);
+    return pid ? (int)pid : -1;
+}
+
+// Returns the child's pid in the parent, 0 in the child, or -1
+int fork(void) {
+    return do_fork(false);
+}
+
+// fork() copying every private page up front, for comparison
+int fork_eager(void) {
+    return do_fork(true);
+}
+
+// The running process leaves for good. Its stack is still in use until the
+// switch, so the next process on this CPU frees it.
+static void exit_current(void) {
+    asm volatile("cli");
+    sched_cpu_t* rq = this_rq();
+    process_t* proc = rq->current;
+    mutex_release_all();
+    fpu_exit(proc);
+    
+    spin_lock(&process_lock);
+    unregister_process(proc);
+    spin_unlock(&process_lock);
+    
+    // Its sleep timer lives on the stack about to be freed
+    if (proc->sleep_timer) {
+        timer_cancel(proc->sleep_timer);
+    }
     
-    return proc->pid;
+    // Unmapping the window detaches shared memory and frees private pages
+    if (proc->mm) {
+        paging_switch(NULL);
+        as_destroy(proc->mm);
+        proc->mm = NULL;
+    }
+    
+    spin_lock(&rq->lock);
+    proc->state = PROCESS_TERMINATED;
+    rq->zombie = proc;
+    schedule_locked(rq);  // Never returns
 }
 
+// Exiting another process may find it running on some other CPU, so it is
+// only marked; it exits itself the next time it passes through schedule().
+// A blocked process is woken to do so.
 void process_exit(u32 pid) {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i].pid == pid) {
-            processes[i].state = PROCESS_TERMINATED;
-            if (processes[i].stack_base) {
-                kfree((void*)processes[i].stack_base);
+    u32 flags = spin_lock_irqsave(&process_lock);
+    
+    process_t* proc = find_process(pid);
+    if (!proc) {
+        spin_unlock_irqrestore(&process_lock, flags);
+        return;
+    }
+    
+    if (proc == get_current_process()) {
+        spin_unlock(&process_lock);
+        exit_current();
+    }
+    
+    // Holding process_lock keeps proc from exiting and being freed
+    proc->killed = true;
+    wait_queue_t* wq = proc->waiting_on;
+    if (wq) {
+        spin_lock(&wq->lock);
+        if (proc->waiting_on == wq) {
+            wait_unlink(proc);
+        }
+        spin_unlock(&wq->lock);
+    }
+    process_wake(proc);
+    
+    spin_unlock_irqrestore(&process_lock, flags);
+}
+
+// Pick the next process on this CPU and switch to it. Called with
+// interrupts disabled and rq->lock held; returns with the lock released.
+static void schedule_locked(sched_cpu_t* rq) {
+    process_t* prev = rq->current;
+    bool prev_runnable = prev != rq->idle && prev->state == PROCESS_RUNNING;
+    
+    rq->need_resched = false;
+    
+    if (!rq->ready_bitmap) {
+        if (prev_runnable) {
+            // Nothing else to run
+            prev->time_slice = time_slice[prev->priority];
+            spin_unlock(&rq->lock);
+            return;
+        }
+        if (!steal_work(rq) && prev == rq->idle) {
+            spin_unlock(&rq->lock);
+            return;
+        }
+    } else if (prev_runnable && bit_scan_reverse(rq->ready_bitmap) < prev->dyn_priority) {
+        // Only lower priority work is waiting: keep running
+        prev->time_slice = time_slice[prev->priority];
+        spin_unlock(&rq->lock);
+        return;
+    }
+    
+    // Charge the run that ends here
+    u64 now = rdtsc();
+    prev->runtime += now - prev->last_tsc;
+    
+    // Requeue behind its peers, dropping any aging boost
+    if (prev_runnable) {
+        add_to_ready_queue(rq, prev);
+        prev->last_tsc = now;
+    }
+    
+    process_t* next = find_highest_priority_process(rq);
+    if (!next) {
+        next = rq->idle;
+    }
+    
+    if (next != prev) {
+        if (prev_runnable) {
+            prev->nivcsw++;
+        } else if (prev != rq->idle) {
+            prev->nvcsw++;
+        }
+    }
+    if (next != rq->idle) {
+        next->wait_time += now - next->last_tsc;
+    }
+    next->last_tsc = now;
+    next->state = PROCESS_RUNNING;
+    next->time_slice = time_slice[next->priority];
+    rq->current = next;
+    
+    if (prev == rq->idle && this_cpu()->index == 0) {
+        timer_idle_exit();
+    }
+    
+    if (next != prev) {
+        paging_tlb_sync();
+        fpu_switch(prev);
+        if (next->mm != prev->mm) {
+            paging_switch(next->mm ? next->mm->directory : NULL);
+        }
+        switch_context(&prev->esp, next->esp);
+    }
+    finish_switch();
+}
+
+// Also where a process marked by process_exit() leaves: on its way out,
+// or once it is switched back in
+void schedule(void) {
+    if (this_rq()->current->killed) {
+        exit_current();
+    }
+    
+    sched_cpu_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+    
+    if (this_rq()->current->killed) {
+        exit_current();
+    }
+}
+
+// Timer interrupt: charge the elapsed ticks to the running process and
+// ask for a switch when its slice is used up or higher priority work is
+// waiting. elapsed is more than one after a tickless idle period. An idle
+// CPU also asks for a switch when another CPU has work it could steal.
+void scheduler_tick(u32 elapsed) {
+    if (!initialized) return;
+    sched_cpu_t* rq = this_rq();
+    process_t* proc = rq->current;
+    if (!proc) return;
+    
+    u32 now = timer_get_ticks();
+    spin_lock(&rq->lock);
+    
+    if (SCHED_AGING && now - rq->last_aging >= aging_interval) {
+        rq->last_aging = now;
+        age_ready_queues(rq, now);
+    }
+    
+    if (proc == rq->idle) {
+        rq->idle_ticks += elapsed;
+        if (rq->ready_bitmap) {
+            rq->need_resched = true;
+        }
+        for (u32 i = 0; i < cpu_count && !rq->need_resched; i++) {
+            if (cpu_rq(i)->nr_ready) {
+                rq->need_resched = true;
             }
-            memset(&processes[i], 0, sizeof(process_t));
-            break;
         }
+        spin_unlock(&rq->lock);
+        return;
     }
     
-    if (current_process && current_process->pid == pid) {
-        current_process = NULL;
+    proc->ticks += elapsed;
+    rq->priority_ticks[proc->priority] += elapsed;
+    proc->time_slice = proc->time_slice > elapsed ? proc->time_slice - elapsed : 0;
+    
+    if (proc->time_slice == 0 || ready_above(rq, proc->dyn_priority) || proc->killed) {
+        rq->need_resched = true;
+    }
+    spin_unlock(&rq->lock);
+}
+
+// Called at the end of every IRQ, after the handler and EOI
+void scheduler_irq_exit(void) {
+    if (initialized && this_rq()->current && this_rq()->need_resched) {
         schedule();
     }
 }
 
-void schedule(void) {
-    if (current_process && current_process->state == PROCESS_RUNNING) {
-        add_to_ready_queue(current_process);
+void scheduler_stats(void) {
+    vga_puts("Tick rate: ");
+    vga_put_dec(timer_get_frequency());
+    vga_puts(" Hz, uptime ");
+    vga_put_dec(timer_get_ticks());
+    vga_puts(" ticks, ");
+    vga_put_dec(cpu_count);
+    vga_puts(cpu_count == 1 ? " CPU\n" : " CPUs\n");
+    vga_puts("  processes: ");
+    vga_put_dec(process_count);
+    vga_puts(" (table ");
+    vga_put_dec(table_size);
+    vga_puts(" slots)\n");
+    
+    // Only levels that have run anything, summed over all CPUs
+    for (int i = MAX_PRIORITY; i >= 0; i--) {
+        u32 ticks = 0;
+        for (u32 cpu = 0; cpu < cpu_count; cpu++) {
+            ticks += cpu_rq(cpu)->priority_ticks[i];
+        }
+        if (!ticks) {
+            continue;
+        }
+        vga_puts("  priority ");
+        vga_put_dec(i);
+        vga_puts(": slice ");
+        vga_put_dec(time_slice[i]);
+        vga_puts(" ticks, ran ");
+        vga_put_dec(ticks);
+        vga_puts(" ticks\n");
     }
     
-    process_t* next = find_highest_priority_process();
-    if (next) {
-        current_process = next;
-        current_process->state = PROCESS_RUNNING;
+    u32 idle_ticks = 0;
+    u32 aged_count = 0;
+    for (u32 cpu = 0; cpu < cpu_count; cpu++) {
+        idle_ticks += cpu_rq(cpu)->idle_ticks;
+        aged_count += cpu_rq(cpu)->aged_count;
+    }
+    vga_puts("  idle: ");
+    vga_put_dec(idle_ticks);
+    vga_puts(" ticks\n");
+    if (SCHED_AGING) {
+        vga_puts("  aging promotions: ");
+        vga_put_dec(aged_count);
+        vga_puts("\n");
+    }
+    kstack_stats();
+}
+
+// Copy the accounting of up to max processes into out, in table order.
+// Returns the number of live processes, which may exceed max. The current
+// run or wait is included, read without the process's run queue lock.
+u32 process_snapshot(process_info_t* out, u32 max) {
+    u32 flags = spin_lock_irqsave(&process_lock);
+    u64 now = rdtsc();
+    u32 count = 0;
+    
+    for (u32 i = 0; i < table_size && count < max; i++) {
+        process_t* proc = process_table[i];
+        if (!proc) {
+            continue;
+        }
         
-        // Context switch would happen here
-        // For now, we'll use a simple round-robin approach
-    } else if (current_process) {
-        // Keep current process if no other ready
-        current_process->state = PROCESS_RUNNING;
+        process_info_t* info = &out[count++];
+        info->pid = proc->pid;
+        info->priority = proc->priority;
+        info->dyn_priority = proc->dyn_priority;
+        info->cpu = proc->cpu;
+        info->state = proc->state;
+        info->runtime = proc->runtime;
+        info->wait_time = proc->wait_time;
+        u64 last = proc->last_tsc;
+        if (now > last && proc->state == PROCESS_RUNNING) {
+            info->runtime += now - last;
+        } else if (now > last && proc->state == PROCESS_READY) {
+            info->wait_time += now - last;
+        }
+        info->start_tsc = proc->start_tsc;
+        info->nvcsw = proc->nvcsw;
+        info->nivcsw = proc->nivcsw;
     }
+    count = process_count;
+    
+    spin_unlock_irqrestore(&process_lock, flags);
+    return count;
 }
 
 process_t* get_current_process(void) {
-    return current_process;
+    u32 flags = irq_save();
+    process_t* proc = this_rq()->current;
+    irq_restore(flags);
+    return proc;
 }
 
 void yield(void) {
+    u32 flags = irq_save();
     schedule();
+    irq_restore(flags);
+}
+
+void wait_queue_init(wait_queue_t* wq) {
+    spin_lock_init(&wq->lock, "wait queue");
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// Block the current process on wq until process_wake(). Called with
+// wq->lock held and interrupts disabled; returns with the lock held again.
+// Wakeups can be spurious, so callers recheck their condition (see
+// wait_event()).
+void sleep_on(wait_queue_t* wq) {
+    sleep_on_unlock(wq, NULL);
+    spin_lock(&wq->lock);
+}
+
+// As sleep_on(), but also drops outer, a lock taken before wq->lock, and
+// returns with neither lock held
+void sleep_on_unlock(wait_queue_t* wq, spinlock_t* outer) {
+    sched_cpu_t* rq = this_rq();
+    process_t* proc = rq->current;
+    
+    proc->waiting_on = wq;
+    proc->next = NULL;
+    proc->prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = proc;
+    } else {
+        wq->head = proc;
+    }
+    wq->tail = proc;
+    
+    // Take the run queue lock before letting wakers at the wait queue, so
+    // a wakeup can't requeue us before we are switched out
+    spin_lock(&rq->lock);
+    proc->state = PROCESS_BLOCKED;
+    spin_unlock(&wq->lock);
+    if (outer) {
+        spin_unlock(outer);
+    }
+    schedule_locked(rq);
+    
+    if (proc->killed) {
+        exit_current();
+    }
+}
+
+// Make a blocked process ready on the CPU it last ran on. Safe from
+// interrupt handlers and other CPUs: the switch to it is deferred to
+// scheduler_irq_exit(), via an IPI when it belongs to another CPU.
+void process_wake(process_t* proc) {
+    u32 flags = irq_save();
+    u32 cpu = proc->cpu;
+    sched_cpu_t* rq = cpu_rq(cpu);
+    bool preempt = false;
+    
+    spin_lock(&rq->lock);
+    if (proc->state == PROCESS_BLOCKED) {
+        add_to_ready_queue(rq, proc);
+        preempt = should_preempt(rq, proc);
+        if (preempt) {
+            rq->need_resched = true;
+        }
+    }
+    spin_unlock(&rq->lock);
+    
+    if (preempt) {
+        smp_send_resched(cpu);
+    }
+    irq_restore(flags);
+}
+
+void wake_up(wait_queue_t* wq) {
+    u32 flags = spin_lock_irqsave(&wq->lock);
+    wake_up_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Wake the first waiter, if any, with wq->lock already held
+bool wake_up_locked(wait_queue_t* wq) {
+    process_t* proc = wq->head;
+    if (!proc) {
+        return false;
+    }
+    wait_unlink(proc);
+    process_wake(proc);
+    return true;
+}
+
+void wake_up_all(wait_queue_t* wq) {
+    u32 flags = spin_lock_irqsave(&wq->lock);
+    while (wq->head) {
+        process_t* proc = wq->head;
+        wait_unlink(proc);
+        process_wake(proc);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Change proc's priority, moving it up its run queue if it is waiting to
+// run. Priority inheritance uses this to boost a mutex owner and to drop
+// the boost again; a lowered priority takes effect at the next requeue.
+void sched_set_priority(process_t* proc, u32 priority) {
+    u32 flags = irq_save();
+    sched_cpu_t* rq;
+    
+    // Work stealing can move a ready process between queues; retry until
+    // the queue locked is the one it is on
+    while (1) {
+        rq = cpu_rq(proc->cpu);
+        spin_lock(&rq->lock);
+        if (proc->cpu == rq->cpu) {
+            break;
+        }
+        spin_unlock(&rq->lock);
+    }
+    
+    bool preempt = false;
+    proc->priority = priority;
+    if (proc->state == PROCESS_READY && priority > proc->dyn_priority) {
+        dequeue(rq, proc);
+        enqueue(rq, proc, priority);
+        preempt = should_preempt(rq, proc);
+    } else if (proc == rq->current) {
+        proc->dyn_priority = priority;
+        preempt = ready_above(rq, priority);
+    }
+    if (preempt) {
+        rq->need_resched = true;
+    }
+    spin_unlock(&rq->lock);
+    
+    if (preempt) {
+        smp_send_resched(rq->cpu);
+    }
+    irq_restore(flags);
+}
+
+static void sleep_timeout(void* data) {
+    process_wake((process_t*)data);
+}
+
+// Block for at least ms milliseconds, rounded up to whole ticks
+void sleep_ms(u32 ms) {
+    ktimer_t timer;
+    u32 flags = irq_save();
+    process_t* proc = this_rq()->current;
+    
+    timer_setup(&timer, sleep_timeout, proc);
+    proc->sleep_timer = &timer;
+    timer_add(&timer, timer_get_ticks() + timer_ms_to_ticks(ms));
+    
+    // The expiry clears pending before waking us, and the wakeup needs our
+    // run queue lock, so checking pending under that lock can't miss it
+    while (1) {
+        sched_cpu_t* rq = this_rq();
+        spin_lock(&rq->lock);
+        if (!timer.pending) {
+            spin_unlock(&rq->lock);
+            break;
+        }
+        proc->state = PROCESS_BLOCKED;
+        schedule_locked(rq);
+        if (proc->killed) {
+            exit_current();
+        }
+    }
+    proc->sleep_timer = NULL;
+    
+    irq_restore(flags);
 }
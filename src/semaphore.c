@@ -0,0 +1,35 @@
+#include "semaphore.h"
+#include "kernel.h"
+
+void sem_init(semaphore_t* sem, u32 count) {
+    sem->count = count;
+    wait_queue_init(&sem->wait);
+}
+
+void sem_down(semaphore_t* sem) {
+    u32 flags = spin_lock_irqsave(&sem->wait.lock);
+    while (sem->count == 0) {
+        sleep_on(&sem->wait);
+    }
+    sem->count--;
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+}
+
+bool sem_trydown(semaphore_t* sem) {
+    u32 flags = spin_lock_irqsave(&sem->wait.lock);
+    bool taken = sem->count > 0;
+    if (taken) {
+        sem->count--;
+    }
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+    return taken;
+}
+
+// One waiter per unit: a waiter that finds the count taken again by a
+// sem_trydown() meanwhile just goes back to sleep
+void sem_up(semaphore_t* sem) {
+    u32 flags = spin_lock_irqsave(&sem->wait.lock);
+    sem->count++;
+    wake_up_locked(&sem->wait);
+    spin_unlock_irqrestore(&sem->wait.lock, flags);
+}
@@ -0,0 +1,246 @@
+#include "serial.h"
+#include "idt.h"
+#include "kernel.h"
+#include "spinlock.h"
+#include "tty.h"
+
+// 16550 UART driver for COM1
+//
+// Output is queued on a transmit ring and moved into the UART's 16-byte
+// FIFO a burst at a time: by the writer when the transmitter is idle, and
+// then by the transmit-empty interrupt until the ring drains, when that
+// interrupt is switched off again. Writers only wait on the UART when the
+// ring is full. Received bytes are taken from the FIFO by the interrupt
+// handler onto a receive ring, and the console's readers are woken.
+#define UART_DATA 0  // Divisor latch low with DLAB set
+#define UART_IER  1  // Divisor latch high with DLAB set
+#define UART_IIR  2  // FIFO control on write
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+#define UART_MSR  6
+
+#define IER_RX 0x01
+#define IER_TX 0x02
+
+#define FCR_ENABLE    0x01
+#define FCR_CLEAR     0x06  // Both FIFOs
+#define FCR_TRIGGER_8 0x80  // Receive interrupt at 8 bytes
+
+#define LCR_8N1  0x03
+#define LCR_DLAB 0x80
+
+#define MCR_DTR      0x01
+#define MCR_RTS      0x02
+#define MCR_OUT2     0x08  // Gates the IRQ line on PCs
+#define MCR_LOOPBACK 0x10
+
+#define LSR_DATA    0x01
+#define LSR_OVERRUN 0x02
+#define LSR_THRE    0x20
+
+#define IIR_NONE    0x01
+#define IIR_ID      0x0E
+#define IIR_MODEM   0x00
+#define IIR_THRE    0x02
+#define IIR_RX      0x04
+#define IIR_LINE    0x06
+#define IIR_TIMEOUT 0x0C
+
+#define UART_FIFO_SIZE 16
+
+static u8 tx_ring[SERIAL_TX_SIZE];
+static u32 tx_head = 0;
+static u32 tx_tail = 0;
+static char rx_ring[SERIAL_RX_SIZE];
+static u32 rx_head = 0;
+static u32 rx_tail = 0;
+static bool tx_armed = false;  // Transmit-empty interrupt enabled
+static serial_stats_t stats;
+static spinlock_t serial_lock = SPINLOCK_INIT("serial");
+static bool initialized = false;
+
+static inline void uart_out(u32 reg, u8 value) {
+    outb(COM1_PORT + reg, value);
+}
+
+static inline u8 uart_in(u32 reg) {
+    return inb(COM1_PORT + reg);
+}
+
+// Refill the transmit FIFO, which the caller has seen empty, and keep the
+// transmit interrupt on for as long as the ring has more
+static void tx_fill(void) {
+    for (u32 n = 0; n < UART_FIFO_SIZE && tx_head != tx_tail; n++) {
+        uart_out(UART_DATA, tx_ring[tx_head]);
+        tx_head = (tx_head + 1) % SERIAL_TX_SIZE;
+        stats.tx_bytes++;
+    }
+    
+    bool pending = tx_head != tx_tail;
+    if (pending != tx_armed) {
+        uart_out(UART_IER, pending ? IER_RX | IER_TX : IER_RX);
+        tx_armed = pending;
+    }
+}
+
+// Send the next FIFO's worth without the interrupt, for a full ring or
+// with interrupts off for good
+static void tx_poll(void) {
+    while (!(uart_in(UART_LSR) & LSR_THRE)) {
+        asm volatile("pause");
+    }
+    tx_fill();
+}
+
+static void serial_handler(registers_t* regs) {
+    (void)regs;
+    bool received = false;
+    
+    spin_lock(&serial_lock);
+    stats.interrupts++;
+    u8 iir;
+    while (!((iir = uart_in(UART_IIR)) & IIR_NONE)) {
+        switch (iir & IIR_ID) {
+            case IIR_RX:
+            case IIR_TIMEOUT:
+                while (uart_in(UART_LSR) & LSR_DATA) {
+                    char c = uart_in(UART_DATA);
+                    u32 next = (rx_tail + 1) % SERIAL_RX_SIZE;
+                    if (next == rx_head) {
+                        stats.rx_dropped++;
+                        continue;
+                    }
+                    rx_ring[rx_tail] = c;
+                    rx_tail = next;
+                    stats.rx_bytes++;
+                    received = true;
+                }
+                break;
+            case IIR_THRE:
+                tx_fill();
+                break;
+            case IIR_LINE:
+                if (uart_in(UART_LSR) & LSR_OVERRUN) {
+                    stats.overruns++;
+                }
+                break;
+            default:
+                uart_in(UART_MSR);
+                break;
+        }
+    }
+    spin_unlock(&serial_lock);
+    
+    // Hand the bytes to the tty outside the lock: its bottom half echoes
+    // through serial_write
+    if (received) {
+        char c;
+        while (serial_read(&c)) {
+            tty_input(c);
+        }
+    }
+}
+
+// Program COM1 for 8N1 at 115200 / divisor with FIFOs and interrupts.
+// False if there is no UART, which the loopback test finds out.
+bool serial_init(u32 divisor) {
+    if (initialized) return true;
+    
+    if (divisor == 0 || divisor > 0xFFFF) {
+        divisor = SERIAL_DIVISOR;
+    }
+    
+    uart_out(UART_IER, 0);
+    uart_out(UART_LCR, LCR_DLAB);
+    uart_out(UART_DATA, divisor & 0xFF);
+    uart_out(UART_IER, divisor >> 8);
+    uart_out(UART_LCR, LCR_8N1);
+    uart_out(UART_IIR, FCR_ENABLE | FCR_CLEAR | FCR_TRIGGER_8);
+    
+    uart_out(UART_MCR, MCR_LOOPBACK | MCR_RTS | MCR_OUT2);
+    uart_out(UART_DATA, 0xA5);
+    if (uart_in(UART_DATA) != 0xA5) {
+        return false;
+    }
+    
+    uart_out(UART_MCR, MCR_DTR | MCR_RTS | MCR_OUT2);
+    register_interrupt_handler(COM1_IRQ, serial_handler);
+    uart_out(UART_IER, IER_RX);
+    
+    initialized = true;
+    return true;
+}
+
+bool serial_present(void) {
+    return initialized;
+}
+
+void serial_write(const char* buf, size_t len) {
+    if (!initialized) {
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&serial_lock);
+    for (size_t i = 0; i < len; i++) {
+        u32 next = (tx_tail + 1) % SERIAL_TX_SIZE;
+        if (next == tx_head) {
+            // The interrupt can't drain the ring while we hold the lock
+            stats.tx_full++;
+            tx_poll();
+        }
+        tx_ring[tx_tail] = buf[i];
+        tx_tail = next;
+    }
+    
+    // Start an idle transmitter, or have a busy one interrupt when its
+    // FIFO empties
+    if (!tx_armed) {
+        if (uart_in(UART_LSR) & LSR_THRE) {
+            tx_fill();
+        } else {
+            uart_out(UART_IER, IER_RX | IER_TX);
+            tx_armed = true;
+        }
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// Next received byte, if any; doesn't block
+bool serial_read(char* c) {
+    if (!initialized) {
+        return false;
+    }
+    
+    u32 flags = spin_lock_irqsave(&serial_lock);
+    bool got = rx_head != rx_tail;
+    if (got) {
+        *c = rx_ring[rx_head];
+        rx_head = (rx_head + 1) % SERIAL_RX_SIZE;
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+    return got;
+}
+
+bool serial_has_input(void) {
+    return rx_head != rx_tail;
+}
+
+// Push out everything queued, for when interrupts won't come again
+void serial_flush(void) {
+    if (!initialized) {
+        return;
+    }
+    
+    u32 flags = spin_lock_irqsave(&serial_lock);
+    while (tx_head != tx_tail) {
+        tx_poll();
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+void serial_get_stats(serial_stats_t* out) {
+    u32 flags = spin_lock_irqsave(&serial_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
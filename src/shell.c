@@ -1,9 +1,29 @@
 #include "shell.h"
 #include "kernel.h"
 #include "vga.h"
-#include "keyboard.h"
+#include "console.h"
+#include "tty.h"
+#include "serial.h"
+#include "klog.h"
 #include "fs.h"
 #include "scheduler.h"
+#include "memory.h"
+#include "slab.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "ipc.h"
+#include "shm.h"
+#include "vm.h"
+
+// CPU-bound demo process: spins for two seconds, then exits
+static void busy_worker(void) {
+    u32 end = timer_get_ticks() + timer_ms_to_ticks(2000);
+    volatile u32 counter = 0;
+    while (timer_get_ticks() < end) {
+        counter++;
+    }
+}
 
 static void cmd_help(void) {
     vga_puts("Available commands:\n");
@@ -13,9 +33,64 @@ static void cmd_help(void) {
     vga_puts("  create   - Create a file\n");
     vga_puts("  delete   - Delete a file\n");
     vga_puts("  echo     - Echo text\n");
+    vga_puts("  membench - Run the allocator churn benchmark\n");
+    vga_puts("  copybench - Measure memcpy/memset throughput\n");
+    vga_puts("  vgabench - Measure console output throughput\n");
+    vga_puts("  slabinfo - Show slab cache usage\n");
+    vga_puts("  spawn    - Start a CPU-bound process [prio] [stack KB]\n");
+    vga_puts("  sched    - Show scheduler statistics\n");
+    vga_puts("  sleep    - Sleep for N milliseconds\n");
+    vga_puts("  ps       - List processes with CPU time and switches\n");
+    vga_puts("  top      - Show the busiest processes until a key is pressed\n");
+    vga_puts("  cpus     - Show per-CPU run queues\n");
+    vga_puts("  locks    - Show lock contention (LOCK_STATS=1 builds)\n");
+    vga_puts("  ipcbench - Measure message queue throughput and latency\n");
+    vga_puts("  shm      - Share a page with a new process, then list regions\n");
+    vga_puts("  forkbench - Compare copy-on-write and eager fork\n");
+    vga_puts("  console  - Choose console output [vga|serial|both]\n");
+    vga_puts("  dmesg    - Show the kernel log [-n level]\n");
+    vga_puts("  klogbench - Measure the cost of a kernel log record\n");
     vga_puts("  exit     - Exit shell (not implemented)\n");
 }
 
+// Child side of the shm demo. It exits still attached, so process exit
+// does the detaching.
+static void shm_worker(void) {
+    int id = shm_create("shmdemo", 4096);
+    volatile u32* shared = (volatile u32*)shm_attach(id);
+    if (shared) {
+        shared[0] = get_current_process()->pid;
+    }
+}
+
+static void cmd_shm(void) {
+    int id = shm_create("shmdemo", 4096);
+    volatile u32* shared = (volatile u32*)shm_attach(id);
+    if (!shared) {
+        vga_puts("shm: could not create region\n");
+        shm_destroy(id);
+        return;
+    }
+    
+    shared[0] = 0;
+    u32 pid = process_create(shm_worker, DEFAULT_PRIORITY);
+    for (u32 i = 0; i < 100 && pid && shared[0] != pid; i++) {
+        sleep_ms(10);
+    }
+    
+    if (pid && shared[0] == pid) {
+        sleep_ms(10);  // Let it exit
+        vga_puts("Process ");
+        vga_put_dec(pid);
+        vga_puts(" wrote its pid through shared memory\n");
+    } else {
+        vga_puts("shm: no write seen from the other process\n");
+    }
+    shm_stats();
+    shm_detach((void*)shared);
+    shm_destroy(id);
+}
+
 static void cmd_clear(void) {
     vga_clear();
 }
@@ -85,6 +160,322 @@ static void cmd_delete(char* args) {
     }
 }
 
+static void cmd_spawn(char* args) {
+    u32 priority = DEFAULT_PRIORITY;
+    u32 stack_kb = PROCESS_STACK_SIZE / 1024;
+    int i = 0;
+    if (args && args[0] >= '0' && args[0] <= '9') {
+        priority = 0;
+        for (; args[i] >= '0' && args[i] <= '9'; i++) {
+            priority = priority * 10 + (args[i] - '0');
+        }
+        while (args[i] == ' ') i++;
+        if (args[i] >= '0' && args[i] <= '9') {
+            stack_kb = 0;
+            for (; args[i] >= '0' && args[i] <= '9'; i++) {
+                stack_kb = stack_kb * 10 + (args[i] - '0');
+            }
+        }
+    }
+    
+    u32 pid = process_create_ex(busy_worker, priority, stack_kb * 1024);
+    if (pid) {
+        vga_puts("Started process ");
+        vga_put_dec(pid);
+        vga_puts("\n");
+    } else {
+        vga_puts("Failed to start process\n");
+    }
+}
+
+static const char* state_name(process_state_t state) {
+    switch (state) {
+        case PROCESS_READY:      return "ready";
+        case PROCESS_RUNNING:    return "running";
+        case PROCESS_BLOCKED:    return "blocked";
+        case PROCESS_TERMINATED: return "exiting";
+    }
+    return "?";
+}
+
+// Right-align value in width columns
+static void put_dec_padded(u32 value, u32 width) {
+    u32 digits = 1;
+    for (u32 v = value; v >= 10; v /= 10) {
+        digits++;
+    }
+    while (digits++ < width) {
+        vga_putchar(' ');
+    }
+    vga_put_dec(value);
+}
+
+static void put_str_padded(const char* str, u32 width) {
+    vga_puts(str);
+    for (u32 len = strlen(str); len < width; len++) {
+        vga_putchar(' ');
+    }
+}
+
+// Tenths of a percent as "12.5", right-aligned in width columns
+static void put_percent(u32 tenths, u32 width) {
+    put_dec_padded(tenths / 10, width - 2);
+    vga_putchar('.');
+    vga_put_dec(tenths % 10);
+}
+
+// part as tenths of a percent of total, both in TSC cycles
+static u32 share_tenths(u64 part, u64 total) {
+    u32 unit = div_u64_u32(total, 1000);
+    if (unit == 0) {
+        return 0;
+    }
+    u32 tenths = div_u64_u32(part, unit);
+    return tenths > 1000 ? 1000 : tenths;
+}
+
+static void print_process_header(void) {
+    vga_puts("  PID PRI DYN STATE    CPU  %CPU   TIME ms   WAIT ms   VCSW  IVCSW\n");
+}
+
+static void print_process(const process_info_t* info, u32 tenths, u32 tsc_per_ms) {
+    put_dec_padded(info->pid, 5);
+    put_dec_padded(info->priority, 4);
+    put_dec_padded(info->dyn_priority, 4);
+    vga_putchar(' ');
+    put_str_padded(state_name(info->state), 8);
+    put_dec_padded(info->cpu, 4);
+    put_percent(tenths, 6);
+    put_dec_padded(div_u64_u32(info->runtime, tsc_per_ms), 10);
+    put_dec_padded(div_u64_u32(info->wait_time, tsc_per_ms), 10);
+    put_dec_padded(info->nvcsw, 7);
+    put_dec_padded(info->nivcsw, 7);
+    vga_putchar('\n');
+}
+
+// Copy the process table sorted by PID into a new array. Returns the
+// count, with *out NULL if out of memory.
+static u32 snapshot_processes(process_info_t** out) {
+    u32 cap = process_snapshot(NULL, 0) + 16;  // Room for a few spawns
+    process_info_t* info = (process_info_t*)kmalloc(cap * sizeof(process_info_t));
+    *out = info;
+    if (!info) {
+        return 0;
+    }
+    
+    u32 count = process_snapshot(info, cap);
+    if (count > cap) {
+        count = cap;
+    }
+    
+    // Shell sort by PID
+    for (u32 gap = count / 2; gap > 0; gap /= 2) {
+        for (u32 i = gap; i < count; i++) {
+            process_info_t tmp = info[i];
+            u32 j = i;
+            while (j >= gap && info[j - gap].pid > tmp.pid) {
+                info[j] = info[j - gap];
+                j -= gap;
+            }
+            info[j] = tmp;
+        }
+    }
+    return count;
+}
+
+static u32 get_tsc_per_ms(void) {
+    u32 tsc_per_ms = timer_tsc_per_ms();
+    return tsc_per_ms ? tsc_per_ms : 1;
+}
+
+// Every process with its share of one CPU since it was created
+static void cmd_ps(void) {
+    process_info_t* info;
+    u32 count = snapshot_processes(&info);
+    if (!info) {
+        vga_puts("Out of memory\n");
+        return;
+    }
+    
+    u64 now = rdtsc();
+    u32 tsc_per_ms = get_tsc_per_ms();
+    print_process_header();
+    for (u32 i = 0; i < count; i++) {
+        print_process(&info[i], share_tenths(info[i].runtime, now - info[i].start_tsc), tsc_per_ms);
+    }
+    kfree(info);
+}
+
+// Wait up to ms for a key; true (and the key consumed) if one came
+static bool wait_for_key(u32 ms) {
+    for (u32 waited = 0; waited < ms; waited += 100) {
+        if (tty_has_input()) {
+            char c[2];
+            tty_read(c, sizeof(c));
+            return true;
+        }
+        sleep_ms(100);
+    }
+    return false;
+}
+
+// Busiest processes over the last second, redrawn until a key is pressed
+static void cmd_top(void) {
+    process_info_t* prev;
+    u32 prev_count = snapshot_processes(&prev);
+    u64 prev_tsc = rdtsc();
+    if (!prev) {
+        vga_puts("Out of memory\n");
+        return;
+    }
+    
+    // The screen so far goes into the scrollback once; frames are then
+    // redrawn over each other
+    vga_clear();
+    vga_puts("Sampling...\n");
+    
+    // Any key, not a whole line, ends it
+    tty_set_mode(TTY_RAW);
+    while (!wait_for_key(1000)) {
+        process_info_t* cur;
+        u32 count = snapshot_processes(&cur);
+        u64 now = rdtsc();
+        u32* share = cur ? (u32*)kmalloc((count + 1) * sizeof(u32)) : NULL;
+        if (!share) {
+            kfree(cur);
+            vga_puts("Out of memory\n");
+            break;
+        }
+        
+        // Both snapshots are sorted by PID, so deltas are one merge pass
+        u64 interval = now - prev_tsc;
+        u64 busy = 0;
+        u32 j = 0;
+        for (u32 i = 0; i < count; i++) {
+            while (j < prev_count && prev[j].pid < cur[i].pid) {
+                j++;
+            }
+            u64 delta = cur[i].runtime;
+            if (j < prev_count && prev[j].pid == cur[i].pid) {
+                delta -= prev[j].runtime;
+            }
+            busy += delta;
+            share[i] = share_tenths(delta, interval);
+        }
+        
+        console_home();
+        vga_puts("top - up ");
+        vga_put_dec(timer_get_ticks() / timer_get_frequency());
+        vga_puts("s, ");
+        vga_put_dec(count);
+        vga_puts(" processes, ");
+        vga_put_dec(cpu_count);
+        vga_puts(" CPUs, ");
+        put_percent(share_tenths(busy, interval * cpu_count), 4);
+        vga_puts("% busy (any key exits)\n");
+        print_process_header();
+        
+        // Highest share first; a printed entry is marked with ~0
+        u32 tsc_per_ms = get_tsc_per_ms();
+        for (u32 row = 0; row < VGA_HEIGHT - 3 && row < count; row++) {
+            u32 best = count;
+            for (u32 i = 0; i < count; i++) {
+                if (share[i] != 0xFFFFFFFF && (best == count || share[i] > share[best])) {
+                    best = i;
+                }
+            }
+            print_process(&cur[best], share[best], tsc_per_ms);
+            share[best] = 0xFFFFFFFF;
+        }
+        
+        kfree(share);
+        kfree(prev);
+        prev = cur;
+        prev_count = count;
+        prev_tsc = now;
+    }
+    tty_set_mode(TTY_COOKED);
+    kfree(prev);
+}
+
+static void cmd_sleep(char* args) {
+    u32 ms = 0;
+    for (int i = 0; args && args[i] >= '0' && args[i] <= '9'; i++) {
+        ms = ms * 10 + (args[i] - '0');
+    }
+    
+    u32 start = timer_get_ticks();
+    sleep_ms(ms);
+    vga_puts("Slept ");
+    vga_put_dec(timer_get_ticks() - start);
+    vga_puts(" ticks\n");
+}
+
+// Pick the console's output devices, then show them and the input and
+// serial counters
+static void cmd_console(char* args) {
+    if (strcmp(args, "vga") == 0) {
+        console_set_outputs(CONSOLE_VGA);
+    } else if (strcmp(args, "serial") == 0) {
+        console_set_outputs(CONSOLE_SERIAL);
+    } else if (strcmp(args, "both") == 0) {
+        console_set_outputs(CONSOLE_VGA | CONSOLE_SERIAL);
+    } else if (args[0]) {
+        vga_puts("Usage: console [vga|serial|both]\n");
+        return;
+    }
+    
+    u32 outputs = console_get_outputs();
+    vga_puts("Console output:");
+    vga_puts(outputs & CONSOLE_VGA ? " vga" : "");
+    vga_puts(outputs & CONSOLE_SERIAL ? " serial" : "");
+    vga_puts("\n");
+    
+    tty_stats_t tty;
+    tty_get_stats(&tty);
+    vga_puts("tty: ");
+    vga_put_dec(tty.keys);
+    vga_puts(" keys, ");
+    vga_put_dec(tty.lines);
+    vga_puts(" lines, ");
+    vga_put_dec(tty.wakeups);
+    vga_puts(" reader wakeups, ");
+    vga_put_dec(tty.dropped);
+    vga_puts(" keys lost\n");
+    if (!serial_present()) {
+        vga_puts("No serial port\n");
+        return;
+    }
+    
+    serial_stats_t stats;
+    serial_get_stats(&stats);
+    vga_puts("COM1: ");
+    vga_put_dec(stats.tx_bytes);
+    vga_puts(" bytes sent, ");
+    vga_put_dec(stats.rx_bytes);
+    vga_puts(" received, ");
+    vga_put_dec(stats.interrupts);
+    vga_puts(" interrupts, ");
+    vga_put_dec(stats.tx_full);
+    vga_puts(" waits on a full ring, ");
+    vga_put_dec(stats.rx_dropped + stats.overruns);
+    vga_puts(" bytes lost\n");
+}
+
+// Replay the kernel log, or with -n set the level printed to the console
+static void cmd_dmesg(char* args) {
+    if (args[0] == '-' && args[1] == 'n' && args[2] == ' ') {
+        u32 level = args[3] - '0';
+        if (level > KLOG_DEBUG) {
+            vga_puts("Levels: 0 error, 1 warning, 2 info, 3 debug\n");
+            return;
+        }
+        klog_set_console_level(level);
+        return;
+    }
+    klog_dump();
+}
+
 static void cmd_echo(char* args) {
     if (args) {
         vga_puts(args);
@@ -130,6 +521,40 @@ void shell_execute(const char* input) {
         cmd_delete(args);
     } else if (strcmp(cmd, "echo") == 0) {
         cmd_echo(args);
+    } else if (strcmp(cmd, "membench") == 0) {
+        memory_benchmark();
+    } else if (strcmp(cmd, "copybench") == 0) {
+        copy_benchmark();
+    } else if (strcmp(cmd, "vgabench") == 0) {
+        vga_benchmark();
+    } else if (strcmp(cmd, "slabinfo") == 0) {
+        kmem_cache_info();
+    } else if (strcmp(cmd, "spawn") == 0) {
+        cmd_spawn(args);
+    } else if (strcmp(cmd, "sched") == 0) {
+        scheduler_stats();
+    } else if (strcmp(cmd, "sleep") == 0) {
+        cmd_sleep(args);
+    } else if (strcmp(cmd, "ps") == 0) {
+        cmd_ps();
+    } else if (strcmp(cmd, "top") == 0) {
+        cmd_top();
+    } else if (strcmp(cmd, "ipcbench") == 0) {
+        ipc_benchmark();
+    } else if (strcmp(cmd, "shm") == 0) {
+        cmd_shm();
+    } else if (strcmp(cmd, "forkbench") == 0) {
+        fork_benchmark();
+    } else if (strcmp(cmd, "locks") == 0) {
+        lock_stats_dump();
+    } else if (strcmp(cmd, "cpus") == 0) {
+        smp_stats();
+    } else if (strcmp(cmd, "console") == 0) {
+        cmd_console(args);
+    } else if (strcmp(cmd, "dmesg") == 0) {
+        cmd_dmesg(args);
+    } else if (strcmp(cmd, "klogbench") == 0) {
+        klog_benchmark();
     } else if (strcmp(cmd, "exit") == 0) {
         vga_puts("Exit not implemented\n");
     } else if (cmd_len > 0) {
@@ -141,7 +566,6 @@ void shell_execute(const char* input) {
 
 void shell_run(void) {
     char input[SHELL_MAX_INPUT];
-    int input_pos = 0;
     
     vga_puts("Custom OS Shell v1.0\n");
     vga_puts("Type 'help' for available commands\n");
@@ -149,28 +573,10 @@ void shell_run(void) {
     while (1) {
         vga_puts("> ");
         
-        input_pos = 0;
-        memset(input, 0, SHELL_MAX_INPUT);
-        
-        // Read input
-        while (input_pos < SHELL_MAX_INPUT - 1) {
-            char c = keyboard_getchar();
-            
-            if (c == '\n') {
-                vga_putchar('\n');
-                break;
-            } else if (c == '\b') {
-                if (input_pos > 0) {
-                    input_pos--;
-                    input[input_pos] = '\0';
-                    vga_putchar('\b');
-                    vga_putchar(' ');
-                    vga_putchar('\b');
-                }
-            } else if (c >= 32 && c < 127) {
-                input[input_pos++] = c;
-                vga_putchar(c);
-            }
+        // The tty edits and echoes the line; sleep until Enter
+        int len = tty_read(input, SHELL_MAX_INPUT);
+        if (len > 0 && input[len - 1] == '\n') {
+            input[len - 1] = '\0';
         }
         
         shell_execute(input);
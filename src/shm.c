@@ -0,0 +1,268 @@
+#include "shm.h"
+#include "memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "vm.h"
+#include "kernel.h"
+#include "vga.h"
+
+// Shared memory regions
+//
+// A region owns one reference to each of its frames and every mapping of
+// it holds another, so frames are freed by whichever drops the last
+// reference: destroying the name or unmapping the last attachment. The
+// region itself is counted the same way, once for the name and once per
+// attachment. An attachment is a vm area whose release hook drops its
+// region reference, which is how exiting processes detach: tearing down
+// their address space frees every area. A forked child inherits the
+// attachment, with a reference of its own.
+//
+// Detaching can happen on the exit path with interrupts off, so the table
+// is guarded by a spinlock and allocation happens outside it.
+
+typedef struct {
+    char name[SHM_NAME_MAX];  // Empty once destroyed
+    int id;
+    u32 pages;
+    u32 refs;
+    u32 attached;
+    u32* frames;
+} shm_region_t;
+
+static shm_region_t* regions[SHM_MAX_REGIONS];
+static spinlock_t shm_lock = SPINLOCK_INIT("shm");
+
+static int find_region(const char* name) {
+    for (int i = 0; i < SHM_MAX_REGIONS; i++) {
+        if (regions[i] && regions[i]->name[0] && strcmp(regions[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void free_region(shm_region_t* region) {
+    for (u32 i = 0; i < region->pages; i++) {
+        if (region->frames[i]) {
+            pmm_frame_put(region->frames[i]);
+        }
+    }
+    kfree(region->frames);
+    kfree(region);
+}
+
+// Drop a reference with shm_lock held. Returns the region if it is now
+// unused, for the caller to free after unlocking.
+static shm_region_t* put_region(shm_region_t* region) {
+    if (--region->refs) {
+        return NULL;
+    }
+    regions[region->id] = NULL;
+    return region;
+}
+
+static shm_region_t* new_region(const char* name, u32 pages) {
+    shm_region_t* region = (shm_region_t*)kmalloc(sizeof(shm_region_t));
+    if (!region) {
+        return NULL;
+    }
+    region->frames = (u32*)kmalloc(pages * sizeof(u32));
+    if (!region->frames) {
+        kfree(region);
+        return NULL;
+    }
+    memset(region->frames, 0, pages * sizeof(u32));
+    strcpy(region->name, name);
+    region->pages = pages;
+    region->refs = 1;
+    region->attached = 0;
+    
+    for (u32 i = 0; i < pages; i++) {
+        u32 frame = pmm_alloc_frame();
+        if (!frame) {
+            free_region(region);
+            return NULL;
+        }
+        memset((void*)frame, 0, PAGE_SIZE);
+        region->frames[i] = frame;
+    }
+    return region;
+}
+
+// Create a zero-filled region of at least size bytes, or look up an
+// existing one of the same name that is large enough. Returns its id, or
+// -1.
+int shm_create(const char* name, u32 size) {
+    if (!name[0] || strlen(name) >= SHM_NAME_MAX || size == 0 || size > SHM_MAX_SIZE) {
+        return -1;
+    }
+    u32 pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    int id = find_region(name);
+    if (id != -1) {
+        if (regions[id]->pages < pages) {
+            id = -1;
+        }
+        spin_unlock_irqrestore(&shm_lock, flags);
+        return id;
+    }
+    spin_unlock_irqrestore(&shm_lock, flags);
+    
+    shm_region_t* region = new_region(name, pages);
+    if (!region) {
+        return -1;
+    }
+    
+    // Someone else may have created it meanwhile
+    flags = spin_lock_irqsave(&shm_lock);
+    id = find_region(name);
+    if (id != -1) {
+        if (regions[id]->pages < pages) {
+            id = -1;
+        }
+    } else {
+        for (int i = 0; i < SHM_MAX_REGIONS; i++) {
+            if (!regions[i]) {
+                region->id = i;
+                regions[i] = region;
+                id = i;
+                region = NULL;
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&shm_lock, flags);
+    
+    if (region) {
+        free_region(region);
+    }
+    return id;
+}
+
+// Remove the name. The memory stays until the last attachment goes.
+bool shm_destroy(int id) {
+    if (id < 0 || id >= SHM_MAX_REGIONS) {
+        return false;
+    }
+    
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    shm_region_t* region = regions[id];
+    if (!region || !region->name[0]) {
+        spin_unlock_irqrestore(&shm_lock, flags);
+        return false;
+    }
+    region->name[0] = '\0';
+    region = put_region(region);
+    spin_unlock_irqrestore(&shm_lock, flags);
+    
+    if (region) {
+        free_region(region);
+    }
+    return true;
+}
+
+// Release hook of an attachment, after its pages are unmapped
+static void shm_release(vm_area_t* area) {
+    shm_region_t* region = (shm_region_t*)area->data;
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    region->attached--;
+    region = put_region(region);
+    spin_unlock_irqrestore(&shm_lock, flags);
+    
+    if (region) {
+        free_region(region);
+    }
+}
+
+// A fork copied an attachment
+static void shm_dup(vm_area_t* area) {
+    shm_region_t* region = (shm_region_t*)area->data;
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    region->refs++;
+    region->attached++;
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+// Map a region into the current process. Returns its address, or NULL.
+void* shm_attach(int id) {
+    if (id < 0 || id >= SHM_MAX_REGIONS) {
+        return NULL;
+    }
+    
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    shm_region_t* region = regions[id];
+    if (!region || !region->name[0]) {
+        spin_unlock_irqrestore(&shm_lock, flags);
+        return NULL;
+    }
+    region->refs++;
+    region->attached++;
+    spin_unlock_irqrestore(&shm_lock, flags);
+    
+    address_space_t* as = as_current(true);
+    vm_area_t* area = as_alloc_area(as, region->pages * PAGE_SIZE, PAGE_WRITE);
+    if (!area) {
+        flags = spin_lock_irqsave(&shm_lock);
+        region->attached--;
+        region = put_region(region);
+        spin_unlock_irqrestore(&shm_lock, flags);
+        if (region) {
+            free_region(region);
+        }
+        return NULL;
+    }
+    
+    // From here on freeing the area undoes everything
+    area->data = region;
+    area->shared = true;
+    area->release = shm_release;
+    area->dup = shm_dup;
+    for (u32 i = 0; i < region->pages; i++) {
+        u32 frame = region->frames[i];
+        pmm_frame_get(frame);
+        if (!as_map_page(as, area, area->start + i * PAGE_SIZE, frame)) {
+            pmm_frame_put(frame);
+            as_free_area(as, area);
+            return NULL;
+        }
+    }
+    return (void*)area->start;
+}
+
+bool shm_detach(void* addr) {
+    address_space_t* as = as_current(false);
+    vm_area_t* area = as_find_area(as, (u32)addr);
+    if (!area || area->start != (u32)addr || area->release != shm_release) {
+        return false;
+    }
+    as_free_area(as, area);
+    return true;
+}
+
+void shm_stats(void) {
+    vga_puts("Shared memory regions:\n");
+    u32 flags = spin_lock_irqsave(&shm_lock);
+    u32 count = 0;
+    for (int i = 0; i < SHM_MAX_REGIONS; i++) {
+        shm_region_t* region = regions[i];
+        if (!region) {
+            continue;
+        }
+        vga_puts("  ");
+        vga_put_dec(i);
+        vga_puts(": ");
+        vga_puts(region->name[0] ? region->name : "(destroyed)");
+        vga_puts(", ");
+        vga_put_dec(region->pages * PAGE_SIZE / 1024);
+        vga_puts(" KB, ");
+        vga_put_dec(region->attached);
+        vga_puts(" attached\n");
+        count++;
+    }
+    spin_unlock_irqrestore(&shm_lock, flags);
+    if (!count) {
+        vga_puts("  (none)\n");
+    }
+}
@@ -0,0 +1,261 @@
+#include "slab.h"
+#include "memory.h"
+#include "kernel.h"
+#include "vga.h"
+
+// Slab allocator
+//
+// Each cache hands out objects of one size from slabs, which are raw buddy
+// blocks with a small slab_t header at the start. Slabs are aligned to
+// their own size inside the pool, so the owning slab of an object is found
+// by masking its address and objects need no header of their own. Free
+// objects are chained through a pointer stored inside the free object:
+// at offset 0 normally, or just past the object when the cache has a
+// constructor, so constructed state survives a free/alloc cycle. Each
+// cache has its own lock, held with interrupts disabled.
+
+#define SLAB_MIN_ORDER 8  // 4KB slabs at minimum
+
+struct slab {
+    struct slab* next;
+    struct slab* prev;
+    kmem_cache_t* cache;
+    void* free_objects;
+    u32 in_use;
+};
+
+static kmem_cache_t* cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT("slab list");
+
+static inline void** free_link(kmem_cache_t* cache, void* obj) {
+    return (void**)((u8*)obj + cache->free_offset);
+}
+
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static slab_t* slab_create(kmem_cache_t* cache) {
+    slab_t* slab = (slab_t*)buddy_alloc(cache->slab_order);
+    if (!slab) {
+        return NULL;
+    }
+    
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+    
+    // Thread the free list so objects are handed out in address order
+    u8* first = (u8*)slab + cache->first_offset;
+    for (int i = cache->objects_per_slab - 1; i >= 0; i--) {
+        void* obj = first + i * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *free_link(cache, obj) = slab->free_objects;
+        slab->free_objects = obj;
+    }
+    
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, slab_t* slab) {
+    buddy_free(slab, cache->slab_order);
+    cache->slab_count--;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align,
+                                void (*ctor)(void*)) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+    if (align & (align - 1)) {
+        return NULL;  // Alignment must be a power of two
+    }
+    
+    kmem_cache_t* cache = (kmem_cache_t*)kmalloc(sizeof(kmem_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(kmem_cache_t));
+    
+    int i = 0;
+    while (name && name[i] && i < SLAB_NAME_LEN - 1) {
+        cache->name[i] = name[i];
+        i++;
+    }
+    cache->name[i] = '\0';
+    
+    cache->object_size = size;
+    cache->ctor = ctor;
+    if (ctor) {
+        cache->free_offset = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        cache->stride = cache->free_offset + sizeof(void*);
+    } else {
+        cache->free_offset = 0;
+        cache->stride = size < sizeof(void*) ? sizeof(void*) : size;
+    }
+    cache->stride = (cache->stride + align - 1) & ~(align - 1);
+    cache->first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    
+    // Smallest slab holding SLAB_MIN_OBJECTS, or at least one object
+    u32 order = SLAB_MIN_ORDER;
+    while (order < BUDDY_MAX_ORDER &&
+           ((u32)BUDDY_MIN_SIZE << order) < cache->first_offset + SLAB_MIN_OBJECTS * cache->stride) {
+        order++;
+    }
+    u32 slab_size = (u32)BUDDY_MIN_SIZE << order;
+    if (slab_size < cache->first_offset + cache->stride) {
+        kfree(cache);
+        return NULL;
+    }
+    cache->slab_order = order;
+    cache->objects_per_slab = (slab_size - cache->first_offset) / cache->stride;
+    
+    spin_lock_init(&cache->lock, "slab cache");
+    
+    u32 flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    
+    return cache;
+}
+
+void kmem_cache_destroy(kmem_cache_t* cache) {
+    if (!cache) return;
+    
+    while (cache->partial) {
+        slab_t* slab = cache->partial;
+        slab_list_remove(&cache->partial, slab);
+        slab_destroy(cache, slab);
+    }
+    while (cache->full) {
+        slab_t* slab = cache->full;
+        slab_list_remove(&cache->full, slab);
+        slab_destroy(cache, slab);
+    }
+    if (cache->empty) {
+        slab_destroy(cache, cache->empty);
+        cache->empty = NULL;
+    }
+    
+    u32 flags = spin_lock_irqsave(&cache_list_lock);
+    kmem_cache_t** link = &cache_list;
+    while (*link && *link != cache) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = cache->next;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    
+    kfree(cache);
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+    
+    u32 flags = spin_lock_irqsave(&cache->lock);
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    void* obj = slab->free_objects;
+    slab->free_objects = *free_link(cache, obj);
+    slab->in_use++;
+    cache->active_objects++;
+    
+    if (!slab->free_objects) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!cache || !obj) return;
+    
+    slab_t* slab = (slab_t*)buddy_block_base(obj, cache->slab_order);
+    if (slab->cache != cache) {
+        return;  // Not one of ours
+    }
+    
+    u32 flags = spin_lock_irqsave(&cache->lock);
+    bool was_full = slab->free_objects == NULL;
+    *free_link(cache, obj) = slab->free_objects;
+    slab->free_objects = obj;
+    slab->in_use--;
+    cache->active_objects--;
+    
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+    
+    // Keep one empty slab around to absorb alloc/free ping-pong
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            slab_destroy(cache, slab);
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void kmem_cache_info(void) {
+    for (kmem_cache_t* cache = cache_list; cache; cache = cache->next) {
+        vga_puts(cache->name);
+        vga_puts(": ");
+        vga_put_dec(cache->object_size);
+        vga_puts(" B objects, ");
+        vga_put_dec(cache->active_objects);
+        vga_puts("/");
+        vga_put_dec(cache->slab_count * cache->objects_per_slab);
+        vga_puts(" in use, ");
+        vga_put_dec(cache->slab_count);
+        vga_puts(" slabs of ");
+        vga_put_dec(BUDDY_MIN_SIZE << cache->slab_order);
+        vga_puts(" B\n");
+    }
+}
@@ -0,0 +1,160 @@
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "idt.h"
+#include "pmm.h"
+#include "fpu.h"
+#include "timer.h"
+#include "kernel.h"
+#include "vga.h"
+#include "klog.h"
+
+// Multiprocessor bring-up
+//
+// The BSP reads the processor list from the ACPI MADT, copies the real-mode
+// trampoline to low memory and starts each AP with the INIT-SIPI-SIPI
+// sequence. Every AP gets its own GDT/TSS, a 16KB stack that becomes its
+// idle task, and an APIC timer driving its scheduler tick.
+
+#define AP_START_TIMEOUT_MS 100
+
+typedef struct {
+    u32 cr3;
+    u32 cr4;
+    u32 stack;
+    u32 cpu;
+} __attribute__((packed)) trampoline_params_t;
+
+extern u8 trampoline_start[];
+extern u8 trampoline_end[];
+extern u8 trampoline_params[];
+
+cpu_t cpus[MAX_CPUS];
+volatile u32 cpu_count = 1;
+
+static void apic_timer_handler(registers_t* regs) {
+    (void)regs;
+    scheduler_tick(1);
+}
+
+// Nothing to do: the sender already set need_resched, and the switch
+// happens on the way out of the interrupt
+static void resched_handler(registers_t* regs) {
+    (void)regs;
+}
+
+static void delay_ms(u32 ms) {
+    u32 start = timer_get_ticks();
+    u32 ticks = timer_ms_to_ticks(ms) + 1;
+    while (timer_get_ticks() - start < ticks) {
+        asm volatile("pause");
+    }
+}
+
+// First C code run by an AP, on its own stack with paging enabled
+void ap_main(cpu_t* cpu) {
+    gdt_init_cpu(cpu);
+    gdt_init_double_fault(cpu);
+    idt_load();
+    fpu_init_cpu();
+    
+    lapic_enable();
+    lapic_timer_start(timer_get_frequency());
+    
+    scheduler_start_ap();
+    cpu->online = true;
+    cpu_idle();
+}
+
+static bool start_ap(cpu_t* cpu) {
+    trampoline_params_t* params = (trampoline_params_t*)(TRAMPOLINE_BASE + (trampoline_params - trampoline_start));
+    asm volatile("mov %%cr3, %0" : "=r"(params->cr3));
+    asm volatile("mov %%cr4, %0" : "=r"(params->cr4));
+    params->stack = cpu->stack_top;
+    params->cpu = (u32)cpu;
+    
+    lapic_send_init(cpu->apic_id);
+    delay_ms(10);
+    
+    // The second SIPI is only needed if the first one was missed
+    for (int attempt = 0; attempt < 2 && !cpu->online; attempt++) {
+        lapic_send_startup(cpu->apic_id, TRAMPOLINE_BASE >> 12);
+        u32 start = timer_get_ticks();
+        while (!cpu->online && timer_get_ticks() - start <= timer_ms_to_ticks(AP_START_TIMEOUT_MS)) {
+            asm volatile("pause");
+        }
+    }
+    return cpu->online;
+}
+
+void smp_init(void) {
+    u32 apic_ids[MAX_CPUS];
+    u32 lapic_base = LAPIC_DEFAULT_BASE;
+    
+    cpus[0].online = true;
+    
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    u32 found = acpi_find_cpus(apic_ids, MAX_CPUS, &lapic_base);
+    if (!(edx & (1 << 9)) || found < 2) {
+        return;  // No APIC or a single CPU
+    }
+    
+    if (!lapic_init(lapic_base)) {
+        return;
+    }
+    cpus[0].apic_id = lapic_id();
+    
+    register_interrupt_handler(APIC_TIMER_VECTOR, apic_timer_handler);
+    register_interrupt_handler(APIC_RESCHED_VECTOR, resched_handler);
+    
+    memcpy((void*)TRAMPOLINE_BASE, trampoline_start, trampoline_end - trampoline_start);
+    
+    for (u32 i = 0; i < found && cpu_count < MAX_CPUS; i++) {
+        if (apic_ids[i] == cpus[0].apic_id) {
+            continue;
+        }
+        
+        cpu_t* cpu = &cpus[cpu_count];
+        u32 stack = pmm_alloc_frames(AP_STACK_SIZE / PAGE_SIZE);
+        if (!stack) {
+            break;
+        }
+        cpu->index = cpu_count;
+        cpu->apic_id = apic_ids[i];
+        cpu->stack_top = stack + AP_STACK_SIZE;
+        
+        if (start_ap(cpu)) {
+            cpu_count++;
+        } else {
+            pmm_free_frames(stack, AP_STACK_SIZE / PAGE_SIZE);
+            klog(KLOG_WARN, "CPU with APIC ID %u did not start", apic_ids[i]);
+        }
+    }
+}
+
+// Make another CPU run its scheduler now
+void smp_send_resched(u32 cpu) {
+    if (cpu < cpu_count && cpu != this_cpu()->index) {
+        lapic_send_ipi(cpus[cpu].apic_id, APIC_RESCHED_VECTOR);
+    }
+}
+
+void smp_stats(void) {
+    for (u32 i = 0; i < cpu_count; i++) {
+        sched_cpu_t* rq = &cpus[i].sched;
+        vga_puts("  CPU ");
+        vga_put_dec(i);
+        vga_puts(" (APIC ");
+        vga_put_dec(cpus[i].apic_id);
+        vga_puts("): running pid ");
+        vga_put_dec(rq->current ? rq->current->pid : 0);
+        vga_puts(", ");
+        vga_put_dec(rq->nr_ready);
+        vga_puts(" ready, idle ");
+        vga_put_dec(rq->idle_ticks);
+        vga_puts(" ticks, stole ");
+        vga_put_dec(rq->steals);
+        vga_puts("\n");
+    }
+}
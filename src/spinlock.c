@@ -0,0 +1,97 @@
+#include "spinlock.h"
+#include "kernel.h"
+#include "vga.h"
+
+// Lock contention statistics
+//
+// Locks are grouped into classes by name, so all run queue locks, say,
+// add up to one line, and a lock embedded in a freed object leaves
+// nothing dangling. A lock finds its class on first acquisition. Counters
+// are updated by whichever lock of the class is held, without further
+// locking, so they are approximate when several locks of one class are
+// busy at once.
+
+#if LOCK_STATS
+
+static lock_class_t classes[LOCK_CLASS_MAX];
+static u32 class_count = 0;
+static volatile u32 class_lock = 0;  // Can't be a spinlock_t: it would recurse
+static lock_class_t overflow_class = { "(other)", 0, 0, 0, 0 };
+
+static lock_class_t* find_class(const char* name) {
+    if (!name) {
+        name = "(unnamed)";
+    }
+    
+    while (__sync_lock_test_and_set(&class_lock, 1)) {
+        asm volatile("pause");
+    }
+    lock_class_t* class = &overflow_class;
+    for (u32 i = 0; i < class_count; i++) {
+        if (strcmp(classes[i].name, name) == 0) {
+            class = &classes[i];
+            break;
+        }
+    }
+    if (class == &overflow_class && class_count < LOCK_CLASS_MAX) {
+        class = &classes[class_count++];
+        memset(class, 0, sizeof(lock_class_t));
+        class->name = name;
+    }
+    __sync_lock_release(&class_lock);
+    return class;
+}
+
+void lock_stat_acquired(spinlock_t* lock, u64 start, bool contended) {
+    u64 now = rdtsc();
+    if (!lock->class) {
+        lock->class = find_class(lock->name);
+    }
+    
+    lock_class_t* class = lock->class;
+    class->acquisitions++;
+    if (contended) {
+        class->contended++;
+        class->spin_cycles += now - start;
+    }
+    lock->acquired_at = now;
+}
+
+void lock_stat_released(spinlock_t* lock) {
+    u64 held = rdtsc() - lock->acquired_at;
+    if (lock->class && held > lock->class->max_hold_cycles) {
+        lock->class->max_hold_cycles = held;
+    }
+}
+
+static void print_class(const lock_class_t* class) {
+    vga_puts("  ");
+    vga_puts(class->name);
+    vga_puts(": ");
+    vga_put_dec(class->acquisitions);
+    vga_puts(" acquired, ");
+    vga_put_dec(class->contended);
+    vga_puts(" contended, ");
+    vga_put_dec(class->contended ? div_u64_u32(class->spin_cycles, class->contended) : 0);
+    vga_puts(" cycles avg spin, ");
+    vga_put_dec(div_u64_u32(class->max_hold_cycles, 1));
+    vga_puts(" max hold\n");
+}
+
+void lock_stats_dump(void) {
+    vga_puts("Lock statistics (TSC cycles):\n");
+    for (u32 i = 0; i < class_count; i++) {
+        print_class(&classes[i]);
+    }
+    if (overflow_class.acquisitions) {
+        print_class(&overflow_class);
+    }
+}
+
+#else
+
+void lock_stats_dump(void) {
+    vga_puts("Lock statistics disabled (build with LOCK_STATS=1)\n");
+}
+
+#endif
@@ -0,0 +1,44 @@
+; Context switch
+global switch_context
+global save_context
+
+; void switch_context(u32* old_esp, u32 new_esp)
+; Saves the callee-saved registers on the current stack, stores the stack
+; pointer through old_esp, then resumes the context saved at new_esp.
+switch_context:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; u32 save_context(u32* frame)
+; Records the registers switch_context() would push, followed by a resume
+; address and this call's return address, in frame[0..5], and the stack
+; pointer this call returns with in frame[6]. A copy of the stack with
+; frame[0..5] stored below that pointer can be resumed by switch_context(),
+; and returns 1 from this call; the call itself returns 0.
+save_context:
+    mov eax, [esp + 4]
+    mov [eax], edi
+    mov [eax + 4], esi
+    mov [eax + 8], ebx
+    mov [eax + 12], ebp
+    mov dword [eax + 16], .resumed
+    mov edx, [esp]
+    mov [eax + 20], edx
+    lea edx, [esp + 4]
+    mov [eax + 24], edx
+    xor eax, eax
+    ret
+.resumed:
+    mov eax, 1
+    ret
@@ -0,0 +1,319 @@
+#include "timer.h"
+#include "idt.h"
+#include "kernel.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "vga.h"
+
+// PIT timer and timer wheel
+//
+// Timers hang off doubly linked slot lists, so adding and cancelling are
+// O(1). Timers due within 256 ticks sit in the root wheel, indexed by their
+// expiry tick; later ones sit in an outer wheel and are cascaded one level
+// down each time the wheel below wraps, which makes expiry amortized O(1).
+// Each wheel keeps a bitmap of non-empty slots so the idle path can find
+// the next expiry and program the PIT for it instead of ticking.
+
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+#define PIT_MODE_ONESHOT  0x30  // Channel 0, lobyte/hibyte, mode 0
+#define PIT_MODE_PERIODIC 0x34  // Channel 0, lobyte/hibyte, mode 2
+#define PIT_LATCH         0x00
+#define PIT_MAX_COUNT     0xFFFF
+
+static volatile u32 ticks = 0;
+static u32 frequency = TIMER_HZ;
+static u32 divisor = PIT_FREQUENCY / TIMER_HZ;
+static u32 oneshot_ticks = 0;  // Non-zero while the PIT is in one-shot mode
+static u32 idle_remainder = 0; // PIT counts short of a tick from early wakeups
+static u64 boot_tsc = 0;       // TSC when the PIT started counting
+
+static ktimer_t* root_wheel[TIMER_ROOT_SIZE];
+static ktimer_t* outer_wheels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static u32 root_bitmap[TIMER_ROOT_SIZE / 32];
+static u32 outer_bitmaps[TIMER_LEVELS][TIMER_LEVEL_SIZE / 32];
+static u32 wheel_time = 0;  // Next tick the wheel will process
+static spinlock_t timer_lock = SPINLOCK_INIT("timer");  // The wheels; not held in callbacks
+
+static void pit_program(u8 mode, u32 count) {
+    outb(PIT_COMMAND, mode);
+    outb(PIT_CHANNEL0, count & 0xFF);
+    outb(PIT_CHANNEL0, (count >> 8) & 0xFF);
+}
+
+static void wheel_link(ktimer_t* timer, ktimer_t** slot, u32* bitmap, u32 level, u32 index) {
+    timer->slot = slot;
+    timer->level = level;
+    timer->index = index;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    bitmap[index >> 5] |= 1u << (index & 31);
+}
+
+static void wheel_unlink(ktimer_t* timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    
+    if (!*timer->slot) {
+        u32* bitmap = timer->level == 0 ? root_bitmap : outer_bitmaps[timer->level - 1];
+        bitmap[timer->index >> 5] &= ~(1u << (timer->index & 31));
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = NULL;
+}
+
+static void wheel_insert(ktimer_t* timer) {
+    u32 expires = timer->expires;
+    u32 delta = expires - wheel_time;
+    
+    if ((i32)delta < 0) {
+        // Already due: run on the next tick processed
+        u32 index = wheel_time & (TIMER_ROOT_SIZE - 1);
+        wheel_link(timer, &root_wheel[index], root_bitmap, 0, index);
+    } else if (delta < TIMER_ROOT_SIZE) {
+        u32 index = expires & (TIMER_ROOT_SIZE - 1);
+        wheel_link(timer, &root_wheel[index], root_bitmap, 0, index);
+    } else {
+        u32 level = 0;
+        while (level < TIMER_LEVELS - 1 &&
+               delta >= (1u << (TIMER_ROOT_BITS + (level + 1) * TIMER_LEVEL_BITS))) {
+            level++;
+        }
+        u32 index = (expires >> (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1);
+        wheel_link(timer, &outer_wheels[level][index], outer_bitmaps[level], level + 1, index);
+    }
+}
+
+// Move every timer in one outer slot down; returns the slot index so the
+// caller knows whether this wheel wrapped too
+static u32 cascade(u32 level, u32 index) {
+    while (outer_wheels[level][index]) {
+        ktimer_t* timer = outer_wheels[level][index];
+        wheel_unlink(timer);
+        wheel_insert(timer);
+    }
+    return index;
+}
+
+// BSP only, from the PIT interrupt
+static void run_timers(void) {
+    spin_lock(&timer_lock);
+    while ((i32)(ticks - wheel_time) >= 0) {
+        u32 index = wheel_time & (TIMER_ROOT_SIZE - 1);
+        
+        if (index == 0) {
+            for (u32 level = 0; level < TIMER_LEVELS; level++) {
+                u32 shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+                if (cascade(level, (wheel_time >> shift) & (TIMER_LEVEL_SIZE - 1)) != 0) {
+                    break;
+                }
+            }
+        }
+        
+        // Timers re-added from a callback land in a later slot
+        wheel_time++;
+        while (root_wheel[index]) {
+            ktimer_t* timer = root_wheel[index];
+            void (*callback)(void*) = timer->callback;
+            void* data = timer->data;
+            
+            // Once pending is clear the owner may reuse the timer
+            wheel_unlink(timer);
+            timer->pending = false;
+            spin_unlock(&timer_lock);
+            callback(data);
+            spin_lock(&timer_lock);
+        }
+    }
+    spin_unlock(&timer_lock);
+}
+
+// Ticks from wheel_time to the earliest slot that may hold a due timer:
+// exact for the root wheel, otherwise the next cascade. 0xFFFFFFFF if no
+// timer is pending.
+static u32 next_expiry_delta(void) {
+    u32 start = wheel_time & (TIMER_ROOT_SIZE - 1);
+    u32 delta = 0xFFFFFFFF;
+    
+    // Circular scan of the root bitmap starting at the current slot
+    for (u32 n = 0; n <= TIMER_ROOT_SIZE / 32; n++) {
+        u32 word = ((start >> 5) + n) & (TIMER_ROOT_SIZE / 32 - 1);
+        u32 bits = root_bitmap[word];
+        if (n == 0) {
+            bits &= ~0u << (start & 31);
+        } else if (n == TIMER_ROOT_SIZE / 32) {
+            bits &= (1u << (start & 31)) - 1;
+        }
+        if (bits) {
+            u32 slot = word * 32 + bit_scan_forward(bits);
+            delta = (slot - start) & (TIMER_ROOT_SIZE - 1);
+            break;
+        }
+    }
+    
+    for (u32 level = 0; level < TIMER_LEVELS; level++) {
+        if (outer_bitmaps[level][0] | outer_bitmaps[level][1]) {
+            u32 until_cascade = TIMER_ROOT_SIZE - start;
+            if (until_cascade < delta) {
+                delta = until_cascade;
+            }
+            break;
+        }
+    }
+    
+    return delta;
+}
+
+static void timer_handler(registers_t* regs) {
+    (void)regs;
+    u32 elapsed = 1;
+    
+    // A one-shot period covers several ticks; go back to periodic mode
+    if (oneshot_ticks) {
+        elapsed = oneshot_ticks;
+        oneshot_ticks = 0;
+        pit_program(PIT_MODE_PERIODIC, divisor);
+    }
+    ticks += elapsed;
+    
+    run_timers();
+    vga_tick();
+    scheduler_tick(elapsed);
+}
+
+void timer_init(u32 hz) {
+    if (hz < TIMER_MIN_HZ) {
+        hz = TIMER_MIN_HZ;
+    }
+    if (hz > TIMER_MAX_HZ) {
+        hz = TIMER_MAX_HZ;
+    }
+    frequency = hz;
+    divisor = PIT_FREQUENCY / hz;
+    
+    memset(root_wheel, 0, sizeof(root_wheel));
+    memset(outer_wheels, 0, sizeof(outer_wheels));
+    memset(root_bitmap, 0, sizeof(root_bitmap));
+    memset(outer_bitmaps, 0, sizeof(outer_bitmaps));
+    wheel_time = ticks;
+    
+    register_interrupt_handler(IRQ0, timer_handler);
+    boot_tsc = rdtsc();
+    pit_program(PIT_MODE_PERIODIC, divisor);
+}
+
+u32 timer_get_ticks(void) {
+    return ticks;
+}
+
+u32 timer_get_frequency(void) {
+    return frequency;
+}
+
+// TSC rate measured against the PIT over the whole uptime, so it gets more
+// precise the longer the system runs. 0 until the first tick.
+u32 timer_tsc_per_ms(void) {
+    u32 ms = div_u64_u32((u64)ticks * 1000, frequency);
+    if (ms == 0) {
+        return 0;
+    }
+    return div_u64_u32(rdtsc() - boot_tsc, ms);
+}
+
+// Rounds up so a non-zero delay never becomes zero ticks
+u32 timer_ms_to_ticks(u32 ms) {
+    return (ms * frequency + 999) / 1000;
+}
+
+void timer_setup(ktimer_t* timer, void (*callback)(void*), void* data) {
+    memset(timer, 0, sizeof(ktimer_t));
+    timer->callback = callback;
+    timer->data = data;
+}
+
+// Arm (or re-arm) a timer to fire at an absolute tick
+void timer_add(ktimer_t* timer, u32 expires) {
+    u32 flags = spin_lock_irqsave(&timer_lock);
+    if (timer->pending) {
+        wheel_unlink(timer);
+    }
+    timer->expires = expires;
+    timer->pending = true;
+    wheel_insert(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_cancel(ktimer_t* timer) {
+    u32 flags = spin_lock_irqsave(&timer_lock);
+    if (timer->pending) {
+        wheel_unlink(timer);
+        timer->pending = false;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+// Called by the BSP's idle process with interrupts disabled: instead of taking
+// every tick, program the PIT to fire once at the next timer expiry (as far
+// as its 16-bit counter reaches)
+void timer_idle_enter(void) {
+    if (oneshot_ticks) {
+        return;
+    }
+    
+    spin_lock(&timer_lock);
+    u32 delta = next_expiry_delta();
+    u32 pending = wheel_time - ticks;
+    spin_unlock(&timer_lock);  // Ticks before wheel_time is due
+    if (delta != 0xFFFFFFFF) {
+        delta += pending;
+    }
+    
+    u32 max_ticks = PIT_MAX_COUNT / divisor;
+    if (delta > max_ticks) {
+        delta = max_ticks;
+    }
+    if (delta < 2) {
+        return;  // Next event is at the next tick anyway
+    }
+    
+    oneshot_ticks = delta;
+    pit_program(PIT_MODE_ONESHOT, delta * divisor);
+}
+
+// Woken early by another interrupt: account for the time that did pass
+// and return to periodic ticks. Interrupts must be disabled.
+void timer_idle_exit(void) {
+    if (!oneshot_ticks) {
+        return;
+    }
+    
+    u32 count = oneshot_ticks * divisor;
+    outb(PIT_COMMAND, PIT_LATCH);
+    u32 remaining = inb(PIT_CHANNEL0);
+    remaining |= inb(PIT_CHANNEL0) << 8;
+    
+    // Past terminal count the counter wraps and the expiry IRQ is pending.
+    // timer_handler() counts one tick for it, so leave that one out.
+    if (remaining > count) {
+        ticks += oneshot_ticks - 1;
+    } else {
+        // Keep the part of a tick that passed, or early wakeups would
+        // make the clock fall behind
+        u32 elapsed = count - remaining + idle_remainder;
+        ticks += elapsed / divisor;
+        idle_remainder = elapsed % divisor;
+    }
+    oneshot_ticks = 0;
+    pit_program(PIT_MODE_PERIODIC, divisor);
+}
@@ -0,0 +1,75 @@
+; AP startup trampoline
+;
+; Copied to TRAMPOLINE_BASE (0x8000) and entered in real mode by the
+; startup IPI. Switches to protected mode with a temporary GDT, turns on
+; paging with the kernel's page directory and calls ap_main(cpu) on the
+; stack the BSP prepared. The parameter block at the end is filled in by
+; smp_init() before each AP is started.
+
+global trampoline_start
+global trampoline_end
+global trampoline_params
+extern ap_main
+
+TRAMPOLINE_BASE equ 0x8000
+%define REL(x) (TRAMPOLINE_BASE + (x) - trampoline_start)
+
+section .text
+[BITS 16]
+trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [REL(tramp_gdt_ptr)]
+    
+    mov eax, cr0
+    or eax, 1            ; PE
+    mov cr0, eax
+    jmp dword 0x08:REL(tramp_protected)
+
+[BITS 32]
+tramp_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    
+    ; Same paging setup as the BSP
+    mov eax, [REL(tramp_cr4)]
+    mov cr4, eax
+    mov eax, [REL(tramp_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000   ; PG | WP
+    mov cr0, eax
+    
+    mov esp, [REL(tramp_stack)]
+    push dword [REL(tramp_cpu)]
+    mov eax, ap_main
+    call eax
+    
+    ; ap_main never returns
+    cli
+.hang:
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0x0000000000000000  ; Null
+    dq 0x00CF9A000000FFFF  ; Code
+    dq 0x00CF92000000FFFF  ; Data
+tramp_gdt_ptr:
+    dw tramp_gdt_ptr - tramp_gdt - 1
+    dd REL(tramp_gdt)
+
+align 4
+trampoline_params:
+tramp_cr3:   dd 0
+tramp_cr4:   dd 0
+tramp_stack: dd 0
+tramp_cpu:   dd 0
+trampoline_end:
@@ -0,0 +1,249 @@
+#include "tty.h"
+#include "kernel.h"
+#include "idt.h"
+#include "console.h"
+#include "scheduler.h"
+#include "spinlock.h"
+
+// Console tty: the line discipline between the input drivers and readers
+//
+// The keyboard and serial interrupt handlers only queue decoded keys into
+// the input ring and raise BH_TTY. The bottom half runs the keys through
+// the line discipline once the handlers are done: in cooked mode it edits
+// and echoes the line being typed and moves it to the read queue when
+// Enter completes it, waking readers once per line; in raw mode keys go
+// straight to the read queue. Readers sleep on tty_wait until there is
+// something for them, so an idle shell costs no CPU.
+
+static char input_ring[TTY_INPUT_SIZE];
+static u32 input_head = 0;
+static u32 input_tail = 0;
+static spinlock_t tty_lock = SPINLOCK_INIT("tty");  // Input ring, line, mode, stats
+
+static char line[TTY_LINE_MAX];
+static u32 line_len = 0;
+static tty_mode_t mode = TTY_COOKED;
+
+static char read_queue[TTY_READ_SIZE];
+static u32 read_head = 0;
+static u32 read_tail = 0;
+static u32 lines_ready = 0;  // Newlines in the read queue
+static wait_queue_t tty_wait;  // Its lock also guards the read queue
+
+static tty_stats_t stats;
+static bool initialized = false;
+
+static u32 read_queued(void) {
+    return (read_tail - read_head + TTY_READ_SIZE) % TTY_READ_SIZE;
+}
+
+// Called with tty_wait.lock held
+static bool readable(void) {
+    if (mode == TTY_RAW) {
+        return read_head != read_tail;
+    }
+    return lines_ready > 0;
+}
+
+// Called with both locks held; all or nothing, so a line is never split
+static bool queue_chars(const char* buf, u32 len) {
+    if (read_queued() + len >= TTY_READ_SIZE) {
+        stats.dropped += len;
+        return false;
+    }
+    for (u32 i = 0; i < len; i++) {
+        read_queue[read_tail] = buf[i];
+        read_tail = (read_tail + 1) % TTY_READ_SIZE;
+    }
+    return true;
+}
+
+static void echo(const char* buf, size_t len) {
+    console_write(buf, len);
+}
+
+static void erase_char(void) {
+    if (line_len > 0) {
+        line_len--;
+        echo("\b \b", 3);
+    }
+}
+
+static void erase_word(void) {
+    while (line_len > 0 && line[line_len - 1] == ' ') {
+        erase_char();
+    }
+    while (line_len > 0 && line[line_len - 1] != ' ') {
+        erase_char();
+    }
+}
+
+// Hand the line, newline included, to readers
+static void finish_line(void) {
+    line[line_len++] = '\n';
+    echo("\n", 1);
+    
+    spin_lock(&tty_wait.lock);
+    if (queue_chars(line, line_len)) {
+        lines_ready++;
+        stats.lines++;
+        if (wake_up_locked(&tty_wait)) {
+            stats.wakeups++;
+        }
+    }
+    spin_unlock(&tty_wait.lock);
+    line_len = 0;
+}
+
+// Called with tty_lock held. One byte is kept free for the newline.
+static void cooked_input(char c) {
+    switch (c) {
+        case '\r':
+        case '\n':
+            finish_line();
+            break;
+        case '\b':
+        case TTY_DEL:
+            erase_char();
+            break;
+        case TTY_KILL:
+            while (line_len > 0) {
+                erase_char();
+            }
+            break;
+        case TTY_WERASE:
+            erase_word();
+            break;
+        case TTY_INTR:
+            // Nothing to signal, but the reader gets an empty line so a
+            // prompt comes back
+            echo("^C", 2);
+            line_len = 0;
+            finish_line();
+            break;
+        default:
+            if ((c >= 32 && c < 127) && line_len < TTY_LINE_MAX - 1) {
+                line[line_len++] = c;
+                echo(&c, 1);
+            }
+            break;
+    }
+}
+
+static void tty_bottom_half(void) {
+    u32 flags = spin_lock_irqsave(&tty_lock);
+    bool raw_queued = false;
+    while (input_head != input_tail) {
+        char c = input_ring[input_head];
+        input_head = (input_head + 1) % TTY_INPUT_SIZE;
+        if (mode == TTY_COOKED) {
+            cooked_input(c);
+            continue;
+        }
+        spin_lock(&tty_wait.lock);
+        raw_queued |= queue_chars(&c, 1);
+        spin_unlock(&tty_wait.lock);
+    }
+    
+    // Raw readers take whatever has arrived, so one wakeup per pass
+    if (raw_queued) {
+        spin_lock(&tty_wait.lock);
+        if (wake_up_locked(&tty_wait)) {
+            stats.wakeups++;
+        }
+        spin_unlock(&tty_wait.lock);
+    }
+    spin_unlock_irqrestore(&tty_lock, flags);
+}
+
+void tty_init(void) {
+    if (initialized) return;
+    
+    wait_queue_init(&tty_wait);
+    memset(&stats, 0, sizeof(stats));
+    register_bottom_half(BH_TTY, tty_bottom_half);
+    initialized = true;
+}
+
+// Top half: called by the input drivers' interrupt handlers with a
+// decoded key
+void tty_input(char c) {
+    u32 flags = spin_lock_irqsave(&tty_lock);
+    u32 next = (input_tail + 1) % TTY_INPUT_SIZE;
+    if (next != input_head) {
+        input_ring[input_tail] = c;
+        input_tail = next;
+        stats.keys++;
+    } else {
+        stats.dropped++;
+    }
+    spin_unlock_irqrestore(&tty_lock, flags);
+    raise_bottom_half(BH_TTY);
+}
+
+// Blocks until a line (cooked) or any key (raw) is ready, then copies it
+// into buf, NUL-terminated. A cooked line keeps its newline; one longer
+// than buf is returned over several reads. Returns the bytes copied.
+int tty_read(char* buf, size_t size) {
+    if (!buf || size < 2) {
+        return -1;
+    }
+    
+    u32 flags = spin_lock_irqsave(&tty_wait.lock);
+    while (!readable()) {
+        sleep_on(&tty_wait);
+    }
+    
+    size_t n = 0;
+    while (n < size - 1 && read_head != read_tail) {
+        char c = read_queue[read_head];
+        read_head = (read_head + 1) % TTY_READ_SIZE;
+        buf[n++] = c;
+        if (c == '\n' && mode == TTY_COOKED) {
+            lines_ready--;
+            break;
+        }
+    }
+    buf[n] = '\0';
+    spin_unlock_irqrestore(&tty_wait.lock, flags);
+    return (int)n;
+}
+
+// True if tty_read wouldn't block
+bool tty_has_input(void) {
+    u32 flags = spin_lock_irqsave(&tty_wait.lock);
+    bool ready = readable();
+    spin_unlock_irqrestore(&tty_wait.lock, flags);
+    return ready;
+}
+
+// Going raw hands a half-typed line to readers as it is; going back to
+// cooked discards unread keys, so they don't end up in front of the next
+// line
+void tty_set_mode(tty_mode_t new_mode) {
+    u32 flags = spin_lock_irqsave(&tty_lock);
+    spin_lock(&tty_wait.lock);
+    if (new_mode == TTY_RAW && mode == TTY_COOKED) {
+        queue_chars(line, line_len);
+        line_len = 0;
+    } else if (new_mode == TTY_COOKED && mode == TTY_RAW) {
+        read_head = read_tail;
+        lines_ready = 0;
+    }
+    mode = new_mode;
+    if (readable()) {
+        wake_up_locked(&tty_wait);
+    }
+    spin_unlock(&tty_wait.lock);
+    spin_unlock_irqrestore(&tty_lock, flags);
+}
+
+tty_mode_t tty_get_mode(void) {
+    return mode;
+}
+
+void tty_get_stats(tty_stats_t* out) {
+    u32 flags = spin_lock_irqsave(&tty_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&tty_lock, flags);
+}
@@ -1,31 +1,257 @@
 #include "kernel.h"
+#ifndef HOST_BUILD
+#include "fpu.h"
+#else
+// The host harness runs in user mode, where the OS owns the SIMD state
+static inline u32 kernel_fpu_begin(void) {
+    return 0;
+}
+
+static inline void kernel_fpu_end(u32 flags) {
+    (void)flags;
+}
+
+static inline bool fpu_sse_enabled(void) {
+    return true;
+}
+#endif
+
+// String and memory functions
+//
+// Bulk copies and fills use the string instructions: rep movsd/stosd for
+// the dwords and rep movsb/stosb for the odd bytes, or rep movsb/stosb for
+// everything on CPUs with fast short strings (ERMS). Large blocks whose
+// source and destination share 16-byte alignment go through SSE2 instead
+// when the CPU has it and ERMS is absent, bracketed by kernel_fpu_begin()
+// so a process's SIMD registers survive. string_init() picks the variants
+// once at boot; until then the dword versions run, which any 386 has.
+//
+// String scans read a dword at a time once the pointer is aligned, so
+// they never read past the page holding the terminator.
+
+#define CPUID_SSE2 (1 << 26)
+#define CPUID_ERMS (1 << 9)  // Leaf 7, EBX
+
+#define SSE_MIN_SIZE 2048
+
+// Repeated byte masks for finding a zero byte in a word
+#define ONES  0x01010101
+#define HIGHS 0x80808080
+
+typedef u32 __attribute__((__may_alias__)) word_t;
+
+static bool erms = false;
+static bool sse2 = false;
+
+static inline bool has_zero_byte(u32 word) {
+    return ((word - ONES) & ~word & HIGHS) != 0;
+}
+
+static inline void copy_dwords(void* dest, const void* src, size_t count) {
+    size_t dwords = count >> 2;
+    size_t bytes = count & 3;
+    asm volatile("rep movsl" : "+D"(dest), "+S"(src), "+c"(dwords) : : "memory");
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(bytes) : : "memory");
+}
+
+static inline void copy_bytes(void* dest, const void* src, size_t count) {
+    asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(count) : : "memory");
+}
+
+static inline void fill_dwords(void* dest, u8 value, size_t count) {
+    size_t dwords = count >> 2;
+    size_t bytes = count & 3;
+    u32 pattern = value * ONES;
+    asm volatile("rep stosl" : "+D"(dest), "+c"(dwords) : "a"(pattern) : "memory");
+    asm volatile("rep stosb" : "+D"(dest), "+c"(bytes) : "a"(pattern) : "memory");
+}
+
+static inline void fill_bytes(void* dest, u8 value, size_t count) {
+    asm volatile("rep stosb" : "+D"(dest), "+c"(count) : "a"(value) : "memory");
+}
+
+// 64 bytes per iteration; dest and src 16-byte aligned, count a multiple
+// of 64
+static void copy_sse2(u8* dest, const u8* src, size_t count) {
+    u32 flags = kernel_fpu_begin();
+    for (; count; count -= 64, src += 64, dest += 64) {
+        asm volatile("movdqa   (%1), %%xmm0\n\t"
+                     "movdqa 16(%1), %%xmm1\n\t"
+                     "movdqa 32(%1), %%xmm2\n\t"
+                     "movdqa 48(%1), %%xmm3\n\t"
+                     "movdqa %%xmm0,   (%0)\n\t"
+                     "movdqa %%xmm1, 16(%0)\n\t"
+                     "movdqa %%xmm2, 32(%0)\n\t"
+                     "movdqa %%xmm3, 48(%0)"
+                     : : "r"(dest), "r"(src) : "memory");
+    }
+    kernel_fpu_end(flags);
+}
+
+static void fill_sse2(u8* dest, u8 value, size_t count) {
+    u32 pattern = value * ONES;
+    u32 flags = kernel_fpu_begin();
+    asm volatile("movd %0, %%xmm0\n\t"
+                 "pshufd $0, %%xmm0, %%xmm0" : : "r"(pattern));
+    for (; count; count -= 64, dest += 64) {
+        asm volatile("movdqa %%xmm0,   (%0)\n\t"
+                     "movdqa %%xmm0, 16(%0)\n\t"
+                     "movdqa %%xmm0, 32(%0)\n\t"
+                     "movdqa %%xmm0, 48(%0)"
+                     : : "r"(dest) : "memory");
+    }
+    kernel_fpu_end(flags);
+}
+
+void string_init(void) {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    u32 max_leaf = eax;
+    
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    sse2 = (edx & CPUID_SSE2) && fpu_sse_enabled();
+    if (max_leaf >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        erms = (ebx & CPUID_ERMS) != 0;
+    }
+}
+
+const char* string_variant(void) {
+    if (erms) {
+        return "rep movsb (ERMS)";
+    }
+    return sse2 ? "SSE2" : "rep movsd";
+}
+
+#ifdef HOST_BUILD
+// The harness fuzzes every variant, not just the one its CPU gets
+void string_force_variant(bool use_erms, bool use_sse2) {
+    erms = use_erms;
+    sse2 = use_sse2;
+}
+#endif
 
 void* memset(void* dest, int value, size_t count) {
-    u8* ptr = (u8*)dest;
-    for (size_t i = 0; i < count; i++) {
-        ptr[i] = (u8)value;
+    u8* d = (u8*)dest;
+    if (erms) {
+        fill_bytes(d, (u8)value, count);
+        return dest;
+    }
+    
+    if (sse2 && count >= SSE_MIN_SIZE) {
+        size_t head = (16 - ((u32)d & 15)) & 15;
+        fill_dwords(d, (u8)value, head);
+        d += head;
+        count -= head;
+        fill_sse2(d, (u8)value, count & ~63);
+        d += count & ~63;
+        count &= 63;
     }
+    fill_dwords(d, (u8)value, count);
     return dest;
 }
 
 void* memcpy(void* dest, const void* src, size_t count) {
     u8* d = (u8*)dest;
     const u8* s = (const u8*)src;
-    for (size_t i = 0; i < count; i++) {
-        d[i] = s[i];
+    if (erms) {
+        copy_bytes(d, s, count);
+        return dest;
+    }
+    
+    if (sse2 && count >= SSE_MIN_SIZE && (((u32)d ^ (u32)s) & 15) == 0) {
+        size_t head = (16 - ((u32)d & 15)) & 15;
+        copy_dwords(d, s, head);
+        d += head;
+        s += head;
+        count -= head;
+        copy_sse2(d, s, count & ~63);
+        d += count & ~63;
+        s += count & ~63;
+        count &= 63;
+    }
+    copy_dwords(d, s, count);
+    return dest;
+}
+
+// Copying forwards is safe when dest is below src, so only a destination
+// inside the source runs backwards: the odd bytes at the top, then dwords.
+// This avoids std, which interrupt handlers would inherit.
+void* memmove(void* dest, const void* src, size_t count) {
+    u8* d = (u8*)dest;
+    const u8* s = (const u8*)src;
+    if (d <= s || d >= s + count) {
+        copy_dwords(d, s, count);
+        return dest;
+    }
+    
+    d += count;
+    s += count;
+    for (size_t tail = count & 3; tail; tail--) {
+        *--d = *--s;
+    }
+    for (size_t words = count >> 2; words; words--) {
+        d -= 4;
+        s -= 4;
+        *(word_t*)d = *(const word_t*)s;
     }
     return dest;
 }
 
+int memcmp(const void* s1, const void* s2, size_t count) {
+    const u8* a = (const u8*)s1;
+    const u8* b = (const u8*)s2;
+    
+    // Skip equal dwords, then find the differing byte
+    while (count >= 4 && *(const word_t*)a == *(const word_t*)b) {
+        a += 4;
+        b += 4;
+        count -= 4;
+    }
+    for (; count; count--, a++, b++) {
+        if (*a != *b) {
+            return *a - *b;
+        }
+    }
+    return 0;
+}
+
 size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len] != '\0') {
-        len++;
+    const char* p = str;
+    while ((u32)p & 3) {
+        if (!*p) {
+            return p - str;
+        }
+        p++;
     }
-    return len;
+    
+    const word_t* w = (const word_t*)p;
+    while (!has_zero_byte(*w)) {
+        w++;
+    }
+    p = (const char*)w;
+    while (*p) {
+        p++;
+    }
+    return p - str;
 }
 
 int strcmp(const char* s1, const char* s2) {
+    // Word at a time only works when both strings reach alignment together
+    if ((((u32)s1 ^ (u32)s2) & 3) == 0) {
+        while ((u32)s1 & 3) {
+            if (!*s1 || *s1 != *s2) {
+                return *(u8*)s1 - *(u8*)s2;
+            }
+            s1++;
+            s2++;
+        }
+        while (*(const word_t*)s1 == *(const word_t*)s2 && !has_zero_byte(*(const word_t*)s1)) {
+            s1 += 4;
+            s2 += 4;
+        }
+    }
+    
     while (*s1 && (*s1 == *s2)) {
         s1++;
         s2++;
@@ -1,5 +1,8 @@
 #include "vga.h"
 #include "kernel.h"
+#include "spinlock.h"
+#include "idt.h"
+#include "console.h"
 
 enum vga_color {
     VGA_COLOR_BLACK = 0,
@@ -20,10 +23,51 @@ enum vga_color {
     VGA_COLOR_WHITE = 15,
 };
 
+// Text output goes to a ring of rows in RAM that holds the screen and the
+// scrollback above it, so scrolling a line only moves the ring's top and
+// blanks the new bottom row. Rows marked dirty are copied to the VGA text
+// memory, a run of adjacent rows per memcpy; writes to that memory are
+// slow, especially under virtualization.
+//
+// Text memory is a 32 KB window with room for about eight screens. The
+// display is panned through it with the CRTC start address, so a scroll
+// leaves the rows already there in place and only the new ones are
+// copied; when the display reaches the end of the window it starts over
+// at the top, the one case that redraws the whole screen. The hardware
+// cursor is moved at the same time, never once per character.
+//
+// The copy happens when a burst of lines has built up, on the timer tick,
+// and when a CPU goes idle. Until the timer is ticking, every write is
+// copied out at once, so boot messages appear as they are printed.
+#define VGA_FLUSH_LINES VGA_HEIGHT  // Newlines that force a flush
+#define VGA_ALL_ROWS ((1u << VGA_HEIGHT) - 1)
+#define VGA_RING_ROWS 256           // Screen and scrollback, a power of two
+#define VGA_RING_MASK (VGA_RING_ROWS - 1)
+#define VGA_WINDOW_ROWS (0x8000 / (VGA_WIDTH * sizeof(u16)))
+
+#define CRTC_INDEX 0x3D4
+#define CRTC_DATA 0x3D5
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW 0x0D
+#define CRTC_CURSOR_HIGH 0x0E
+#define CRTC_CURSOR_LOW 0x0F
+
 static u8 terminal_row;
 static u8 terminal_column;
 static u8 terminal_color;
 static u16* terminal_buffer;
+static u16 ring[VGA_RING_ROWS * VGA_WIDTH];
+static u32 top;                  // Ring row at the top of the live screen
+static u32 history;              // Rows of scrollback above it
+static u32 view;                 // Rows scrolled back from the live screen
+static u32 hw_top;               // Text memory row at the top of the display
+static u32 cursor_pos;           // Cell the hardware cursor was last put at
+static u32 dirty_rows;           // Bit per screen row changed since the last flush
+static u32 pending_lines;        // Newlines since the last flush
+static u32 pending_scroll;       // Lines scrolled since the last flush
+static volatile bool changed;    // Anything to flush, cursor included
+static bool batching = false;
+static spinlock_t vga_lock = SPINLOCK_INIT("vga");
 
 static inline u8 vga_entry_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
@@ -33,23 +77,163 @@ static inline u16 vga_entry(unsigned char uc, u8 color) {
     return (u16)uc | (u16)color << 8;
 }
 
+static inline u16* ring_row(u32 row) {
+    return &ring[(row & VGA_RING_MASK) * VGA_WIDTH];
+}
+
+static void crtc_write(u8 high_index, u32 value) {
+    outb(CRTC_INDEX, high_index);
+    outb(CRTC_DATA, (value >> 8) & 0xFF);
+    outb(CRTC_INDEX, high_index + 1);
+    outb(CRTC_DATA, value & 0xFF);
+}
+
+static void fill_row(u32 row) {
+    u16* cells = ring_row(top + row);
+    u16 blank = vga_entry(' ', terminal_color);
+    for (size_t x = 0; x < VGA_WIDTH; x++) {
+        cells[x] = blank;
+    }
+    dirty_rows |= 1u << row;
+}
+
+// Copy screen rows first to last, which may wrap around the ring
+static void copy_rows(u32 first, u32 last) {
+    u32 row = first;
+    while (row <= last) {
+        u32 index = (top - view + row) & VGA_RING_MASK;
+        u32 count = last - row + 1;
+        if (count > VGA_RING_ROWS - index) {
+            count = VGA_RING_ROWS - index;
+        }
+        memcpy(terminal_buffer + (hw_top + row) * VGA_WIDTH, &ring[index * VGA_WIDTH],
+               count * VGA_WIDTH * sizeof(u16));
+        row += count;
+    }
+}
+
+static void flush_locked(void) {
+    // Pan down past the scrolled lines, or start over at the top of the
+    // window, which needs the whole screen
+    u32 hw = hw_top + pending_scroll;
+    if (hw + VGA_HEIGHT > VGA_WINDOW_ROWS) {
+        hw = 0;
+        dirty_rows = VGA_ALL_ROWS;
+    }
+    bool panned = hw != hw_top;
+    hw_top = hw;
+    
+    u32 dirty = dirty_rows;
+    while (dirty) {
+        u32 first = bit_scan_forward(dirty);
+        u32 last = first;
+        while (last + 1 < VGA_HEIGHT && ((dirty >> (last + 1)) & 1)) {
+            last++;
+        }
+        copy_rows(first, last);
+        dirty &= ~(((1u << (last + 1)) - 1) & ~((1u << first) - 1));
+    }
+    if (panned) {
+        crtc_write(CRTC_START_HIGH, hw_top * VGA_WIDTH);
+    }
+    
+    // Below the display while scrolled back, which hides it
+    u32 row = view ? VGA_HEIGHT : terminal_row;
+    u32 pos = (hw_top + row) * VGA_WIDTH + terminal_column;
+    if (pos != cursor_pos) {
+        crtc_write(CRTC_CURSOR_HIGH, pos);
+        cursor_pos = pos;
+    }
+    
+    dirty_rows = 0;
+    pending_lines = 0;
+    pending_scroll = 0;
+    changed = false;
+}
+
+static void scroll(void) {
+    top = (top + 1) & VGA_RING_MASK;
+    if (history < VGA_RING_ROWS - VGA_HEIGHT) {
+        history++;
+    }
+    
+    // The rows already in text memory move up with the display
+    dirty_rows >>= 1;
+    fill_row(VGA_HEIGHT - 1);
+    pending_scroll++;
+}
+
+static void newline(void) {
+    terminal_column = 0;
+    pending_lines++;
+    if (terminal_row + 1 < VGA_HEIGHT) {
+        terminal_row++;
+    } else {
+        scroll();
+    }
+}
+
+static void put_char(char c) {
+    if (c == '\n') {
+        newline();
+    } else if (c == '\b') {
+        if (terminal_column > 0) {
+            terminal_column--;
+        }
+    } else {
+        ring_row(top + terminal_row)[terminal_column] = vga_entry(c, terminal_color);
+        dirty_rows |= 1u << terminal_row;
+        if (++terminal_column == VGA_WIDTH) {
+            newline();
+        }
+    }
+}
+
 void vga_init(void) {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
     terminal_buffer = (u16*)VGA_MEMORY;
+    top = 0;
+    history = 0;
+    view = 0;
+    hw_top = 0;
+    cursor_pos = 0xFFFFFFFF;
+    crtc_write(CRTC_START_HIGH, 0);
     vga_clear();
+    history = 0;
 }
 
+// The text on screen goes into the scrollback
 void vga_clear(void) {
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    for (u32 y = 0; y <= terminal_row; y++) {
+        scroll();
+    }
+    for (u32 y = 0; y < VGA_HEIGHT; y++) {
+        fill_row(y);
+    }
+    terminal_row = 0;
+    terminal_column = 0;
+    view = 0;
+    flush_locked();
+    spin_unlock_irqrestore(&vga_lock, flags);
+}
+
+// Blank the live screen in place and put the cursor top left. Unlike
+// vga_clear() nothing goes into the scrollback, so a full-screen redraw
+// can repeat without flooding it. Left for the next flush, which normally
+// comes after the new text is drawn.
+void vga_home(void) {
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    for (u32 y = 0; y < VGA_HEIGHT; y++) {
+        fill_row(y);
     }
     terminal_row = 0;
     terminal_column = 0;
+    view = 0;
+    changed = true;
+    spin_unlock_irqrestore(&vga_lock, flags);
 }
 
 void vga_set_color(u8 color) {
@@ -60,49 +244,159 @@ u8 vga_get_color(void) {
     return terminal_color;
 }
 
+void vga_write(const char* buf, size_t len) {
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    if (view) {
+        view = 0;  // Output returns to the live screen
+        dirty_rows = VGA_ALL_ROWS;
+    }
+    changed = true;
+    for (size_t i = 0; i < len; i++) {
+        put_char(buf[i]);
+    }
+    if (!batching || pending_lines >= VGA_FLUSH_LINES) {
+        flush_locked();
+    }
+    spin_unlock_irqrestore(&vga_lock, flags);
+}
+
+// The printing helpers write to the console, which includes the screen
 void vga_putchar(char c) {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            // Scroll
-            for (size_t y = 1; y < VGA_HEIGHT; y++) {
-                for (size_t x = 0; x < VGA_WIDTH; x++) {
-                    terminal_buffer[(y - 1) * VGA_WIDTH + x] = 
-                        terminal_buffer[y * VGA_WIDTH + x];
-                }
-            }
-            for (size_t x = 0; x < VGA_WIDTH; x++) {
-                terminal_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = 
-                    vga_entry(' ', terminal_color);
+    console_write(&c, 1);
+}
+
+void vga_puts(const char* str) {
+    console_write(str, strlen(str));
+}
+
+void vga_flush(void) {
+    if (!changed) {
+        return;
+    }
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    flush_locked();
+    spin_unlock_irqrestore(&vga_lock, flags);
+}
+
+// Move the display rows lines back into the scrollback, or forward
+// towards the live screen for negative rows
+void vga_scroll_view(int rows) {
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    int target = (int)view + rows;
+    if (target < 0) {
+        target = 0;
+    }
+    if (target > (int)history) {
+        target = history;
+    }
+    if ((u32)target != view) {
+        view = target;
+        dirty_rows = VGA_ALL_ROWS;
+        flush_locked();
+    }
+    spin_unlock_irqrestore(&vga_lock, flags);
+}
+
+// Timer interrupt: from the first tick on, output is batched. A CPU in
+// the middle of a write will flush it, or the next tick will.
+void vga_tick(void) {
+    batching = true;
+    if (changed && spin_trylock(&vga_lock)) {
+        flush_locked();
+        spin_unlock(&vga_lock);
+    }
+}
+
+void vga_put_dec(u32 value) {
+    char buf[11];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    vga_puts(&buf[i]);
+}
+
+void vga_put_hex(u32 value) {
+    static const char digits[] = "0123456789ABCDEF";
+    char buf[11];
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 8; i++) {
+        buf[2 + i] = digits[(value >> (28 - i * 4)) & 0xF];
+    }
+    buf[10] = '\0';
+    vga_puts(buf);
+}
+
+// Console throughput: the same lines printed through the back buffer,
+// with a flush after every line, and straight into text memory as the
+// driver did before it had a back buffer
+#define VGA_BENCH_LINES 500
+
+static const char bench_line[] = "vgabench: the quick brown fox jumps over the lazy dog 0123456789\n";
+
+static void direct_write(const char* str, size_t len, u32* row, u32* column) {
+    volatile u16* screen = terminal_buffer + hw_top * VGA_WIDTH;
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] != '\n') {
+            screen[*row * VGA_WIDTH + *column] = vga_entry(str[i], terminal_color);
+            if (++*column < VGA_WIDTH) {
+                continue;
             }
-            terminal_row = VGA_HEIGHT - 1;
         }
-    } else {
-        const size_t index = terminal_row * VGA_WIDTH + terminal_column;
-        terminal_buffer[index] = vga_entry(c, terminal_color);
-        if (++terminal_column == VGA_WIDTH) {
-            terminal_column = 0;
-            if (++terminal_row == VGA_HEIGHT) {
-                // Scroll
-                for (size_t y = 1; y < VGA_HEIGHT; y++) {
-                    for (size_t x = 0; x < VGA_WIDTH; x++) {
-                        terminal_buffer[(y - 1) * VGA_WIDTH + x] = 
-                            terminal_buffer[y * VGA_WIDTH + x];
-                    }
-                }
-                for (size_t x = 0; x < VGA_WIDTH; x++) {
-                    terminal_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = 
-                        vga_entry(' ', terminal_color);
-                }
-                terminal_row = VGA_HEIGHT - 1;
+        *column = 0;
+        if (++*row == VGA_HEIGHT) {
+            for (size_t j = VGA_WIDTH; j < VGA_HEIGHT * VGA_WIDTH; j++) {
+                screen[j - VGA_WIDTH] = screen[j];
+            }
+            for (size_t x = 0; x < VGA_WIDTH; x++) {
+                screen[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
             }
+            *row = VGA_HEIGHT - 1;
         }
     }
 }
 
-void vga_puts(const char* str) {
-    size_t len = strlen(str);
-    for (size_t i = 0; i < len; i++) {
-        vga_putchar(str[i]);
+static u64 bench_write(bool batch) {
+    bool saved = batching;
+    batching = batch;
+    u64 start = rdtsc();
+    for (u32 i = 0; i < VGA_BENCH_LINES; i++) {
+        vga_write(bench_line, sizeof(bench_line) - 1);
+    }
+    vga_flush();
+    u64 cycles = rdtsc() - start;
+    batching = saved;
+    return cycles;
+}
+
+void vga_benchmark(void) {
+    u64 batched = bench_write(true);
+    u64 unbatched = bench_write(false);
+    
+    u32 flags = spin_lock_irqsave(&vga_lock);
+    u32 row = terminal_row;
+    u32 column = terminal_column;
+    u64 start = rdtsc();
+    for (u32 i = 0; i < VGA_BENCH_LINES; i++) {
+        direct_write(bench_line, sizeof(bench_line) - 1, &row, &column);
     }
+    u64 direct = rdtsc() - start;
+    dirty_rows = VGA_ALL_ROWS;  // Put the ring's contents back
+    flush_locked();
+    spin_unlock_irqrestore(&vga_lock, flags);
+    
+    vga_puts("Console output, cycles per line over ");
+    vga_put_dec(VGA_BENCH_LINES);
+    vga_puts(" lines:\n  batched ");
+    vga_put_dec(div_u64_u32(batched, VGA_BENCH_LINES));
+    vga_puts(", flush per line ");
+    vga_put_dec(div_u64_u32(unbatched, VGA_BENCH_LINES));
+    vga_puts(", direct to text memory ");
+    vga_put_dec(div_u64_u32(direct, VGA_BENCH_LINES));
+    vga_puts(" (");
+    vga_put_dec(batched ? div_u64_u32(direct, (u32)batched) : 0);
+    vga_puts("x)\n");
 }
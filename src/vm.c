@@ -0,0 +1,380 @@
+#include "vm.h"
+#include "memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "semaphore.h"
+#include "kernel.h"
+#include "vga.h"
+
+// Address spaces
+//
+// Only the process window differs between address spaces; the kernel half
+// of every directory shares the kernel's page tables. Areas are kept in a
+// sorted list and placed first fit with an unmapped page after each one,
+// so running off the end of an area faults instead of landing in the next.
+//
+// Areas are only added and removed by the owning process, or by the
+// scheduler once it has exited, so a pointer from as_find_area() stays
+// valid for the caller.
+
+address_space_t* as_create(void) {
+    address_space_t* as = (address_space_t*)kmalloc(sizeof(address_space_t));
+    if (!as) {
+        return NULL;
+    }
+    
+    as->directory = paging_new_directory();
+    if (!as->directory) {
+        kfree(as);
+        return NULL;
+    }
+    as->areas = NULL;
+    as->pages = 0;
+    spin_lock_init(&as->lock, "address space");
+    return as;
+}
+
+// as must not be loaded on any CPU
+void as_destroy(address_space_t* as) {
+    if (!as) {
+        return;
+    }
+    while (as->areas) {
+        as_free_area(as, as->areas);
+    }
+    paging_free_directory(as->directory);
+    kfree(as);
+}
+
+// The current process's address space. The scheduler loads CR3 from
+// process->mm, so the first one is installed with interrupts off.
+address_space_t* as_current(bool create) {
+    process_t* proc = get_current_process();
+    if (!proc) {
+        return NULL;
+    }
+    if (proc->mm || !create) {
+        return proc->mm;
+    }
+    
+    address_space_t* as = as_create();
+    if (!as) {
+        return NULL;
+    }
+    u32 flags = irq_save();
+    proc->mm = as;
+    paging_switch(as->directory);
+    irq_restore(flags);
+    return as;
+}
+
+// Duplicate as for a forked child. Private pages end up read-only and
+// copy-on-write in both address spaces, so forking costs page table
+// entries rather than memory; eager copies them straight away instead.
+// Only the owner of as changes it, so the walk needs no lock.
+address_space_t* as_fork(address_space_t* as, bool eager) {
+    address_space_t* child = as_create();
+    if (!child) {
+        return NULL;
+    }
+    
+    vm_area_t** tail = &child->areas;
+    for (vm_area_t* area = as->areas; area; area = area->next) {
+        vm_area_t* copy = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+        if (!copy) {
+            as_destroy(child);
+            return NULL;
+        }
+        *copy = *area;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+        if (copy->dup) {
+            copy->dup(copy);
+        }
+        
+        for (u32 addr = area->start; addr < area->end; addr += PAGE_SIZE) {
+            u32 entry = paging_lookup_in(as->directory, addr);
+            if (!(entry & PAGE_PRESENT)) {
+                continue;
+            }
+            u32 frame = entry & PAGE_FRAME_MASK;
+            u32 flags = entry & 0xFFF;
+            
+            if (area->shared) {
+                pmm_frame_get(frame);
+            } else if (eager) {
+                u32 page = pmm_alloc_frame();
+                if (!page) {
+                    as_destroy(child);
+                    return NULL;
+                }
+                memcpy((void*)page, (void*)frame, PAGE_SIZE);
+                frame = page;
+                if (flags & PAGE_COW) {
+                    flags = (flags & ~PAGE_COW) | PAGE_WRITE;
+                }
+            } else {
+                if (flags & PAGE_WRITE) {
+                    flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+                    paging_set_flags_in(as->directory, addr, flags);
+                }
+                pmm_frame_get(frame);
+            }
+            
+            if (!paging_map_page_in(child->directory, addr, frame, flags)) {
+                pmm_frame_put(frame);
+                as_destroy(child);
+                return NULL;
+            }
+            child->pages++;
+        }
+    }
+    return child;
+}
+
+vm_area_t* as_alloc_area(address_space_t* as, u32 size, u32 flags) {
+    size = (size + PAGE_SIZE - 1) & PAGE_FRAME_MASK;
+    if (!as || size == 0 || size > PROCESS_WINDOW_END - PROCESS_WINDOW_START) {
+        return NULL;
+    }
+    
+    vm_area_t* area = (vm_area_t*)kmalloc(sizeof(vm_area_t));
+    if (!area) {
+        return NULL;
+    }
+    
+    u32 irq_flags = spin_lock_irqsave(&as->lock);
+    u32 start = PROCESS_WINDOW_START;
+    vm_area_t** link = &as->areas;
+    while (*link) {
+        if (size + PAGE_SIZE <= (*link)->start - start) {
+            break;
+        }
+        start = (*link)->end + PAGE_SIZE;
+        link = &(*link)->next;
+    }
+    if (start > PROCESS_WINDOW_END || size > PROCESS_WINDOW_END - start) {
+        spin_unlock_irqrestore(&as->lock, irq_flags);
+        kfree(area);
+        return NULL;
+    }
+    
+    area->start = start;
+    area->end = start + size;
+    area->flags = flags;
+    area->shared = false;
+    area->release = NULL;
+    area->dup = NULL;
+    area->data = NULL;
+    area->next = *link;
+    *link = area;
+    spin_unlock_irqrestore(&as->lock, irq_flags);
+    return area;
+}
+
+// The mapping takes over one reference to phys
+bool as_map_page(address_space_t* as, vm_area_t* area, u32 virt, u32 phys) {
+    if (virt < area->start || virt >= area->end) {
+        return false;
+    }
+    if (!paging_map_page_in(as->directory, virt, phys, area->flags)) {
+        return false;
+    }
+    
+    u32 irq_flags = spin_lock_irqsave(&as->lock);
+    as->pages++;
+    spin_unlock_irqrestore(&as->lock, irq_flags);
+    return true;
+}
+
+// Unmap the area, drop its frame references and hand it to release()
+void as_free_area(address_space_t* as, vm_area_t* area) {
+    u32 irq_flags = spin_lock_irqsave(&as->lock);
+    vm_area_t** link = &as->areas;
+    while (*link && *link != area) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        spin_unlock_irqrestore(&as->lock, irq_flags);
+        return;
+    }
+    *link = area->next;
+    spin_unlock_irqrestore(&as->lock, irq_flags);
+    
+    u32 unmapped = 0;
+    for (u32 addr = area->start; addr < area->end; addr += PAGE_SIZE) {
+        u32 frame = paging_unmap_page_in(as->directory, addr);
+        if (frame) {
+            pmm_frame_put(frame);
+            unmapped++;
+        }
+    }
+    
+    irq_flags = spin_lock_irqsave(&as->lock);
+    as->pages -= unmapped;
+    spin_unlock_irqrestore(&as->lock, irq_flags);
+    
+    if (area->release) {
+        area->release(area);
+    }
+    kfree(area);
+}
+
+vm_area_t* as_find_area(address_space_t* as, u32 addr) {
+    if (!as) {
+        return NULL;
+    }
+    
+    u32 irq_flags = spin_lock_irqsave(&as->lock);
+    vm_area_t* area = as->areas;
+    while (area && addr >= area->end) {
+        area = area->next;
+    }
+    if (area && addr < area->start) {
+        area = NULL;
+    }
+    spin_unlock_irqrestore(&as->lock, irq_flags);
+    return area;
+}
+
+void* vm_alloc(u32 size) {
+    address_space_t* as = as_current(true);
+    vm_area_t* area = as_alloc_area(as, size, PAGE_WRITE);
+    if (!area) {
+        return NULL;
+    }
+    
+    for (u32 addr = area->start; addr < area->end; addr += PAGE_SIZE) {
+        u32 frame = pmm_alloc_frame();
+        if (!frame) {
+            as_free_area(as, area);
+            return NULL;
+        }
+        memset((void*)frame, 0, PAGE_SIZE);
+        if (!as_map_page(as, area, addr, frame)) {
+            pmm_frame_put(frame);
+            as_free_area(as, area);
+            return NULL;
+        }
+    }
+    return (void*)area->start;
+}
+
+// Only frees memory from vm_alloc(); shared mappings have their own calls
+bool vm_free(void* addr) {
+    address_space_t* as = as_current(false);
+    vm_area_t* area = as_find_area(as, (u32)addr);
+    if (!area || area->start != (u32)addr || area->release) {
+        return false;
+    }
+    as_free_area(as, area);
+    return true;
+}
+
+// Fork benchmark: a process with FORK_BENCH_PAGES of private memory forks
+// repeatedly, copy-on-write and eager. Each child waits until the parent
+// has counted the frames the fork took, then writes to every page, which
+// is where copy-on-write pays its deferred cost, and exits.
+#define FORK_BENCH_PAGES 256
+#define FORK_BENCH_ROUNDS 8
+
+static semaphore_t bench_go;
+static semaphore_t bench_child_done;
+static semaphore_t bench_done;
+static u64 child_write_cycles;  // Set by each child before it exits
+
+typedef struct {
+    u64 fork_cycles;
+    u64 write_cycles;
+    u32 frames;
+    u32 failures;
+} fork_result_t;
+
+static void bench_round(volatile u8* mem, bool eager, fork_result_t* result) {
+    u32 free_before = pmm_free_frame_count();
+    u64 start = rdtsc();
+    int pid = eager ? fork_eager() : fork();
+    if (pid == 0) {
+        sem_down(&bench_go);
+        u64 write_start = rdtsc();
+        for (u32 i = 0; i < FORK_BENCH_PAGES; i++) {
+            mem[i * PAGE_SIZE]++;
+        }
+        child_write_cycles = rdtsc() - write_start;
+        sem_up(&bench_child_done);
+        process_exit(get_current_process()->pid);
+    }
+    
+    u64 end = rdtsc();
+    if (pid < 0) {
+        result->failures++;
+        return;
+    }
+    result->fork_cycles += end - start;
+    result->frames += free_before - pmm_free_frame_count();
+    sem_up(&bench_go);
+    sem_down(&bench_child_done);
+    result->write_cycles += child_write_cycles;
+}
+
+static void print_result(const char* label, fork_result_t* result) {
+    u32 rounds = FORK_BENCH_ROUNDS - result->failures;
+    vga_puts(label);
+    if (!rounds) {
+        vga_puts("fork failed\n");
+        return;
+    }
+    vga_put_dec(div_u64_u32(result->fork_cycles, rounds));
+    vga_puts(" cycles/fork, ");
+    vga_put_dec(result->frames * (PAGE_SIZE / 1024) / rounds);
+    vga_puts(" KB at fork, ");
+    vga_put_dec(div_u64_u32(result->write_cycles, rounds));
+    vga_puts(" cycles for the child to write every page\n");
+}
+
+static void bench_main(void) {
+    volatile u8* mem = (volatile u8*)vm_alloc(FORK_BENCH_PAGES * PAGE_SIZE);
+    if (!mem) {
+        vga_puts("forkbench: out of memory\n");
+        sem_up(&bench_done);
+        return;
+    }
+    for (u32 i = 0; i < FORK_BENCH_PAGES; i++) {
+        mem[i * PAGE_SIZE] = (u8)i;
+    }
+    
+    fork_result_t cow;
+    fork_result_t eager;
+    memset(&cow, 0, sizeof(cow));
+    memset(&eager, 0, sizeof(eager));
+    for (u32 i = 0; i < FORK_BENCH_ROUNDS; i++) {
+        bench_round(mem, false, &cow);
+        bench_round(mem, true, &eager);
+    }
+    
+    vga_puts("Fork benchmark: ");
+    vga_put_dec(FORK_BENCH_PAGES * PAGE_SIZE / 1024);
+    vga_puts(" KB private memory, ");
+    vga_put_dec(FORK_BENCH_ROUNDS);
+    vga_puts(" forks each\n");
+    print_result("  copy-on-write: ", &cow);
+    print_result("  eager copy:    ", &eager);
+    
+    vm_free((void*)mem);
+    sem_up(&bench_done);
+}
+
+// fork() needs a process with a stack of its own, so the benchmark runs in
+// one while the caller waits
+void fork_benchmark(void) {
+    sem_init(&bench_go, 0);
+    sem_init(&bench_child_done, 0);
+    sem_init(&bench_done, 0);
+    if (!process_create(bench_main, get_current_process()->priority)) {
+        vga_puts("forkbench: could not start\n");
+        return;
+    }
+    sem_down(&bench_done);
+}
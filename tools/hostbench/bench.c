@@ -0,0 +1,557 @@
+// Host harness for src/util.c and src/memory.c
+//
+//   hostbench bench [seed]              microbenchmarks
+//   hostbench fuzz [seed] [iterations]  differential fuzzing against libc
+//
+// Both print CSV on stdout (suite,case,size,align,value,unit) so runs can
+// be diffed between commits; fuzz also exits non-zero on any mismatch.
+// Everything is driven by a seeded generator, so a run is repeatable. The
+// kernel allocator gets an mmap'd pool below 4GB; on a 64-bit host its
+// block headers are wider than on i386, so compare results from the same
+// build flavour (make hostbench HOST_ARCH=-m32 where multilib is present).
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel.h"
+#include "memory.h"
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+#define POOL_SIZE (32 * 1024 * 1024)
+#define BEST_OF 5
+
+// The kernel's string functions, renamed by host.h
+void* kmemset(void* dest, int value, size_t count);
+void* kmemcpy(void* dest, const void* src, size_t count);
+void* kmemmove(void* dest, const void* src, size_t count);
+int kmemcmp(const void* s1, const void* s2, size_t count);
+size_t kstrlen(const char* str);
+int kstrcmp(const char* s1, const char* s2);
+int kstrncmp(const char* s1, const char* s2, size_t n);
+void string_force_variant(bool use_erms, bool use_sse2);
+
+// Every memcpy/memset variant in util.c, for the memory fuzz
+static const struct {
+    bool erms;
+    bool sse2;
+} variants[] = {
+    { false, false },  // rep movsd
+    { false, true },   // SSE2
+    { true, false },   // rep movsb (ERMS)
+};
+
+static u32 rng_state;
+static u8* pool;
+static u32 pool_free;     // Free heap bytes with nothing allocated
+static u32 pool_largest;
+
+static u32 rng(void) {
+    // xorshift32
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static u32 rng_range(u32 low, u32 high) {
+    return low + rng() % (high - low + 1);
+}
+
+// Log-uniform between 2^low_shift and 2^high_shift
+static u32 rng_size(u32 low_shift, u32 high_shift) {
+    u32 shift = rng_range(low_shift, high_shift);
+    return (1u << shift) + rng() % (1u << shift);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void csv(const char* suite, const char* name, u32 size, const char* align,
+                double value, const char* unit) {
+    printf("%s,%s,%u,%s,%.2f,%s\n", suite, name, size, align, value, unit);
+}
+
+static void pool_init(void) {
+    pool = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (pool == MAP_FAILED || (size_t)pool + POOL_SIZE > 0xFFFFFFFFu) {
+        fprintf(stderr, "hostbench: no pool below 4GB\n");
+        exit(2);
+    }
+    memory_init_pool(pool, POOL_SIZE);
+    memory_usage(&pool_free, &pool_largest);
+}
+
+static bool pool_restored(void) {
+    u32 free_bytes, largest;
+    memory_usage(&free_bytes, &largest);
+    return free_bytes == pool_free && largest == pool_largest;
+}
+
+// Allocation churn: a working set of same-sized blocks, freeing one and
+// allocating a replacement per round
+#define CHURN_SLOTS 64
+#define CHURN_ROUNDS 100000
+
+static void bench_churn(void) {
+    static const u32 sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    void* slots[CHURN_SLOTS];
+
+    for (u32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        double best = 0;
+        for (int rep = 0; rep < BEST_OF; rep++) {
+            for (int i = 0; i < CHURN_SLOTS; i++) {
+                slots[i] = kmalloc(sizes[s]);
+            }
+            u64 start = rdtsc();
+            for (u32 i = 0; i < CHURN_ROUNDS; i++) {
+                u32 slot = rng() % CHURN_SLOTS;
+                kfree(slots[slot]);
+                slots[slot] = kmalloc(sizes[s]);
+            }
+            double cycles = (double)(rdtsc() - start) / CHURN_ROUNDS;
+            for (int i = 0; i < CHURN_SLOTS; i++) {
+                kfree(slots[i]);
+            }
+            if (rep == 0 || cycles < best) {
+                best = cycles;
+            }
+        }
+        csv("alloc_churn", "kmalloc_kfree", sizes[s], "-", best, "cycles/pair");
+    }
+}
+
+// Fragmentation: a random trace of allocations and frees around a target
+// number of live blocks, then the state of the heap at the end
+#define TRACE_SLOTS 2048
+#define TRACE_OPS 200000
+
+typedef struct {
+    const char* name;
+    u32 low_shift;
+    u32 high_shift;
+} trace_t;
+
+static void bench_fragmentation(void) {
+    static const trace_t traces[] = {
+        { "small", 4, 8 },
+        { "mixed", 4, 13 },
+        { "large", 10, 15 },
+    };
+    static void* slots[TRACE_SLOTS];
+    static u32 sizes[TRACE_SLOTS];
+
+    for (u32 t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+        memset(slots, 0, sizeof(slots));
+        u64 requested = 0;
+        u32 failures = 0;
+        u64 start = rdtsc();
+        for (u32 i = 0; i < TRACE_OPS; i++) {
+            u32 slot = rng() % TRACE_SLOTS;
+            if (slots[slot]) {
+                kfree(slots[slot]);
+                requested -= sizes[slot];
+                slots[slot] = NULL;
+            } else {
+                sizes[slot] = rng_size(traces[t].low_shift, traces[t].high_shift - 1);
+                slots[slot] = kmalloc(sizes[slot]);
+                if (slots[slot]) {
+                    requested += sizes[slot];
+                } else {
+                    failures++;
+                }
+            }
+        }
+        double cycles = (double)(rdtsc() - start) / TRACE_OPS;
+
+        u32 free_bytes, largest;
+        memory_usage(&free_bytes, &largest);
+        u32 used = pool_free - free_bytes;
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-", cycles, "cycles/op");
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-", (double)requested, "live_bytes");
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-", (double)used, "heap_bytes");
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-",
+            used ? 100.0 * (used - requested) / used : 0, "internal_pct");
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-",
+            free_bytes ? 100.0 * (free_bytes - largest) / free_bytes : 0, "external_pct");
+        csv("fragmentation", traces[t].name, TRACE_OPS, "-", failures, "failures");
+
+        for (u32 i = 0; i < TRACE_SLOTS; i++) {
+            kfree(slots[i]);
+        }
+    }
+}
+
+// Buffer growth: several buffers grown by half again each step, with
+// unrelated allocations in between, as a string builder or vector would.
+// Counts how often krealloc() could extend the block where it stood.
+#define GROW_BUFFERS 16
+#define GROW_LIMIT 65536
+
+static void bench_realloc(void) {
+    void* buffers[GROW_BUFFERS];
+    void* other[GROW_BUFFERS];
+    u32 sizes[GROW_BUFFERS];
+    u32 grown = 0;
+    u32 in_place = 0;
+
+    for (int i = 0; i < GROW_BUFFERS; i++) {
+        sizes[i] = 16;
+        buffers[i] = kmalloc(sizes[i]);
+        other[i] = NULL;
+    }
+    u64 cycles = 0;
+    for (bool active = true; active;) {
+        active = false;
+        for (int i = 0; i < GROW_BUFFERS; i++) {
+            if (sizes[i] >= GROW_LIMIT) {
+                continue;
+            }
+            active = true;
+            kfree(other[i]);
+            other[i] = kmalloc(rng_size(4, 9));
+
+            sizes[i] += sizes[i] / 2;
+            u64 start = rdtsc();
+            void* p = krealloc(buffers[i], sizes[i]);
+            cycles += rdtsc() - start;
+            if (p == buffers[i]) {
+                in_place++;
+            }
+            if (p) {
+                buffers[i] = p;
+            }
+            grown++;
+        }
+    }
+    for (int i = 0; i < GROW_BUFFERS; i++) {
+        kfree(buffers[i]);
+        kfree(other[i]);
+    }
+
+    csv("realloc_growth", "krealloc", GROW_LIMIT, "-", (double)cycles / grown, "cycles/op");
+    csv("realloc_growth", "krealloc", GROW_LIMIT, "-", 100.0 * in_place / grown, "in_place_pct");
+}
+
+// Copy and fill throughput by size and alignment, kernel against libc
+#define THROUGHPUT_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    const char* name;
+    u32 dest;
+    u32 src;
+} alignment_t;
+
+static double measure(int which, u8* dest, const u8* src, u32 size) {
+    u32 rounds = THROUGHPUT_BYTES / size;
+    double best = 0;
+    for (int rep = 0; rep < BEST_OF; rep++) {
+        double start = now_ns();
+        for (u32 i = 0; i < rounds; i++) {
+            switch (which) {
+            case 0: kmemcpy(dest, src, size); break;
+            case 1: memcpy(dest, src, size); break;
+            case 2: kmemset(dest, i, size); break;
+            default: memset(dest, i, size); break;
+            }
+            asm volatile("" : : "r"(dest) : "memory");
+        }
+        double ns = now_ns() - start;
+        if (rep == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return (double)rounds * size / best * 1e9 / (1024 * 1024);
+}
+
+static void bench_throughput(void) {
+    static const alignment_t alignments[] = {
+        { "d0s0", 0, 0 }, { "d1s0", 1, 0 }, { "d0s1", 0, 1 },
+        { "d4s4", 4, 4 }, { "d8s0", 8, 0 }, { "d3s7", 3, 7 },
+    };
+    static const char* names[] = { "kmemcpy", "libc_memcpy", "kmemset", "libc_memset" };
+    u32 max = 1024 * 1024;
+    u8* src = mmap(NULL, max + 64, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u8* dest = mmap(NULL, max + 64, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memset(src, 0x5A, max + 64);
+    memset(dest, 0, max + 64);
+
+    for (u32 size = 64; size <= max; size *= 4) {
+        for (u32 a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++) {
+            for (int which = 0; which < 4; which++) {
+                // Fills have no source
+                if (which >= 2 && alignments[a].src != 0) {
+                    continue;
+                }
+                double rate = measure(which, dest + alignments[a].dest, src + alignments[a].src, size);
+                csv("throughput", names[which], size, alignments[a].name, rate, "MB/s");
+            }
+        }
+    }
+    munmap(src, max + 64);
+    munmap(dest, max + 64);
+}
+
+// Differential fuzzing. Each case works on buffers with guard bytes on
+// both sides, so an overrun shows up as a difference from libc.
+#define FUZZ_MAX 9000
+#define FUZZ_GUARD 64
+
+static u32 failures;
+
+static void fail(const char* what, u32 iteration, u32 size, u32 a, u32 b) {
+    if (failures++ < 10) {
+        fprintf(stderr, "mismatch: %s, iteration %u, size %u, offsets %u/%u\n", what, iteration, size, a, b);
+    }
+}
+
+static int sign(int value) {
+    return (value > 0) - (value < 0);
+}
+
+static u32 fuzz_size(void) {
+    // Mostly small, with a tail past the SSE threshold
+    return rng() % 4 ? rng() % 80 : rng() % FUZZ_MAX;
+}
+
+static void fill_random(u8* buf, u32 size) {
+    for (u32 i = 0; i < size; i++) {
+        buf[i] = (u8)rng();
+    }
+}
+
+static void fuzz_memory(u32 iterations) {
+    u32 total = FUZZ_MAX + 2 * FUZZ_GUARD;
+    u8* src = malloc(total);
+    u8* ours = malloc(total);
+    u8* theirs = malloc(total);
+
+    for (u32 it = 0; it < iterations; it++) {
+        u32 size = fuzz_size();
+        u32 d = rng() % FUZZ_GUARD;
+        u32 s = rng() % FUZZ_GUARD;
+        fill_random(src, total);
+        fill_random(ours, total);
+        memcpy(theirs, ours, total);
+
+        switch (it % 4) {
+        case 0:
+            kmemcpy(ours + d, src + s, size);
+            memcpy(theirs + d, src + s, size);
+            if (memcmp(ours, theirs, total)) {
+                fail("memcpy", it, size, d, s);
+            }
+            break;
+        case 1: {
+            int value = rng();
+            kmemset(ours + d, value, size);
+            memset(theirs + d, value, size);
+            if (memcmp(ours, theirs, total)) {
+                fail("memset", it, size, d, 0);
+            }
+            break;
+        }
+        case 2:
+            // Overlapping, in either direction
+            kmemmove(ours + d, ours + s, size);
+            memmove(theirs + d, theirs + s, size);
+            if (memcmp(ours, theirs, total)) {
+                fail("memmove", it, size, d, s);
+            }
+            break;
+        default:
+            memcpy(ours + d, src + s, size);
+            if (size && rng() % 2) {
+                ours[d + rng() % size] ^= 1 << (rng() % 8);
+            }
+            if (sign(kmemcmp(ours + d, src + s, size)) != sign(memcmp(ours + d, src + s, size))) {
+                fail("memcmp", it, size, d, s);
+            }
+            break;
+        }
+    }
+    free(src);
+    free(ours);
+    free(theirs);
+}
+
+// Strings end on the last byte of a page followed by an inaccessible one,
+// so reading past the terminator's page faults
+static sigjmp_buf fault_jump;
+
+static void on_fault(int sig) {
+    (void)sig;
+    siglongjmp(fault_jump, 1);
+}
+
+static void check_strings(u32 it, const char* a, const char* b, u32 len, u32 n) {
+    if (sigsetjmp(fault_jump, 1)) {
+        fail("string read past the terminator's page", it, len, 0, 0);
+        return;
+    }
+    if (kstrlen(a) != strlen(a)) {
+        fail("strlen", it, len, 0, 0);
+    }
+    if (sign(kstrcmp(a, b)) != sign(strcmp(a, b)) || sign(kstrcmp(b, a)) != sign(strcmp(b, a))) {
+        fail("strcmp", it, len, 0, 0);
+    }
+    if (sign(kstrncmp(a, b, n)) != sign(strncmp(a, b, n))) {
+        fail("strncmp", it, len, n, 0);
+    }
+}
+
+static void fuzz_strings(u32 iterations) {
+    long page = sysconf(_SC_PAGESIZE);
+    u8* area = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mprotect(area + page, page, PROT_NONE);
+    char* end_a = (char*)area + page;
+    char* b = malloc(page + 1);
+    signal(SIGSEGV, on_fault);
+
+    for (u32 it = 0; it < iterations; it++) {
+        u32 len = rng() % 4 ? rng() % 64 : rng() % (page - 1);
+        char* a = end_a - len - 1;
+        for (u32 i = 0; i < len; i++) {
+            a[i] = (char)rng_range(1, 4);  // Few letters, so prefixes match
+        }
+        a[len] = '\0';
+
+        // b: a copy of a, maybe changed or cut short
+        u32 b_off = rng() % 8;
+        memcpy(b + b_off, a, len + 1);
+        if (len && rng() % 2) {
+            b[b_off + rng() % len] = (char)rng_range(1, 5);
+        }
+        if (len && rng() % 4 == 0) {
+            b[b_off + rng() % len] = '\0';
+        }
+        check_strings(it, a, b + b_off, len, rng() % (len + 8));
+    }
+    signal(SIGSEGV, SIG_DFL);
+    free(b);
+    munmap(area, 2 * page);
+}
+
+// The allocator against a shadow record of live blocks: every block is
+// filled with its own byte, which must survive until it is freed or
+// reallocated, and the heap must coalesce back once everything is freed
+#define SHADOW_SLOTS 1024
+
+static void fuzz_allocator(u32 iterations) {
+    static u8* ptrs[SHADOW_SLOTS];
+    static u32 sizes[SHADOW_SLOTS];
+    memset(ptrs, 0, sizeof(ptrs));
+
+    for (u32 it = 0; it < iterations; it++) {
+        u32 slot = rng() % SHADOW_SLOTS;
+        u8 tag = (u8)(slot * 7 + 1);
+
+        if (ptrs[slot]) {
+            for (u32 i = 0; i < sizes[slot]; i++) {
+                if (ptrs[slot][i] != tag) {
+                    fail("heap block overwritten", it, sizes[slot], slot, i);
+                    break;
+                }
+            }
+        }
+
+        u32 op = rng() % 3;
+        u32 size = rng_size(0, 14);
+        if (op == 0 && ptrs[slot]) {
+            kfree(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else if (op == 1 && ptrs[slot]) {
+            u8* p = krealloc(ptrs[slot], size);
+            if (!p) {
+                continue;  // The old block is still valid
+            }
+            u32 kept = size < sizes[slot] ? size : sizes[slot];
+            for (u32 i = 0; i < kept; i++) {
+                if (p[i] != tag) {
+                    fail("krealloc lost data", it, size, slot, i);
+                    break;
+                }
+            }
+            ptrs[slot] = p;
+            sizes[slot] = size;
+            memset(p, tag, size);
+        } else if (!ptrs[slot]) {
+            u32 align = rng() % 2 ? 0 : 1u << rng_range(2, 12);
+            u8* p = align ? kmalloc_aligned(size, align) : kmalloc(size);
+            if (!p) {
+                continue;
+            }
+            if (p < pool || p + size > pool + POOL_SIZE) {
+                fail("kmalloc outside the pool", it, size, slot, 0);
+                continue;
+            }
+            if (align && ((size_t)p & (align - 1))) {
+                fail("kmalloc_aligned misaligned", it, size, slot, align);
+            }
+            ptrs[slot] = p;
+            sizes[slot] = size;
+            memset(p, tag, size);
+        }
+    }
+
+    for (u32 i = 0; i < SHADOW_SLOTS; i++) {
+        kfree(ptrs[i]);
+    }
+    if (!pool_restored()) {
+        fail("heap did not coalesce after freeing everything", iterations, 0, 0, 0);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (strcmp(argv[1], "bench") && strcmp(argv[1], "fuzz"))) {
+        fprintf(stderr, "usage: %s bench [seed] | fuzz [seed] [iterations]\n", argv[0]);
+        return 2;
+    }
+    rng_state = argc > 2 ? (u32)strtoul(argv[2], NULL, 0) : 1;
+    if (!rng_state) {
+        rng_state = 1;
+    }
+
+    string_init();
+    pool_init();
+    fprintf(stderr, "hostbench: string variant %s, seed %u\n", string_variant(), rng_state);
+    printf("suite,case,size,align,value,unit\n");
+
+    if (strcmp(argv[1], "bench") == 0) {
+        bench_churn();
+        bench_fragmentation();
+        bench_realloc();
+        bench_throughput();
+        return pool_restored() ? 0 : 1;
+    }
+
+    u32 iterations = argc > 3 ? (u32)strtoul(argv[3], NULL, 0) : 200000;
+    u32 before;
+    for (u32 i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        string_force_variant(variants[i].erms, variants[i].sse2);
+        before = failures;
+        fuzz_memory(iterations);
+        char name[64];
+        snprintf(name, sizeof(name), "memory/%s", string_variant());
+        csv("fuzz", name, iterations, "-", failures - before, "failures");
+    }
+    string_init();
+    before = failures;
+    fuzz_strings(iterations);
+    csv("fuzz", "strings", iterations, "-", failures - before, "failures");
+    before = failures;
+    fuzz_allocator(iterations);
+    csv("fuzz", "allocator", iterations, "-", failures - before, "failures");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Forced into the kernel sources built for the host harness. The kernel's
+// string functions get their own names, so they link alongside libc's and
+// the two can be compared.
+#define memset  kmemset
+#define memcpy  kmemcpy
+#define memmove kmemmove
+#define memcmp  kmemcmp
+#define strlen  kstrlen
+#define strcmp  kstrcmp
+#define strncmp kstrncmp
+#define strcpy  kstrcpy
+
+#endif
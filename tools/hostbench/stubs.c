@@ -0,0 +1,66 @@
+// Stand-ins for the kernel services memory.c and util.c call, for the host
+// harness. Frames come from mmap below 4GB, since the kernel keeps
+// addresses in u32.
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "kernel.h"
+#include "pmm.h"
+#include "paging.h"
+#include "timer.h"
+#include "vga.h"
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+void vga_puts(const char* str) {
+    fputs(str, stderr);
+}
+
+void vga_put_dec(u32 value) {
+    fprintf(stderr, "%u", value);
+}
+
+void vga_put_hex(u32 value) {
+    fprintf(stderr, "0x%08X", value);
+}
+
+// The harness hands memory.c its pool with memory_init_pool()
+void* vmm_reserve(u32 size, u32 flags) {
+    (void)size;
+    (void)flags;
+    return NULL;
+}
+
+u32 pmm_free_frame_count(void) {
+    return 0;
+}
+
+u32 pmm_alloc_frames(u32 count) {
+    void* p = mmap(NULL, count * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    return p == MAP_FAILED ? 0 : (u32)(size_t)p;
+}
+
+void pmm_free_frames(u32 addr, u32 count) {
+    munmap((void*)(size_t)addr, count * PAGE_SIZE);
+}
+
+// Measured once against the monotonic clock
+u32 timer_tsc_per_ms(void) {
+    static u32 tsc_per_ms = 0;
+    if (!tsc_per_ms) {
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        u64 tsc_start = rdtsc();
+        long ns;
+        do {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ns = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+        } while (ns < 20000000L);
+        tsc_per_ms = (u32)((rdtsc() - tsc_start) * 1000000 / ns);
+    }
+    return tsc_per_ms;
+}